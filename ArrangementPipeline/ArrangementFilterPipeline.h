@@ -98,7 +98,8 @@ private:
                             blockHeader->length + sizeof(BlockHeader),
                             arrangementFilterTask->classId,
                             arrangementFilterTask->arrangementVersion,
-                            true);
+                            true,
+                            arrangementFilterTask);
                     GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
                     arcTag = true;
                 } else {
@@ -107,7 +108,8 @@ private:
                             blockHeader->length + sizeof(BlockHeader),
                             arrangementFilterTask->classId,
                             arrangementFilterTask->arrangementVersion,
-                            false);
+                            false,
+                            arrangementFilterTask);
                     GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
                     actTag = true;
                 }
@@ -122,7 +124,7 @@ private:
             }
             assert(readoffset == arrangementFilterTask->length);
 
-            delete arrangementFilterTask;
+            arrangementFilterTask->release();
         }
     }
 
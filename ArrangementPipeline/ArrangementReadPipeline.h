@@ -9,12 +9,13 @@
 #ifndef MEGA_ARRANGEMENTREADPIPELINE_H
 #define MEGA_ARRANGEMENTREADPIPELINE_H
 
+#include <unistd.h>
 #include "ArrangementFilterPipeline.h"
 #include "../Utility/FileOperator.h"
+#include "../Utility/ContainerIndex.h"
+#include "../Utility/ContainerCatalog.h"
 
 extern std::string LogicFilePath;
-extern std::string ClassFilePath;
-extern std::string VersionFilePath;
 extern uint64_t ContainerSize;
 uint64_t ArrangementReadBufferLength = ContainerSize * 1.2;
 
@@ -84,30 +85,41 @@ private:
         }
     }
 
+    // arrangement moves every chunk of the container, it can not go on without them. the write stops before it
+    // commits, and the next write task recovers the store to its last generation.
+    uint8_t *readContainer(const ContainerLocation &location, uint64_t *decompressedSize) {
+        uint8_t *buffer = (uint8_t *) malloc(ArrangementReadBufferLength);
+        uint64_t readSize = GlobalContainerCatalog.read(location, buffer, ArrangementReadBufferLength);
+        uint8_t *decompressedBuffer = (uint8_t *) malloc(ArrangementReadBufferLength);
+        *decompressedSize = 0;
+        if (readSize == location.length) {
+            *decompressedSize = ZSTD_decompress(decompressedBuffer, ArrangementReadBufferLength, buffer, readSize);
+        }
+        free(buffer);
+        if (readSize != location.length || ZSTD_isError(*decompressedSize)) {
+            printf("Container in Segment%lu at %lu can not be read, arrangement stops before the version commits\n",
+                   location.segment, location.offset);
+            fflush(stdout);
+            _exit(1);
+        }
+        readAmount += readSize;
+        return decompressedBuffer;
+    }
+
     uint64_t readClass(uint64_t classId, uint64_t versionId) {
         uint64_t cid = 0;
         while (1) {
-            char pathbuffer[512];
-            sprintf(pathbuffer, ClassFilePath.data(), classId, versionId, cid);
-            FileOperator classFile((char *) pathbuffer, FileOpenType::TRY);
-            if (!classFile.ok()) {
+            ContainerLocation location;
+            if (!GlobalContainerCatalog.locate(ContainerKind::Active, classId, versionId, cid, &location)) {
                 break;
             }
-            uint8_t *buffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t readSize = classFile.read(buffer, ArrangementReadBufferLength);
-
-            uint8_t *decompressedBuffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t decompressedSize = ZSTD_decompress(decompressedBuffer, ArrangementReadBufferLength, buffer,
-                                                        readSize);
-            assert(!ZSTD_isError(decompressedSize));
-            free(buffer);
-
-            readAmount += readSize;
+            uint64_t decompressedSize;
+            uint8_t *decompressedBuffer = readContainer(location, &decompressedSize);
             ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(decompressedBuffer,
                                                                                      decompressedSize, classId,
                                                                                      versionId);
             GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
-            remove(pathbuffer);
+            GlobalContainerCatalog.remove(ContainerKind::Active, classId, versionId, cid);
             cid++;
         }
         printf("Read %lu containers from Cat.(%lu,%lu)\n", cid + 1, classId, versionId);
@@ -120,54 +132,34 @@ private:
     uint64_t readClassWithAppend(uint64_t classId, uint64_t versionId) {
         uint64_t cid = 0;
         while (1) {
-            char pathbuffer[512];
-            sprintf(pathbuffer, ClassFilePath.data(), classId, versionId, cid);
-            FileOperator classFile((char *) pathbuffer, FileOpenType::TRY);
-            if (!classFile.ok()) {
+            ContainerLocation location;
+            if (!GlobalContainerCatalog.locate(ContainerKind::Active, classId, versionId, cid, &location)) {
                 break;
             }
-            uint8_t *buffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t readSize = classFile.read(buffer, ArrangementReadBufferLength);
-
-            uint8_t *decompressedBuffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t decompressedSize = ZSTD_decompress(decompressedBuffer, ArrangementReadBufferLength, buffer,
-                                                        readSize);
-            assert(!ZSTD_isError(decompressedSize));
-            free(buffer);
-
-            readAmount += readSize;
+            uint64_t decompressedSize;
+            uint8_t *decompressedBuffer = readContainer(location, &decompressedSize);
             ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(decompressedBuffer,
                                                                                      decompressedSize, classId,
                                                                                      versionId);
             GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
-            remove(pathbuffer);
+            GlobalContainerCatalog.remove(ContainerKind::Active, classId, versionId, cid);
             cid++;
         }
       printf("Read %lu containers from Cat.(%lu,%lu)\n", cid, classId, versionId);
 
         cid = 0;
         while (1) {
-            char pathbuffer[512];
-            sprintf(pathbuffer, ClassFileAppendPath.data(), classId, versionId, cid);
-            FileOperator classFile((char *) pathbuffer, FileOpenType::TRY);
-            if (!classFile.ok()) {
+            ContainerLocation location;
+            if (!GlobalContainerCatalog.locate(ContainerKind::Append, classId, versionId, cid, &location)) {
                 break;
             }
-            uint8_t *buffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t readSize = classFile.read(buffer, ArrangementReadBufferLength);
-
-            uint8_t *decompressedBuffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t decompressedSize = ZSTD_decompress(decompressedBuffer, ArrangementReadBufferLength, buffer,
-                                                        readSize);
-            assert(!ZSTD_isError(decompressedSize));
-            free(buffer);
-
-            readAmount += readSize;
+            uint64_t decompressedSize;
+            uint8_t *decompressedBuffer = readContainer(location, &decompressedSize);
             ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(decompressedBuffer,
                                                                                      decompressedSize, classId,
                                                                                      versionId);
             GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
-            remove(pathbuffer);
+            GlobalContainerCatalog.remove(ContainerKind::Append, classId, versionId, cid);
             cid++;
         }
       printf("Read %lu containers from Cat.(%lu,%lu)_append\n", cid, classId, versionId);
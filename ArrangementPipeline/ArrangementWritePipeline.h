@@ -18,6 +18,8 @@
 #include <sys/time.h>
 #include "gflags/gflags.h"
 #include "../Utility/BufferedFileWriter.h"
+#include "../Utility/ContainerIndex.h"
+#include "../Utility/ContainerCatalog.h"
 
 extern uint64_t ContainerSize;
 uint64_t ArrangementFlushBufferLength = ContainerSize * 1.2;
@@ -42,10 +44,17 @@ public:
     }
 
 private:
+    void flush(WriteBuffer &writeBuffer, ContainerKind kind, uint64_t category, uint64_t version, uint64_t cid) {
+        size_t compressedSize = ZSTD_compress(writeBuffer.compressBuffer, ArrangementFlushBufferLength,
+                                              writeBuffer.buffer, writeBuffer.used, ZSTD_CLEVEL_DEFAULT);
+        assert(!ZSTD_isError(compressedSize));
+        GlobalContainerCatalog.append(kind, category, version, cid, writeBuffer.compressBuffer, compressedSize,
+                                      writeBuffer.buffer, writeBuffer.used);
+    }
+
     void arrangementWriteCallback(){
         pthread_setname_np(pthread_self(), "AWriting Thread");
         ArrangementWriteTask *arrangementWriteTask;
-        char pathBuffer[256];
         uint64_t currentVersion = 0;
         uint64_t classIter = 0;
         while (likely(runningFlag)) {
@@ -65,46 +74,24 @@ private:
                 currentVersion = arrangementWriteTask->arrangementVersion;
                 classIter = 0;
 
-                sprintf(pathBuffer, VersionFilePath.data(), classIter + 1, currentVersion, archiveCID);
-                archivedFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
                 archivedBuffer.init();
-
-                sprintf(pathBuffer, ClassFilePath.data(), classIter + 1, currentVersion + 1, activeCID);
-                activeFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
                 activeBuffer.init();
+                delete arrangementWriteTask;
             } else if (arrangementWriteTask->classEndFlag) {
                 classIter++;
 
                 delete arrangementWriteTask;
 
                 //====================================
-                size_t compressedSize = ZSTD_compress(archivedBuffer.compressBuffer, ArrangementFlushBufferLength,
-                                                      archivedBuffer.buffer, archivedBuffer.used, ZSTD_CLEVEL_DEFAULT);
-                assert(!ZSTD_isError(compressedSize));
-                archivedFileOperator->write(archivedBuffer.compressBuffer, compressedSize);
-                archivedFileOperator->fsync();
-                delete archivedFileOperator;
-                archivedFileOperator = nullptr;
-
-                compressedSize = ZSTD_compress(activeBuffer.compressBuffer, ArrangementFlushBufferLength,
-                                               activeBuffer.buffer, activeBuffer.used, ZSTD_CLEVEL_DEFAULT);
-                assert(!ZSTD_isError(compressedSize));
-                activeFileOperator->write(activeBuffer.compressBuffer, compressedSize);
-                activeFileOperator->fsync();
-                delete activeFileOperator;
-                activeFileOperator = nullptr;
+                flush(archivedBuffer, ContainerKind::Archived, classIter, currentVersion, archiveCID);
+                flush(activeBuffer, ContainerKind::Active, classIter, currentVersion + 1, activeCID);
                 //====================================
 
                 activeCID = 0;
                 archiveCID = 0;
 
                 if (classIter < currentVersion) {
-                    sprintf(pathBuffer, VersionFilePath.data(), classIter + 1, currentVersion, archiveCID);
-                    archivedFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
                     archivedBuffer.clear();
-
-                    sprintf(pathBuffer, ClassFilePath.data(), classIter + 1, currentVersion + 1, activeCID);
-                    activeFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
                     activeBuffer.clear();
                 }
                 continue;
@@ -128,21 +115,12 @@ private:
             } else if (arrangementWriteTask->isArchived) {
                 archivedBuffer.write(arrangementWriteTask->writeBuffer, arrangementWriteTask->length);
                 if (archivedBuffer.used >= ContainerSize) {
-                    size_t compressedSize = ZSTD_compress(archivedBuffer.compressBuffer, ArrangementFlushBufferLength,
-                                                          archivedBuffer.buffer, archivedBuffer.used,
-                                                          ZSTD_CLEVEL_DEFAULT);
-                    assert(!ZSTD_isError(compressedSize));
-                    archivedFileOperator->write(archivedBuffer.compressBuffer, compressedSize);
-                    archivedFileOperator->fsync();
-                    delete archivedFileOperator;
-                    archivedFileOperator = nullptr;
-
+                    flush(archivedBuffer, ContainerKind::Archived, classIter + 1, currentVersion, archiveCID);
                     archiveCID++;
-                    sprintf(pathBuffer, VersionFilePath.data(), classIter + 1, currentVersion, archiveCID);
-                    archivedFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
                     archivedBuffer.clear();
                 }
                 archivedChunks++;
+                delete arrangementWriteTask;
             } else {
                 BlockHeader *bhPtr = (BlockHeader *) arrangementWriteTask->writeBuffer;
                 activeBuffer.write(arrangementWriteTask->writeBuffer, arrangementWriteTask->length);
@@ -154,20 +132,12 @@ private:
                              arrangementWriteTask->length - sizeof(BlockHeader)});
                 }
                 if (activeBuffer.used >= ContainerSize) {
-                    size_t compressedSize = ZSTD_compress(activeBuffer.compressBuffer, ArrangementFlushBufferLength,
-                                                          activeBuffer.buffer, activeBuffer.used, ZSTD_CLEVEL_DEFAULT);
-                    assert(!ZSTD_isError(compressedSize));
-                    activeFileOperator->write(activeBuffer.compressBuffer, compressedSize);
-                    activeFileOperator->fsync();
-                    delete activeFileOperator;
-                    activeFileOperator = nullptr;
-
+                    flush(activeBuffer, ContainerKind::Active, classIter + 1, currentVersion + 1, activeCID);
                     activeCID++;
-                    sprintf(pathBuffer, ClassFilePath.data(), classIter + 1, currentVersion + 1, activeCID);
-                    activeFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
                     activeBuffer.clear();
                 }
                 activeChunks++;
+                delete arrangementWriteTask;
             }
         }
     }
@@ -179,10 +149,6 @@ private:
     MutexLock mutexLock;
     Condition condition;
 
-    FileOperator *archivedFileOperator = nullptr;
-
-    FileOperator *activeFileOperator = nullptr;
-
     uint64_t activeCID = 0;
     uint64_t archiveCID = 0;
 
@@ -10,7 +10,8 @@
 #define MEGA_CHUNKINGPIPELINE_H
 
 #include <sys/time.h>
-#include "../RollHash/Gear.h"
+#include "../RollHash/FastCDC.h"
+#include "../RollHash/ChunkingProfile.h"
 #include "../RollHash/Rabin.h"
 #include "gflags/gflags.h"
 #include <thread>
@@ -18,11 +19,9 @@
 #include "openssl/sha.h"
 #include "HashingPipeline.h"
 #include "../RollHash/rabin_chunking.h"
-
-DEFINE_string(ChunkingMethod,
-              "FastCDC", "chunking method in chunking");
-DEFINE_int32(ExpectSize,
-             8192, "average chunk size");
+#include "../Utility/Metrics.h"
+#include "../Utility/Trace.h"
+#include "../Utility/xxhash.h"
 
 class ChunkingPipeline {
 public:
@@ -30,18 +29,22 @@ public:
             : taskAmount(0),
               runningFlag(true),
               mutexLock(),
-              condition(mutexLock) {
-        if (FLAGS_ChunkingMethod == std::string("FastCDC")) {
-            rollHash = new Gear();
-            matrix = rollHash->getMatrix();
+              condition(mutexLock),
+              queueMetrics("chunking") {
+        chunkLatency = GlobalMetrics.histogram("chunking_chunk_latency_ns");
+        chunkBytes = GlobalMetrics.counter("chunking_bytes_total");
+        const ChunkingProfile &profile = GlobalChunkingProfile;
+        ExpectSize = profile.expectSize;
+        MaxChunkSize = profile.maxSize;
+        MinChunkSize = profile.minSize;
+        if (profile.method == (uint64_t) ChunkingMethodType::FastCDC) {
+            fastCDC = new FastCDC(ExpectSize, MinChunkSize, MaxChunkSize, profile.normalLevel);
             worker = new std::thread(std::bind(&ChunkingPipeline::chunkingWorkerCallbackFastCDC, this));
-        } else if (FLAGS_ChunkingMethod == std::string("Rabin")) {
+        } else if (profile.method == (uint64_t) ChunkingMethodType::Rabin) {
             worker = new std::thread(std::bind(&ChunkingPipeline::chunkingWorkerCallbackRabin, this));
-        } else if (FLAGS_ChunkingMethod == std::string("Fixed")) {
+        } else if (profile.method == (uint64_t) ChunkingMethodType::Fixed) {
             worker = new std::thread(std::bind(&ChunkingPipeline::chunkingWorkerCallbackFixed, this));
         }
-        MaxChunkSize = FLAGS_ExpectSize * 8;
-        MinChunkSize = FLAGS_ExpectSize / 4;
 
         printf("ChunkingPipeline inited, Max chunk size=%d, Min chunk size=%d\n", MaxChunkSize, MinChunkSize);
     }
@@ -50,6 +53,7 @@ public:
         MutexLockGuard mutexLockGuard(mutexLock);
         taskList.push_back(chunkTask);
         taskAmount++;
+        queueMetrics.push(taskAmount);
         condition.notify();
     }
 
@@ -58,7 +62,7 @@ public:
     }
 
     ~ChunkingPipeline() {
-        delete rollHash;
+        delete fastCDC;
         runningFlag = false;
         condition.notifyAll();
         worker->join();
@@ -74,17 +78,6 @@ private:
         uint64_t posPtr = 0;
         uint64_t base = 0;
 
-        if (FLAGS_ExpectSize == 8192) {
-            chunkMask = 0x0000d90f03530000;//32
-            chunkMask2 = 0x0000d90003530000;//2
-        } else if (FLAGS_ExpectSize == 4096) {
-            chunkMask = 0x0000d90703530000;//16
-            chunkMask2 = 0x0000590003530000;//1
-        } else if (FLAGS_ExpectSize == 16384) {
-            chunkMask = 0x0000d90f13530000;//64
-            chunkMask2 = 0x0000d90103530000;//4
-        }
-
         uint64_t counter = 0;
         uint8_t *data = nullptr;
         DedupTask dedupTask;
@@ -101,15 +94,19 @@ private:
         while (runningFlag) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
+                uint64_t waitStart = queueMetrics.waitBegin();
                 while (!taskAmount) {
                     condition.wait();
                     if (unlikely(!runningFlag)) break;
                 }
                 if (unlikely(!runningFlag)) continue;
+                queueMetrics.waitEnd(waitStart);
                 taskAmount--;
+                queueMetrics.pop(taskAmount);
                 chunkTask = taskList.front();
                 taskList.pop_front();
             }
+            lastEmit = MonotonicNow();
 
             if (unlikely(newFileFlag)) {
                 posPtr = 0;
@@ -129,19 +126,19 @@ private:
             gettimeofday(&t0, NULL);
             if (likely(!chunkTask.countdownLatch)) {
                 while (end - posPtr > MaxChunkSize) {
-                    int chunkSize = fastcdc_chunk_data(data + posPtr, end - posPtr);
+                    int chunkSize = fastCDC->chunk(data + posPtr, end - posPtr);
                     dedupTask.pos = base;
                     dedupTask.length = chunkSize;
                     dedupTask.index++;
 
-                    GlobalHashingPipelinePtr->addTask(dedupTask);
+                    emitChunk(dedupTask);
 
                     base += chunkSize;
                     posPtr += chunkSize;
                 }
             } else {
                 while (end != posPtr) {
-                    int chunkSize = fastcdc_chunk_data(data + posPtr, end - posPtr);
+                    int chunkSize = fastCDC->chunk(data + posPtr, end - posPtr);
                     dedupTask.pos = base;
                     dedupTask.length = chunkSize;
                     dedupTask.index++;
@@ -150,14 +147,14 @@ private:
                         flag = true;
                     }
 
-                    GlobalHashingPipelinePtr->addTask(dedupTask);
+                    emitChunk(dedupTask);
 
                     base += chunkSize;
                     posPtr += chunkSize;
                 }
             }
             if (unlikely(flag)) {
-                chunkTask.countdownLatch->countDown();
+                finishVersion(chunkTask);
                 printf("ChunkingPipeline finish\n");
                 newFileFlag = true;
                 dedupTask.countdownLatch = nullptr;
@@ -179,7 +176,7 @@ private:
         uint64_t fp = 0;
         const uint64_t chunkMask = 0x0000d90f03530000;
         const uint64_t chunkMask2 = 0x0000d90003530000;
-        uint64_t rabinMask = FLAGS_ExpectSize - 1;
+        uint64_t rabinMask = ExpectSize - 1;
         uint64_t counter = 0;
         uint8_t *data = nullptr;
         DedupTask dedupTask;
@@ -196,15 +193,19 @@ private:
         while (runningFlag) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
+                uint64_t waitStart = queueMetrics.waitBegin();
                 while (!taskAmount) {
                     condition.wait();
                     if (!runningFlag) break;
                 }
                 if (!runningFlag) continue;
+                queueMetrics.waitEnd(waitStart);
                 taskAmount--;
+                queueMetrics.pop(taskAmount);
                 chunkTask = taskList.front();
                 taskList.pop_front();
             }
+            lastEmit = MonotonicNow();
 
             gettimeofday(&t0, NULL);
 
@@ -236,7 +237,7 @@ private:
                         n++;
 
 
-                        GlobalHashingPipelinePtr->addTask(dedupTask);
+                        emitChunk(dedupTask);
 
                         base = posPtr + 1;
                         posPtr += MinChunkSize;
@@ -255,7 +256,7 @@ private:
                         cs += posPtr - base + 1;
                         n++;
 
-                        GlobalHashingPipelinePtr->addTask(dedupTask);
+                        emitChunk(dedupTask);
 
                         base = posPtr + 1;
                         posPtr += MinChunkSize;
@@ -270,9 +271,9 @@ private:
 
                     dedupTask.countdownLatch = chunkTask.countdownLatch;
 
-                    GlobalHashingPipelinePtr->addTask(dedupTask);
+                    emitChunk(dedupTask);
                 }
-                chunkTask.countdownLatch->countDown();
+                finishVersion(chunkTask);
                 newFileFlag = true;
                 dedupTask.countdownLatch = nullptr;
             }
@@ -283,34 +284,27 @@ private:
 
     }
 
-    int fastcdc_chunk_data(unsigned char *p, uint64_t n) {
-
-        uint64_t fingerprint = 0, digest;
-        int i = MinChunkSize, Mid = MinChunkSize + FLAGS_ExpectSize;
-        //return n;
+    // the latency of a chunk is the time spent finding its cut point since the previous one.
+    void emitChunk(const DedupTask &dedupTask) {
+        uint64_t now = MonotonicNow();
+        chunkLatency->record(now - lastEmit);
+        chunkBytes->add(dedupTask.length);
+        TRACE_COMPLETE("chunking", lastEmit, dedupTask.index, dedupTask.fileID);
+        lastEmit = now;
+        digest += XXH64(dedupTask.buffer + dedupTask.pos, dedupTask.length, digestPos);
+        digestPos += dedupTask.length;
+        GlobalHashingPipelinePtr->addTask(dedupTask);
+    }
 
-        if (n <= MinChunkSize) //the minimal  subChunk Size.
-            return n;
-        //windows_reset();
-        if (n > MaxChunkSize)
-            n = MaxChunkSize;
-        else if (n < Mid)
-            Mid = n;
-        while (i < Mid) {
-            fingerprint = (fingerprint << 1) + (matrix[p[i]]);
-            if ((!(fingerprint & chunkMask))) { //AVERAGE*2, *4, *8
-                return i;
-            }
-            i++;
-        }
-        while (i < n) {
-            fingerprint = (fingerprint << 1) + (matrix[p[i]]);
-            if ((!(fingerprint & chunkMask2))) { //Average/2, /4, /8
-                return i;
-            }
-            i++;
+    // the digest of a version is the sum of the XXH64 of its chunks, each seeded by its position, so a restore
+    // adds up the chunks it writes whatever order they come in.
+    void finishVersion(const ChunkTask &chunkTask) {
+        if (chunkTask.digest) {
+            *chunkTask.digest = digest;
         }
-        return i;
+        digest = 0;
+        digestPos = 0;
+        chunkTask.countdownLatch->countDown();
     }
 
     void chunkingWorkerCallbackFixed() {
@@ -333,14 +327,18 @@ private:
         while (runningFlag) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
+                uint64_t waitStart = queueMetrics.waitBegin();
                 while (!taskAmount) {
                     condition.wait();
                     if (!runningFlag) return;
                 }
+                queueMetrics.waitEnd(waitStart);
                 taskAmount--;
+                queueMetrics.pop(taskAmount);
                 chunkTask = taskList.front();
                 taskList.pop_front();
             }
+            lastEmit = MonotonicNow();
 
             if (newFileFlag) {
                 posPtr = 0;
@@ -361,7 +359,7 @@ private:
                     dedupTask.pos = base;
                     dedupTask.length = chunkSize;
                     dedupTask.index++;
-                    GlobalHashingPipelinePtr->addTask(dedupTask);
+                    emitChunk(dedupTask);
                     base += chunkSize;
                     posPtr += chunkSize;
                 }
@@ -375,13 +373,13 @@ private:
                         dedupTask.countdownLatch = chunkTask.countdownLatch;
                         flag = true;
                     }
-                    GlobalHashingPipelinePtr->addTask(dedupTask);
+                    emitChunk(dedupTask);
                     base += chunkSize;
                     posPtr += chunkSize;
                 }
             }
             if (flag) {
-                chunkTask.countdownLatch->countDown();
+                finishVersion(chunkTask);
                 newFileFlag = true;
                 dedupTask.countdownLatch = nullptr;
             }
@@ -390,18 +388,18 @@ private:
     }
 
     int fix_chunk_data(unsigned char *p, uint64_t n) {
-        return FLAGS_ExpectSize;
+        return ExpectSize;
     }
 
     int fix_chunk_data_end(unsigned char *p, uint64_t n) {
-        if (n < FLAGS_ExpectSize) {
+        if (n < ExpectSize) {
             return n;
         } else {
-            return FLAGS_ExpectSize;
+            return ExpectSize;
         }
     }
 
-    RollHash *rollHash;
+    FastCDC *fastCDC = nullptr;
     Rabin rollHashRabin;
     std::thread *worker;
     std::list <ChunkTask> taskList;
@@ -409,14 +407,20 @@ private:
     bool runningFlag;
     MutexLock mutexLock;
     Condition condition;
-    uint64_t *matrix;
     uint64_t duration = 0;
     uint64_t order = 0;
-    uint64_t chunkMask;
-    uint64_t chunkMask2;
 
+    uint64_t digest = 0;
+    uint64_t digestPos = 0;
+
+    int ExpectSize;
     int MaxChunkSize;
     int MinChunkSize;
+
+    QueueMetrics queueMetrics;
+    MetricsHistogram *chunkLatency;
+    MetricsCounter *chunkBytes;
+    uint64_t lastEmit = 0;
 };
 
 static ChunkingPipeline *GlobalChunkingPipelinePtr;
@@ -17,11 +17,8 @@
 #include "../Utility/Likely.h"
 #include "../xdelta/xdelta3.h"
 #include "../Utility/BaseCache.h"
-
-struct BaseChunkPositions {
-    uint64_t category: 22;
-    uint64_t quantizedOffset: 42;
-};
+#include "../Utility/Metrics.h"
+#include "../Utility/Trace.h"
 
 DEFINE_uint64(DeltaSelectorThreshold,
               10, "DeltaSelectorThreshold");
@@ -35,7 +32,11 @@ public:
             : taskAmount(0),
               runningFlag(true),
               mutexLock(),
-              condition(mutexLock) {
+              condition(mutexLock),
+              queueMetrics("dedup") {
+        chunkLatency = GlobalMetrics.histogram("dedup_chunk_latency_ns");
+        deltaLatency = GlobalMetrics.histogram("dedup_delta_encode_latency_ns");
+        dedupBytes = GlobalMetrics.counter("dedup_bytes_total");
         worker = new std::thread(std::bind(&DeduplicationPipeline::deduplicationWorkerCallback, this));
 
     }
@@ -44,9 +45,20 @@ public:
         MutexLockGuard mutexLockGuard(mutexLock);
         receiveList.push_back(dedupTask);
         taskAmount++;
+        queueMetrics.push(taskAmount);
+        TRACE_INSTANT("dedup_enqueue", dedupTask.index, dedupTask.fileID);
         condition.notifyAll();
     }
 
+    // a version starts deduplication only after it is allowed, i.e. the previous one is arranged and its index
+    // rolled, so the stages in front of dedup may already work on it.
+    int allowVersion() {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        allowedVersions++;
+        condition.notifyAll();
+        return 0;
+    }
+
     ~DeduplicationPipeline() {
         runningFlag = false;
         condition.notifyAll();
@@ -59,6 +71,7 @@ public:
       printf("Unique:%lu, Internal:%lu, Adjacent:%lu, Delta:%lu, Reject:%lu\n", chunkCounter[0], chunkCounter[1],
              chunkCounter[2], chunkCounter[3], cappingReject);
       printf("xdeltaError:%lu\n", xdeltaError);
+      containerCache.statistics();
 //        printf("Total Length : %lu, AfterDedup : %lu, AfterDelta: %lu, DedupRatio : %f, DeltaRatio : %f\n",
 //               totalLength, afterDedup, afterDelta, (float) totalLength / afterDedup, (float) totalLength / afterDelta);
       GlobalMetadataManagerPtr->setTotalLength(totalLength);
@@ -80,28 +93,38 @@ private:
         while (likely(runningFlag)) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
+                uint64_t waitStart = queueMetrics.waitBegin();
                 while (!taskAmount) {
                     condition.wait();
                     if (unlikely(!runningFlag)) return;
                 }
+                queueMetrics.waitEnd(waitStart);
                 //printf("get task\n");
                 taskAmount = 0;
+                queueMetrics.pop(0);
                 taskList.swap(receiveList);
             }
-
-            if (newVersionFlag) {
-                for (int i = 0; i < 4; i++) {
-                    chunkCounter[i] = 0;
-                }
-                newVersionFlag = false;
-                gettimeofday(&initTime, NULL);
-                duration = 0;
-                if(!taskList.empty()){
-                    baseCache.setCurrentVersion(taskList.begin()->fileID);
-                }
-            }
+            TRACE_INSTANT("dedup_dequeue", taskList.size(), taskList.front().fileID);
 
             for (const auto &dedupTask : taskList) {
+                if (newVersionFlag) {
+                    // the list may hold the tail of one version and the head of the next one.
+                    {
+                        MutexLockGuard mutexLockGuard(mutexLock);
+                        while (startedVersions >= allowedVersions) {
+                            condition.wait();
+                            if (unlikely(!runningFlag)) return;
+                        }
+                        startedVersions++;
+                    }
+                    for (int i = 0; i < 4; i++) {
+                        chunkCounter[i] = 0;
+                    }
+                    newVersionFlag = false;
+                    gettimeofday(&initTime, NULL);
+                    duration = 0;
+                    baseCache.setCurrentVersion(dedupTask.fileID);
+                }
                 detectList.push_back(dedupTask);
                 segmentLength += dedupTask.length;
                 if (segmentLength > SegmentThreshold || dedupTask.countdownLatch) {
@@ -123,6 +146,7 @@ private:
         BasePos tempBasePos;
         BlockEntry tempBlockEntry;
         for (auto &entry: dl) {
+            TRACE_SPAN("lookup", entry.index, entry.fileID);
 
             FPTableEntry fpTableEntry;
             LookupResult lookupResult = GlobalMetadataManagerPtr->dedupLookup(entry.fp, entry.length, &fpTableEntry);
@@ -185,6 +209,9 @@ private:
                 bcp->quantizedOffset = entry.basePos.cid;
                 if (baseChunkPositions[key] == 0) {
                     entry.deltaReject = true;
+                } else {
+                    // start loading the selected base containers in the order doDedup will ask for them.
+                    baseCache.prefetch(entry.basePos);
                 }
             }
         }
@@ -198,6 +225,7 @@ private:
 
         for (auto &entry: dl) {
             gettimeofday(&t0, NULL);
+            uint64_t c0 = MonotonicNow();
             memset(&writeTask, 0, sizeof(WriteTask));
 
             FPTableEntry fpTableEntry;
@@ -233,24 +261,30 @@ private:
                         } else {
                             baseCache.loadBaseChunks(entry.basePos);
                             r = baseCache.getRecordNoFS(&entry.basePos, &tempBlockEntry);
-                            assert(r);
+                            if (!r) {
+                                // the base can not be read, the chunk is stored as it is.
+                                goto unique;
+                            }
                         }
                     }
 
                     // calculate delta
-                    uint8_t *tempBuffer = (uint8_t *) malloc(65536);
+                    uint8_t *tempBuffer = GlobalWriteFilePipelinePtr->getDeltaBuffer();
                     usize_t deltaSize;
                     gettimeofday(&dt1, NULL);
+                    uint64_t d0 = MonotonicNow();
 
                     r = xd3_encode_memory(entry.buffer + entry.pos, entry.length,
                                           tempBlockEntry.block, tempBlockEntry.length, tempBuffer, &deltaSize,
                                           entry.length, XD3_COMPLEVEL_1 | XD3_NOCOMPRESS);
                     gettimeofday(&dt2, NULL);
                     deltaTime += (dt2.tv_sec - dt1.tv_sec) * 1000000 + dt2.tv_usec - dt1.tv_usec;
+                    deltaLatency->record(MonotonicNow() - d0);
+                    TRACE_COMPLETE("delta_encode", d0, entry.index, entry.fileID);
 
                     if (r != 0 || deltaSize >= entry.length) {
                         // no delta
-                        free(tempBuffer);
+                        GlobalWriteFilePipelinePtr->putDeltaBuffer(tempBuffer);
                         xdeltaError++;
                         goto unique;
                     } else {
@@ -332,6 +366,9 @@ private:
 
             gettimeofday(&t1, NULL);
             duration += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
+            chunkLatency->record(MonotonicNow() - c0);
+            dedupBytes->add(entry.length);
+            TRACE_COMPLETE("dedup", c0, entry.index, entry.fileID);
 
             if (unlikely(entry.countdownLatch)) {
                 printf("DedupPipeline finish\n");
@@ -351,6 +388,7 @@ private:
             writeTask.countdownLatch = nullptr;
 
         }
+        baseCache.resetPrefetch();
 
     }
 
@@ -380,6 +418,13 @@ private:
     uint64_t cappingReject = 0;
 
     bool newVersionFlag = true;
+    uint64_t allowedVersions = 0;
+    uint64_t startedVersions = 0;
+
+    QueueMetrics queueMetrics;
+    MetricsHistogram *chunkLatency;
+    MetricsHistogram *deltaLatency;
+    MetricsCounter *dedupBytes;
 };
 
 static DeduplicationPipeline *GlobalDeduplicationPipelinePtr;
@@ -9,10 +9,7 @@
 #ifndef MEGA_ELIMINATOR_H
 #define MEGA_ELIMINATOR_H
 
-extern std::string LogicFilePath;
-extern std::string ClassFilePath;
-extern std::string VersionFilePath;
-extern std::string ClassFileAppendPath;
+#include "../Utility/ContainerCatalog.h"
 
 class Eliminator {
 public:
@@ -23,157 +20,66 @@ public:
     int run(uint64_t maxVersion) {
         printf("start to eliminate\n");
 
-        printf("delete invalid categories\n");
-      versionFileDeleter(1);
+        printf("rewriting catalog\n");
+        std::vector<ContainerLocation> dropList;
+        catalogProcessor(maxVersion, dropList);
+        GlobalContainerCatalog.rollRecipes();
 
-        printf("processing categories files\n");
-        activeFileCombinationProcessor(1, 2, maxVersion);
-        for (uint64_t i = 3; i <= maxVersion; i++) {
-            classFileProcessor(i, maxVersion);
-        }
-
-        printf("processing volume files\n");
-        for (uint64_t i = 2; i <= maxVersion - 1; i++) {
-            archivedFileCombinationProcessor(1, 2, i);
-            versionFileProcessor(i);
-        }
+        // they are deleted once the next generation is committed, until then the last one still refers to them.
+        printf("release invalid categories and the earliest recipe\n");
+        GlobalContainerCatalog.release(dropList);
+        printf("%lu containers released\n", (uint64_t) dropList.size());
 
-        printf("processing recipe files\n");
-        for (uint64_t i = 2; i <= maxVersion; i++) {
-            recipeFilesProcessor(i);
-        }
         GlobalMetadataManagerPtr->similarityTableMerge();
         printf("Similarity Feature Tables have been updated..\n");
         printf("finish, the earliest version has been eliminated..\n");
     }
 
 private:
-    int recipeFilesProcessor(uint64_t recipeId) {
-        // rolling back serial number of recipes
-        sprintf(oldPath, LogicFilePath.data(), recipeId);
-        sprintf(newPath, LogicFilePath.data(), recipeId - 1);
-        rename(oldPath, newPath);
-
-        return 0;
-    }
-
-    int versionFileProcessor(uint64_t versionId) {
-        // append first two archived categories in volumes.
-
-        for (int i = 3; i <= versionId; i++) {
-            uint64_t cid = 0;
-            while (1) {
-                sprintf(oldPath, VersionFilePath.data(), i, versionId, cid);
-                FileOperator fileOperator(oldPath, FileOpenType::TRY);
-                if (!fileOperator.ok()) {
-                    break;
-                }
-                sprintf(newPath, VersionFilePath.data(), i - 1, versionId - 1, cid);
-                rename(oldPath, newPath);
-                cid++;
+    // rolls back serial numbers of categories and volumes in the catalog, the containers stay where they are.
+    // the first volume is dropped, the first two active categories are combined (the second one becomes the
+    // append part of the first), so are the first two archived categories of every volume.
+    int catalogProcessor(uint64_t maxVersion, std::vector<ContainerLocation> &dropList) {
+        CatalogMap oldEntries = GlobalContainerCatalog.getEntries();
+        CatalogMap newEntries;
+        std::vector<std::pair<CatalogKey, ContainerLocation>> keptList;
+
+        for (const auto &entry: oldEntries) {
+            CatalogKey key = entry.first;
+            if (key.kind == ContainerKind::Archived && key.version == 1 && key.category == 1) {
+                dropList.push_back(entry.second);
+                continue;
             }
-        }
-
-        return 0;
-    }
-
-    int versionFileDeleter(uint64_t versionId) {
-        for (int i = 1; i <= versionId; i++) {
-            uint64_t cid = 0;
-            while (1) {
-                sprintf(oldPath, VersionFilePath.data(), i, versionId, cid);
-                {
-                    FileOperator fileOperator(oldPath, FileOpenType::TRY);
-                    if (!fileOperator.ok()) {
-                        break;
-                    }
+            if (key.kind == ContainerKind::Active && key.version == maxVersion) {
+                if (key.category == 2) {
+                    key = {ContainerKind::Append, 1, maxVersion - 1, key.cid};
+                } else {
+                    key = {ContainerKind::Active, key.category > 1 ? key.category - 1 : 1, maxVersion - 1, key.cid};
                 }
-                remove(oldPath);
-                cid++;
-            }
-        }
-        return 0;
-    }
-
-    int classFileProcessor(uint64_t classId, uint64_t maxVersion) {
-        // rolling back serial number of categories
-        uint64_t cid = 0;
-        while (1) {
-            sprintf(oldPath, ClassFilePath.data(), classId, maxVersion, cid);
-            FileOperator fileOperator(oldPath, FileOpenType::TRY);
-            if (!fileOperator.ok()) {
-                break;
-            }
-            sprintf(newPath, ClassFilePath.data(), classId - 1, maxVersion - 1, cid);
-            rename(oldPath, newPath);
-            cid++;
-        }
-        return 0;
-    }
-
-    int activeFileCombinationProcessor(uint64_t classId1, uint64_t classId2, uint64_t maxVersion) {
-        // rolling back serial number of categories
-        // append first two active categories.
-        uint64_t cid = 0;
-        while (1) {
-            sprintf(oldPath, ClassFilePath.data(), classId1, maxVersion, cid);
-            FileOperator fileOperator(oldPath, FileOpenType::TRY);
-            if (!fileOperator.ok()) {
-                break;
-            }
-            sprintf(newPath, ClassFilePath.data(), classId1, maxVersion - 1, cid);
-            rename(oldPath, newPath);
-            cid++;
-        }
-
-        cid = 0;
-        while (1) {
-            sprintf(oldPath, ClassFilePath.data(), classId2, maxVersion, cid);
-            FileOperator fileOperator(oldPath, FileOpenType::TRY);
-            if (!fileOperator.ok()) {
-                break;
-            }
-            sprintf(newPath, ClassFileAppendPath.data(), classId1, maxVersion - 1, cid);
-            rename(oldPath, newPath);
-            cid++;
-        }
-
-        return 0;
-    }
-
-    int archivedFileCombinationProcessor(uint64_t classId1, uint64_t classId2, uint64_t version) {
-        // rolling back serial number of categories
-        // append first two active categories.
-        uint64_t cid = 0;
-        while (1) {
-            sprintf(oldPath, VersionFilePath.data(), classId1, version, cid);
-            FileOperator fileOperator(oldPath, FileOpenType::TRY);
-            if (!fileOperator.ok()) {
-                break;
+            } else if (key.kind == ContainerKind::Archived && key.version >= 2 && key.version <= maxVersion - 1) {
+                if (key.category == 2) {
+                    uint64_t offset = GlobalContainerCatalog.count(ContainerKind::Archived, 1, key.version);
+                    key = {ContainerKind::Archived, 1, key.version - 1, offset + key.cid};
+                } else {
+                    key = {ContainerKind::Archived, key.category > 1 ? key.category - 1 : 1, key.version - 1,
+                           key.cid};
+                }
+            } else {
+                keptList.push_back(entry);
+                continue;
             }
-            sprintf(newPath, VersionFilePath.data(), classId1, version - 1, cid);
-            rename(oldPath, newPath);
-            cid++;
+            newEntries[key] = entry.second;
         }
 
-        uint64_t acid = 0;
-        while (1) {
-            sprintf(oldPath, VersionFilePath.data(), classId2, version, acid);
-            FileOperator fileOperator(oldPath, FileOpenType::TRY);
-            if (!fileOperator.ok()) {
-                break;
+        // a renamed container replaces one which kept its name.
+        for (const auto &entry: keptList) {
+            if (!newEntries.insert(entry).second) {
+                dropList.push_back(entry.second);
             }
-            sprintf(newPath, VersionFilePath.data(), classId1, version - 1, cid);
-            rename(oldPath, newPath);
-            acid++;
-            cid++;
         }
-
+        GlobalContainerCatalog.setEntries(newEntries);
         return 0;
     }
-
-    char oldPath[256];
-    char newPath[256];
 };
 
 #endif //MEGA_ELIMINATOR_H
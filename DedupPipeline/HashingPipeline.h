@@ -14,11 +14,16 @@
 #include "isa-l_crypto/mh_sha1.h"
 #include "openssl/sha.h"
 #include "DeduplicationPipeline.h"
+#include "../Utility/Metrics.h"
+#include "../Utility/Trace.h"
 #include <assert.h>
 
 class HashingPipeline {
 public:
-    HashingPipeline() : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock) {
+    HashingPipeline() : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock),
+                        queueMetrics("hashing") {
+        chunkLatency = GlobalMetrics.histogram("hashing_chunk_latency_ns");
+        hashBytes = GlobalMetrics.counter("hashing_bytes_total");
         worker = new std::thread(std::bind(&HashingPipeline::hashingWorkerCallback, this));
     }
 
@@ -26,6 +31,8 @@ public:
         MutexLockGuard mutexLockGuard(mutexLock);
         receiceList.push_back(dedupTask);
         taskAmount++;
+        queueMetrics.push(taskAmount);
+        TRACE_INSTANT("hashing_enqueue", dedupTask.index, dedupTask.fileID);
         condition.notifyAll();
 
     }
@@ -53,13 +60,17 @@ private:
         while (runningFlag) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
+                uint64_t waitStart = queueMetrics.waitBegin();
                 while (!taskAmount) {
                     condition.wait();
                     if (unlikely(!runningFlag)) return;
                 }
+                queueMetrics.waitEnd(waitStart);
                 taskAmount = 0;
+                queueMetrics.pop(0);
                 taskList.swap(receiceList);
             }
+            TRACE_INSTANT("hashing_dequeue", taskList.size(), taskList.front().fileID);
 
             if(unlikely(newVersion)){
                 duration = 0;
@@ -76,9 +87,13 @@ private:
 
                 //isa sha1
 
+                uint64_t c0 = MonotonicNow();
                 mh_sha1_init(&ctx);
                 mh_sha1_update_avx2(&ctx, dedupTask.buffer + dedupTask.pos, (uint32_t) dedupTask.length);
                 mh_sha1_finalize_avx2(&ctx, &dedupTask.fp);
+                chunkLatency->record(MonotonicNow() - c0);
+                hashBytes->add(dedupTask.length);
+                TRACE_COMPLETE("hashing", c0, dedupTask.index, dedupTask.fileID);
 
                 if (dedupTask.countdownLatch) {
                     printf("HashingPipeline finish\n");
@@ -107,6 +122,10 @@ private:
     uint64_t duration = 0;
 
     bool newVersion = true;
+
+    QueueMetrics queueMetrics;
+    MetricsHistogram *chunkLatency;
+    MetricsCounter *hashBytes;
 };
 
 static HashingPipeline *GlobalHashingPipelinePtr;
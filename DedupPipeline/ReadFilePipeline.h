@@ -11,15 +11,19 @@
 
 #include "jemalloc/jemalloc.h"
 #include <sys/time.h>
+#include <algorithm>
 #include "../Utility/StorageTask.h"
 #include "../Utility/FileOperator.h"
 #include "ChunkingPipeline.h"
+#include "../Utility/Metrics.h"
 
 const uint64_t ReadPipelineReadBlockSize = (uint64_t) 32 * 1024 * 1024;
 
 class ReadFilePipeline {
 public:
     ReadFilePipeline() : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock) {
+        blockLatency = GlobalMetrics.histogram("reading_block_latency_us");
+        readBytes = GlobalMetrics.counter("reading_bytes_total");
         worker = new std::thread(std::bind(&ReadFilePipeline::readFileCallback, this));
     }
 
@@ -72,16 +76,22 @@ private:
             chunkTask.fileID = storageTask->fileID;
             chunkTask.buffer = storageTask->buffer;
             chunkTask.length = storageTask->length;
+            chunkTask.digest = &storageTask->digest;
 
             gettimeofday(&t0, NULL);
-            while (readOnce = fileOperator.read(storageTask->buffer + readOffset, ReadPipelineReadBlockSize)) {
+            uint64_t c0 = MonotonicNow();
+            // the last block is the one reaching the size, a file of whole blocks has no short read to end it.
+            while (readOnce = fileOperator.read(storageTask->buffer + readOffset,
+                                                std::min(ReadPipelineReadBlockSize, storageTask->length - readOffset))) {
+                blockLatency->record((MonotonicNow() - c0) / 1000);
+                readBytes->add(readOnce);
                 readOffset += readOnce;
                 chunkTask.end = readOffset;
-                if (readOnce < ReadPipelineReadBlockSize) {
+                if (readOnce < ReadPipelineReadBlockSize || readOffset == storageTask->length) {
                     chunkTask.countdownLatch = cd;
                 }
                 GlobalChunkingPipelinePtr->addTask(chunkTask);
-
+                c0 = MonotonicNow();
             }
             chunkTask.countdownLatch = nullptr;
             cd->countDown();
@@ -104,6 +114,9 @@ private:
     MutexLock mutexLock;
     Condition condition;
     uint64_t duration = 0;
+
+    MetricsHistogram *blockLatency;
+    MetricsCounter *readBytes;
 };
 
 static ReadFilePipeline *GlobalReadPipelinePtr;
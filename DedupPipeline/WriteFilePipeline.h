@@ -15,17 +15,23 @@
 #include "../Utility/ContainerConstructor.h"
 #include "../Utility/Likely.h"
 #include "../Utility/BufferedFileWriter.h"
+#include "../Utility/ChunkAllocator.h"
+#include "../Utility/RecipeFormat.h"
+#include "../Utility/Metrics.h"
+#include "../Utility/Trace.h"
+#include "../RollHash/ChunkingProfile.h"
 #include <zstd.h>
 
-extern std::string LogicFilePath;
-
 DEFINE_uint64(RecipeFlushBufferSize,
               8388608, "RecipeFlushBufferSize");
 
 class WriteFilePipeline {
 public:
-    WriteFilePipeline() : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock),
-                          logicFileOperator(nullptr) {
+    WriteFilePipeline() : recipeWriter(nullptr), runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock),
+                          deltaBufferPool(ChunkBufferLength(), std::max((uint64_t) 1, 4194304 / ChunkBufferLength())),
+                          queueMetrics("write") {
+        chunkLatency = GlobalMetrics.histogram("write_chunk_latency_ns");
+        storedBytes = GlobalMetrics.counter("write_stored_bytes_total");
         worker = new std::thread(std::bind(&WriteFilePipeline::writeFileCallback, this));
     }
 
@@ -33,6 +39,8 @@ public:
         MutexLockGuard mutexLockGuard(mutexLock);
         receiveList.push_back(writeTask);
         taskAmount++;
+        queueMetrics.push(taskAmount);
+        TRACE_INSTANT("write_enqueue", writeTask.index, writeTask.fileID);
         condition.notify();
     }
 
@@ -40,6 +48,15 @@ public:
         return chunkWriterManager->getContainer(s, e, c, buffer, length);
     }
 
+    // delta buffers are taken by the dedup thread and come back once their chunk is in a container.
+    uint8_t *getDeltaBuffer() {
+        return deltaBufferPool.get();
+    }
+
+    void putDeltaBuffer(uint8_t *deltaBuffer) {
+        deltaBufferPool.put(deltaBuffer);
+    }
+
     ~WriteFilePipeline() {
         runningFlag = false;
         condition.notifyAll();
@@ -49,6 +66,8 @@ public:
 
     void getStatistics() {
         printf("[DedupWrite] total : %lu\n", duration);
+        printf("[DedupWrite] delta buffers:%lu, mallocs:%lu\n", deltaBufferPool.getRequestCounter(),
+               deltaBufferPool.getMallocCounter());
     }
 
 private:
@@ -64,14 +83,18 @@ private:
         while (runningFlag) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
+                uint64_t waitStart = queueMetrics.waitBegin();
                 while (!taskAmount) {
                     condition.wait();
                     if (unlikely(!runningFlag)) return;
                 }
+                queueMetrics.waitEnd(waitStart);
                 taskAmount = 0;
+                queueMetrics.pop(0);
                 condition.notify();
                 taskList.swap(receiveList);
             }
+            TRACE_INSTANT("write_dequeue", taskList.size(), taskList.front().fileID);
 
             memset(&blockHeader, 0, sizeof(BlockHeader));
 
@@ -84,9 +107,10 @@ private:
             }
 
             for (auto &writeTask: taskList) {
-                if (!logicFileOperator) {
-                    sprintf(buffer, LogicFilePath.c_str(), writeTask.fileID);
-                    logicFileOperator = new FileOperator(buffer, FileOpenType::Write);
+                uint64_t c0 = MonotonicNow();
+                if (!recipeWriter) {
+                    GlobalContainerCatalog.createRecipe(writeTask.fileID, buffer);
+                    recipeWriter = new RecipeWriter(buffer);
                     printf("start write\n");
                 }
                 blockHeader = {
@@ -100,26 +124,29 @@ private:
                         blockHeader.sFeatures = writeTask.similarityFeatures;
                         chunkWriterManager->writeClass((uint8_t *) &blockHeader, sizeof(BlockHeader),
                                                        writeTask.buffer + writeTask.pos, writeTask.length);
-                        logicFileOperator->write((uint8_t *) &blockHeader, sizeof(BlockHeader));
+                        storedBytes->add(writeTask.length);
+                        recipeWriter->append(blockHeader);
                         //bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
                         recipeLength += blockHeader.length;
                         break;
                     case 1: //Internal
+                        oriBuffer = writeTask.buffer;
                         if (writeTask.deltaTag) {
                             blockHeader.baseFP = writeTask.baseFP;
                             blockHeader.oriLength = writeTask.oriLength;
                         }
-                        logicFileOperator->write((uint8_t *) &blockHeader, sizeof(BlockHeader));
+                        recipeWriter->append(blockHeader);
 //                        bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
                         recipeLength += blockHeader.length;
                         break;
                     case 2: //Adjacent
+                        oriBuffer = writeTask.buffer;
                         if (writeTask.deltaTag) {
                             blockHeader.baseFP = writeTask.baseFP;
                             blockHeader.oriLength = writeTask.oriLength;
                         }
                         //bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
-                        logicFileOperator->write((uint8_t *) &blockHeader, sizeof(BlockHeader));
+                        recipeWriter->append(blockHeader);
                         recipeLength += blockHeader.length;
                         break;
                     case 4: //Similar
@@ -127,20 +154,23 @@ private:
                         blockHeader.oriLength = writeTask.oriLength;
                         chunkWriterManager->writeClass((uint8_t *) &blockHeader, sizeof(BlockHeader),
                                                        writeTask.buffer, writeTask.length);
-                        logicFileOperator->write((uint8_t *) &blockHeader, sizeof(BlockHeader));
+                        storedBytes->add(writeTask.length);
+                        recipeWriter->append(blockHeader);
                         //bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
                         recipeLength += blockHeader.oriLength;
-                        free(writeTask.buffer);
+                        deltaBufferPool.put(writeTask.buffer);
                         break;
                     default:
                         assert(1);
                         break;
                 }
+                chunkLatency->record(MonotonicNow() - c0);
+                TRACE_COMPLETE("write", c0, writeTask.index, writeTask.fileID);
 
                 if (writeTask.countdownLatch) {
                     printf("WritePipeline finish\n");
-                    delete logicFileOperator;
-                    logicFileOperator = nullptr;
+                    delete recipeWriter;
+                    recipeWriter = nullptr;
                     delete chunkWriterManager;
                     chunkWriterManager = nullptr;
                     gettimeofday(&t1, NULL);
@@ -152,6 +182,7 @@ private:
 
                     writeTask.countdownLatch->countDown();
                     free(oriBuffer);
+                    oriBuffer = nullptr;
                 }
 
             }
@@ -162,7 +193,7 @@ private:
         }
     }
 
-    FileOperator *logicFileOperator;
+    RecipeWriter *recipeWriter;
     char buffer[256];
     bool runningFlag;
     std::thread *worker;
@@ -172,8 +203,13 @@ private:
     MutexLock mutexLock;
     Condition condition;
     uint64_t duration = 0;
-    uint8_t *oriBuffer;
+    uint8_t *oriBuffer = nullptr;
     ContainerConstructor *chunkWriterManager = nullptr;
+    BufferPool deltaBufferPool;
+
+    QueueMetrics queueMetrics;
+    MetricsHistogram *chunkLatency;
+    MetricsCounter *storedBytes;
 };
 
 static WriteFilePipeline *GlobalWriteFilePipelinePtr;
@@ -0,0 +1,277 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_INDEXREBUILDER_H
+#define MEGA_INDEXREBUILDER_H
+
+#include <queue>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <sys/time.h>
+#include "gflags/gflags.h"
+#include "MetadataManager.h"
+#include "../Utility/ContainerCatalog.h"
+#include "../Utility/ContainerScanner.h"
+#include "../Utility/RecipeFormat.h"
+
+DEFINE_uint64(RebuildThreads,
+              4, "threads decompressing and parsing containers during an index rebuild");
+
+struct RebuildChunk {
+    uint32_t category;
+    uint64_t length;
+};
+
+// what one container contributes, the feature runs are sorted by feature for the merge.
+struct ContainerScan {
+    std::vector<std::pair<uint64_t, BasePos>> featureList[3];
+    std::vector<std::pair<SHA1FP, RebuildChunk>> chunkList;
+};
+
+struct RebuildTask {
+    ContainerLocation location;
+    uint32_t category;
+    uint64_t cid;
+    uint64_t rank;
+};
+
+// Rebuilds the index of the last version from the store alone. Every chunk a write may refer to or delta
+// against sits in the active categories of the last version after it was arranged, their block headers carry the
+// similarity features. The containers are read once by a scanner, and the per-container runs are merged in the
+// order a write and its arrangement would have indexed them, so the first chunk of a feature wins as it does
+// there. The recipe of the last version decides which fingerprints the earlier table holds.
+class IndexRebuilder {
+public:
+    IndexRebuilder() {
+    }
+
+    // 0: the rebuilt tables are installed in GlobalMetadataManagerPtr.
+    int run(uint64_t version) {
+        printf("-----------------------Rebuilding index-----------------------\n");
+        struct timeval t0, t1, t2;
+        gettimeofday(&t0, NULL);
+
+        selectContainers(version);
+        printf("%lu containers of version %lu to scan with %lu threads\n", (uint64_t) rebuildList.size(), version,
+               FLAGS_RebuildThreads);
+        scanContainers();
+        gettimeofday(&t1, NULL);
+        uint64_t scanTime = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
+        printf("Scanned %lu bytes (%lu decompressed) in %lu us, %f MB/s\n", scanner.getReadBytes(),
+               scanner.getRawBytes(), scanTime, (float) scanner.getReadBytes() / scanTime);
+        if (damaged) {
+            printf("%lu containers can not be read or decompressed, the index is not rebuilt\n",
+                   (uint64_t) damaged);
+            return 1;
+        }
+
+        SimilarityIndex similarityIndex;
+        std::thread merger1(std::bind(&IndexRebuilder::mergeFeatures, this, 0, &similarityIndex.simIndex1));
+        std::thread merger2(std::bind(&IndexRebuilder::mergeFeatures, this, 1, &similarityIndex.simIndex2));
+        std::thread merger3(std::bind(&IndexRebuilder::mergeFeatures, this, 2, &similarityIndex.simIndex3));
+        merger1.join();
+        merger2.join();
+        merger3.join();
+
+        FPIndex fpIndex;
+        int r = buildFPIndex(version, fpIndex);
+        gettimeofday(&t2, NULL);
+        printf("Merged in %lu us, total %lu us\n", (t2.tv_sec - t1.tv_sec) * 1000000 + t2.tv_usec - t1.tv_usec,
+               (t2.tv_sec - t0.tv_sec) * 1000000 + t2.tv_usec - t0.tv_usec);
+        if (r) {
+            return r;
+        }
+        printf("fingerprint table: %lu items, total size:%lu, duplicate size:%lu\n",
+               (uint64_t) fpIndex.fpTable.size(), fpIndex.totalSize, fpIndex.migrateSize);
+        printf("similar tables: %lu, %lu, %lu items\n", (uint64_t) similarityIndex.simIndex1.size(),
+               (uint64_t) similarityIndex.simIndex2.size(), (uint64_t) similarityIndex.simIndex3.size());
+        GlobalMetadataManagerPtr->installTables(fpIndex, similarityIndex);
+        return 0;
+    }
+
+private:
+    // the newest category first, then the arranged ones in order. the append part of category 1 was category 2
+    // when it was arranged.
+    void selectContainers(uint64_t version) {
+        CatalogMap entries = GlobalContainerCatalog.getEntries();
+        std::vector<std::pair<std::pair<uint64_t, uint64_t>, RebuildTask>> orderList;
+        for (const auto &entry: entries) {
+            const CatalogKey &key = entry.first;
+            if (key.version != version || key.kind == ContainerKind::Archived) {
+                continue;
+            }
+            uint64_t order;
+            uint32_t category;
+            if (key.kind == ContainerKind::Append) {
+                order = 2;
+                category = 0;
+            } else {
+                order = key.category == version ? 0 : (key.category == 1 ? 1 : key.category + 1);
+                category = key.category;
+            }
+            orderList.push_back({{order, key.cid}, {entry.second, category, key.cid, 0}});
+        }
+        std::sort(orderList.begin(), orderList.end(),
+                  [](const std::pair<std::pair<uint64_t, uint64_t>, RebuildTask> &a,
+                     const std::pair<std::pair<uint64_t, uint64_t>, RebuildTask> &b) { return a.first < b.first; });
+        for (auto &item: orderList) {
+            item.second.rank = rebuildList.size();
+            rebuildList.push_back(item.second);
+        }
+        scanList.resize(rebuildList.size());
+    }
+
+    void scanContainers() {
+        std::vector<ContainerLocation> locationList;
+        for (const auto &task: rebuildList) {
+            locationList.push_back(task.location);
+        }
+        scanner.scan(locationList, [this](uint64_t index, const uint8_t *raw, uint64_t rawLength) {
+            if (!raw || !parse(rebuildList[index], raw, rawLength)) {
+                printf("Container %lu of category %u can not be parsed\n", rebuildList[index].cid,
+                       rebuildList[index].category);
+                damaged++;
+            }
+        });
+    }
+
+    bool parse(const RebuildTask &task, const uint8_t *raw, uint64_t rawLength) {
+        ContainerScan &scan = scanList[task.rank];
+        uint64_t offset = 0;
+        while (offset + sizeof(BlockHeader) <= rawLength) {
+            const BlockHeader *blockHeader = (const BlockHeader *) (raw + offset);
+            if (!blockHeader->type) {
+                BasePos basePos = {blockHeader->fp, task.category, task.cid, blockHeader->length, 0};
+                scan.featureList[0].push_back({blockHeader->sFeatures.feature1, basePos});
+                scan.featureList[1].push_back({blockHeader->sFeatures.feature2, basePos});
+                scan.featureList[2].push_back({blockHeader->sFeatures.feature3, basePos});
+            }
+            scan.chunkList.push_back({blockHeader->fp, {task.category, blockHeader->length}});
+            offset += sizeof(BlockHeader) + blockHeader->length;
+        }
+        // the first chunk of a feature in the container is the one indexed.
+        for (auto &featureList: scan.featureList) {
+            std::stable_sort(featureList.begin(), featureList.end(),
+                             [](const std::pair<uint64_t, BasePos> &a, const std::pair<uint64_t, BasePos> &b) {
+                                 return a.first < b.first;
+                             });
+            featureList.erase(std::unique(featureList.begin(), featureList.end(),
+                                          [](const std::pair<uint64_t, BasePos> &a,
+                                             const std::pair<uint64_t, BasePos> &b) { return a.first == b.first; }),
+                              featureList.end());
+        }
+        return offset == rawLength;
+    }
+
+    // k-way merge of the sorted runs, equal features come out by rank and only the first one is kept.
+    void mergeFeatures(int table, std::unordered_map<uint64_t, BasePos> *simIndex) {
+        typedef std::pair<uint64_t, uint64_t> Head;
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heap;
+        std::vector<uint64_t> cursor(scanList.size(), 0);
+        uint64_t total = 0;
+        for (uint64_t rank = 0; rank < scanList.size(); rank++) {
+            const auto &featureList = scanList[rank].featureList[table];
+            if (!featureList.empty()) {
+                heap.push({featureList[0].first, rank});
+            }
+            total += featureList.size();
+        }
+        simIndex->reserve(total);
+        while (!heap.empty()) {
+            uint64_t rank = heap.top().second;
+            heap.pop();
+            auto &featureList = scanList[rank].featureList[table];
+            simIndex->emplace(featureList[cursor[rank]].first, featureList[cursor[rank]].second);
+            if (++cursor[rank] < featureList.size()) {
+                heap.push({featureList[cursor[rank]].first, rank});
+            } else {
+                std::vector<std::pair<uint64_t, BasePos>>().swap(featureList);
+            }
+        }
+    }
+
+    // every chunk of the recipe, and the base of every delta in it, as a write of the version leaves them.
+    int buildFPIndex(uint64_t version, FPIndex &fpIndex) {
+        std::unordered_map<SHA1FP, RebuildChunk, TupleHasher, TupleEqualer> chunkMap;
+        uint64_t total = 0;
+        for (const auto &scan: scanList) {
+            total += scan.chunkList.size();
+        }
+        chunkMap.reserve(total);
+        for (auto &scan: scanList) {
+            for (const auto &chunk: scan.chunkList) {
+                chunkMap.emplace(chunk.first, chunk.second);
+            }
+            std::vector<std::pair<SHA1FP, RebuildChunk>>().swap(scan.chunkList);
+        }
+
+        char recipePath[256];
+        if (!GlobalContainerCatalog.getRecipePath(version, recipePath)) {
+            printf("Version %lu has no recipe\n", version);
+            return 1;
+        }
+        RecipeReader recipeReader(recipePath);
+        fpIndex.fpTable.reserve(recipeReader.getChunkCount());
+        std::vector<SHA1FP> baseList;
+        uint64_t missing = 0;
+        recipeReader.scan(0, recipeReader.getTotalSize(), [&](const BlockHeader &blockHeader, uint64_t) {
+            auto iter = chunkMap.find(blockHeader.fp);
+            if (iter == chunkMap.end()) {
+                missing++;
+                return;
+            }
+            FPTableEntry entry;
+            memset(&entry, 0, sizeof(FPTableEntry));
+            entry.deltaTag = blockHeader.type;
+            entry.categoryOrder = iter->second.category;
+            entry.length = blockHeader.length;
+            entry.oriLength = blockHeader.type ? blockHeader.oriLength : blockHeader.length;
+            if (blockHeader.type) {
+                entry.baseFP = blockHeader.baseFP;
+            }
+            if (!fpIndex.fpTable.emplace(blockHeader.fp, entry).second) {
+                return;
+            }
+            // chunks of older categories were found by the write, those of the newest one were stored by it.
+            fpIndex.totalSize += entry.oriLength + sizeof(BlockHeader);
+            if (entry.categoryOrder != version) {
+                fpIndex.migrateSize += entry.oriLength + sizeof(BlockHeader);
+            } else if (blockHeader.type) {
+                fpIndex.totalSize -= entry.oriLength - entry.length;
+            }
+            if (blockHeader.type) {
+                baseList.push_back(blockHeader.baseFP);
+            }
+        });
+        for (const auto &baseFP: baseList) {
+            auto iter = chunkMap.find(baseFP);
+            if (iter == chunkMap.end()) {
+                missing++;
+                continue;
+            }
+            FPTableEntry entry;
+            memset(&entry, 0, sizeof(FPTableEntry));
+            entry.categoryOrder = iter->second.category;
+            entry.oriLength = entry.length = iter->second.length;
+            if (fpIndex.fpTable.emplace(baseFP, entry).second) {
+                fpIndex.migrateSize += entry.oriLength + sizeof(BlockHeader);
+            }
+        }
+        if (missing) {
+            printf("%lu chunks of version %lu are not in its containers, the index is not rebuilt\n", missing,
+                   version);
+            return 1;
+        }
+        return 0;
+    }
+
+    std::vector<RebuildTask> rebuildList;
+    std::vector<ContainerScan> scanList;
+    ContainerScanner scanner{FLAGS_RebuildThreads};
+    std::atomic<uint64_t> damaged{0};
+};
+
+#endif //MEGA_INDEXREBUILDER_H
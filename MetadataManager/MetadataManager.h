@@ -363,6 +363,20 @@ public:
         return 0;
     }
 
+    // tables rebuilt from the store become the earlier ones, as they are after a version has been arranged.
+    int installTables(FPIndex &fpIndex, SimilarityIndex &similarityIndex) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        earlierTable.rolling(fpIndex);
+        earlierSimilarityTable.rolling(similarityIndex);
+        laterTable.fpTable.clear();
+        laterTable.migrateSize = 0;
+        laterTable.totalSize = 0;
+        laterSimilarityTable.simIndex1.clear();
+        laterSimilarityTable.simIndex2.clear();
+        laterSimilarityTable.simIndex3.clear();
+        return 0;
+    }
+
     int similarityTableMerge(){
         for(auto& item: earlierSimilarityTable.simIndex1){
             if(item.second.CategoryOrder >= 3){
@@ -388,12 +402,12 @@ public:
         return 0;
     }
 
-    // updated
-    int save(){
+    // a snapshot of the index, one per generation of the store.
+    int save(const std::string &path){
         printf("------------------------Saving index----------------------\n");
-        printf("Saving index..\n");
+        printf("Saving index to %s..\n", path.data());
         uint64_t size;
-        FileOperator fileOperator((char*)KVPath.data(), FileOpenType::Write);
+        FileOperator fileOperator((char*)path.data(), FileOpenType::Write);
 
         fileOperator.write((uint8_t*)&earlierTable, sizeof(uint64_t)*2);
         size = earlierTable.fpTable.size();
@@ -457,21 +471,22 @@ public:
         }
         printf("later similar table3 saves %lu items\n", size);
 
+        fflush(fileOperator.getFP());
         fileOperator.fdatasync();
 
         return 0;
     }
 
-    int load(){
+    int load(const std::string &path){
         printf("-----------------------Loading index-----------------------\n");
-        printf("Loading index..\n");
+        printf("Loading index from %s..\n", path.data());
         uint64_t sizeE = 0;
         uint64_t sizeL = 0;
         SHA1FP tempFP;
         FPTableEntry tempFPTableEntry;
         uint64_t tempFeature;
         BasePos tempBasePos;
-        FileOperator fileOperator((char*)KVPath.data(), FileOpenType::Read);
+        FileOperator fileOperator((char*)path.data(), FileOpenType::Read);
         assert(earlierTable.fpTable.size() == 0);
         assert(laterTable.fpTable.size() == 0);
 
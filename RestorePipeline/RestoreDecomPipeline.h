@@ -6,26 +6,42 @@
 #define MEGA_RESTOREDECOMPRESSION_H
 
 #include "RestoreParserPipeline.h"
+#include "../Utility/Metrics.h"
+#include "../Utility/Trace.h"
+
+DEFINE_uint64(RestoreDecomThreads,
+              4, "threads decompressing containers during restore");
 
 class RestoreDecomPipeline {
 public:
     RestoreDecomPipeline() : taskAmount(0), runningFlag(true), mutexLock(),
-                             condition(mutexLock) {
-        worker = new std::thread(std::bind(&RestoreDecomPipeline::restoreDecompressionCallback, this));
+                             condition(mutexLock), queueMetrics("restore_decom") {
+        containerLatency = GlobalMetrics.histogram("restore_decom_container_latency_us");
+        decompressedBytes = GlobalMetrics.counter("restore_decompressed_bytes_total");
+        for (uint64_t i = 0; i < FLAGS_RestoreDecomThreads; i++) {
+            workers.push_back(new std::thread(std::bind(&RestoreDecomPipeline::restoreDecompressionCallback, this)));
+        }
     }
 
     int addTask(RestoreParseTask *restoreTask) {
         MutexLockGuard mutexLockGuard(mutexLock);
         taskList.push_back(restoreTask);
         taskAmount++;
+        queueMetrics.push(taskAmount);
         condition.notify();
     }
 
     ~RestoreDecomPipeline() {
-        printf("[RestoreDecom] total: %lu\n", duration);
-        runningFlag = false;
-        condition.notifyAll();
-        worker->join();
+        printf("[RestoreDecom] total: %lu\n", (uint64_t) duration);
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            runningFlag = false;
+            condition.notifyAll();
+        }
+        for (auto worker: workers) {
+            worker->join();
+            delete worker;
+        }
     }
 
 private:
@@ -33,52 +49,65 @@ private:
         pthread_setname_np(pthread_self(), "RDecom");
 
         RestoreParseTask *restoreParseTask;
+        ZSTD_DCtx *dctx = ZSTD_createDCtx();
 
         struct timeval t0, t1;
 
         while (likely(runningFlag)) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
+                uint64_t waitStart = queueMetrics.waitBegin();
                 while (!taskAmount) {
                     condition.wait();
                     if (unlikely(!runningFlag)) break;
                 }
                 if (unlikely(!runningFlag)) continue;
+                queueMetrics.waitEnd(waitStart);
                 taskAmount--;
+                queueMetrics.pop(taskAmount);
                 restoreParseTask = taskList.front();
                 taskList.pop_front();
             }
 
-            if (restoreParseTask->endFlag) {
-                GlobalRestoreParserPipelinePtr->addTask(restoreParseTask);
-                continue;
-            }
-
+            TRACE_SPAN("decompress", restoreParseTask->sequence, 0);
             gettimeofday(&t0, NULL);
             uint8_t *decomBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-            size_t decompressedSize = ZSTD_decompress(decomBuffer, RestoreReadBufferLength, restoreParseTask->buffer,
-                                                      restoreParseTask->length);
-            assert(!ZSTD_isError(decompressedSize));
+            size_t decompressedSize = ZSTD_decompressDCtx(dctx, decomBuffer, RestoreReadBufferLength,
+                                                          restoreParseTask->buffer, restoreParseTask->length);
+            if (ZSTD_isError(decompressedSize)) {
+                printf("Container %lu of the restore can not be decompressed\n", restoreParseTask->index);
+                free(decomBuffer);
+                GlobalRestoreWritePipelinePtr->containerFailed();
+                restoreParseTask->release();
+                continue;
+            }
             free(restoreParseTask->buffer);
             restoreParseTask->buffer = decomBuffer;
             restoreParseTask->length = decompressedSize;
 
             gettimeofday(&t1, NULL);
             duration += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
+            containerLatency->record((t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
+            decompressedBytes->add(decompressedSize);
 
             GlobalRestoreParserPipelinePtr->addTask(restoreParseTask);
         }
+        ZSTD_freeDCtx(dctx);
     }
 
 
     bool runningFlag;
-    std::thread *worker;
+    std::vector<std::thread *> workers;
     uint64_t taskAmount;
     std::list<RestoreParseTask *> taskList;
     MutexLock mutexLock;
     Condition condition;
 
-    uint64_t duration = 0;
+    std::atomic<uint64_t> duration{0};
+
+    QueueMetrics queueMetrics;
+    MetricsHistogram *containerLatency;
+    MetricsCounter *decompressedBytes;
 };
 
 static RestoreDecomPipeline *GlobalRestoreDecomPipelinePtr;
@@ -12,154 +12,195 @@
 #include "RestoreWritePipeline.h"
 #include "../Utility/StorageTask.h"
 #include "../Utility/FileOperator.h"
+#include "../Utility/RecipeFormat.h"
+#include "../Utility/Metrics.h"
+#include "../Utility/Trace.h"
 #include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
 #include <assert.h>
 
+DEFINE_uint64(RestoreParseThreads,
+              2, "threads parsing containers and writing plain chunks during restore");
+
 extern uint64_t ContainerSize;
 uint64_t RestoreReadBufferLength = ContainerSize * 1.2;
 
-struct BlockRestorePos {
-    uint64_t offset;
-};
-
 class RestoreParserPipeline {
 public:
-    RestoreParserPipeline(uint64_t target, const std::string &path) : taskAmount(0), runningFlag(true), mutexLock(),
-                                                                      condition(mutexLock) {
-        worker = new std::thread(std::bind(&RestoreParserPipeline::restoreParserCallback, this, path));
+    RestoreParserPipeline(const std::string &path, uint64_t offset = 0, uint64_t length = -1)
+            : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock), recipeLatch(1),
+              rangeOffset(offset), rangeLength(length), queueMetrics("restore_parse") {
+        containerLatency = GlobalMetrics.histogram("restore_parse_container_latency_us");
+        for (uint64_t i = 0; i < FLAGS_RestoreParseThreads; i++) {
+            workers.push_back(new std::thread(std::bind(&RestoreParserPipeline::restoreParserCallback, this, path, i)));
+        }
     }
 
     int addTask(RestoreParseTask *restoreParseTask) {
         MutexLockGuard mutexLockGuard(mutexLock);
         taskList.push_back(restoreParseTask);
         taskAmount++;
+        queueMetrics.push(taskAmount);
         condition.notify();
     }
 
     ~RestoreParserPipeline() {
-        printf("[RestoreParser] total :%lu\n", duration);
-        runningFlag = false;
-        condition.notifyAll();
-        worker->join();
+        printf("[RestoreParser] total :%lu\n", (uint64_t) duration);
+        printf("[RestoreParser] chunks referenced in place:%lu\n", (uint64_t) chunkReference);
+        printf("Read amplification : %f\n", (float) readLength / restoreSize);
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            runningFlag = false;
+            condition.notifyAll();
+        }
+        for (auto worker: workers) {
+            worker->join();
+            delete worker;
+        }
+    }
+
+    void waitRecipe() {
+        recipeLatch.wait();
+    }
+
+    // only valid after waitRecipe(), the map is not modified afterwards.
+    bool isRequired(const SHA1FP &fp) {
+        return restoreMap.find(fp) != restoreMap.end();
     }
 
 private:
-    void restoreParserCallback(const std::string &path) {
+    void loadRecipe(const std::string &path) {
+        RecipeReader recipeReader((char *) path.data());
+        printf("Chunks:%lu\n", recipeReader.getChunkCount());
+
+        uint64_t versionSize = recipeReader.getTotalSize();
+        uint64_t rangeBegin = std::min(rangeOffset, versionSize);
+        uint64_t rangeEnd = rangeBegin + std::min(rangeLength, versionSize - rangeBegin);
+
+        // only chunks overlapping [rangeBegin, rangeEnd) and the bases of those deltas are needed.
+        recipeReader.scan(rangeBegin, rangeEnd, [&](const BlockHeader &blockHeader, uint64_t pos) {
+            if (blockHeader.type) {
+                restoreMap[blockHeader.baseFP].push_back({0, 1, pos, blockHeader.length});
+                restoreMap[blockHeader.fp].push_back({1, 0, pos, 0});
+            } else {
+                restoreMap[blockHeader.fp].push_back({0, 0, pos, 0});
+            }
+        });
+        printf("total size:%lu, restore range:[%lu, %lu)\n", versionSize, rangeBegin, rangeEnd);
+        restoreSize = rangeEnd - rangeBegin;
+        GlobalRestoreWritePipelinePtr->setRange(rangeBegin, rangeEnd);
+    }
+
+    void restoreParserCallback(const std::string &path, uint64_t workerId) {
         pthread_setname_np(pthread_self(), "RParsing");
 
-        FileOperator recipeFD((char *) path.data(), FileOpenType::Read);
-        uint64_t size = FileOperator::size(path);
-        uint8_t *recipeBuffer = (uint8_t *) malloc(size);
-        recipeFD.read(recipeBuffer, size);
-        uint64_t count = size / sizeof(BlockHeader);
-        assert(count * sizeof(BlockHeader) == size);
-        BlockHeader *blockHeader;
-        printf("Chunks:%lu\n", count);
-
-        uint64_t pos = 0;
-        for (int i=0; i<count; i++) {
-            blockHeader = (BlockHeader *) (recipeBuffer + i * sizeof(BlockHeader));
-            if(blockHeader->type) {
-                restoreMap[blockHeader->baseFP].push_back({0, 1, pos, blockHeader->length});
-                restoreMap[blockHeader->fp].push_back({1, 0, pos, 0});
-                pos += blockHeader->oriLength;
-            }else{
-                restoreMap[blockHeader->fp].push_back({0, 0, pos, 0});
-                pos += blockHeader->length;
-            }
+        // the restore map is built once and only read afterwards, so it is shared by all workers without locking.
+        if (workerId == 0) {
+            loadRecipe(path);
+            recipeLatch.countDown();
+        } else {
+            recipeLatch.wait();
         }
-        printf("total size:%lu\n", pos);
-        GlobalRestoreWritePipelinePtr->setSize(pos);
 
         RestoreParseTask *restoreParseTask;
 
         struct timeval t0, t1;
 
-        uint64_t readLength = 0;
-
         while (likely(runningFlag)) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
+                uint64_t waitStart = queueMetrics.waitBegin();
                 while (!taskAmount) {
                     condition.wait();
                     if (unlikely(!runningFlag)) break;
                 }
                 if (unlikely(!runningFlag)) continue;
+                queueMetrics.waitEnd(waitStart);
                 taskAmount--;
+                queueMetrics.pop(taskAmount);
                 restoreParseTask = taskList.front();
                 taskList.pop_front();
             }
 
+            TRACE_SPAN("parse", restoreParseTask->sequence, 0);
             gettimeofday(&t0, NULL);
 
-            if (unlikely(restoreParseTask->endFlag)) {
-                printf("Read amplification : %f\n", (float) readLength / pos);
-                delete restoreParseTask;
-                RestoreWriteTask *restoreWriteTask = new RestoreWriteTask(true);
-                GlobalRestoreWritePipelinePtr->addTask(restoreWriteTask);
-                gettimeofday(&t1, NULL);
-                duration += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
-                break;
-            }
-
-            std::list<BlockRestorePos> orderList;
             uint64_t leftLength = restoreParseTask->length;
-            uint64_t readoffset = 0;
             uint8_t *buffer = restoreParseTask->buffer;
 
             readLength += restoreParseTask->sizeAfterCompression;
 
-            while (readoffset < leftLength) {
-                BlockHeader *pBH = (BlockHeader *) (buffer + readoffset);
-                assert(leftLength > sizeof(BlockHeader));
-                assert(leftLength >= sizeof(BlockHeader) + pBH->length);
-                if (pBH->type) {
-                    orderList.push_front({readoffset});
-                } else {
-                    orderList.push_back({readoffset});
-                }
-                readoffset += sizeof(BlockHeader) + pBH->length;
-            }
-            assert(readoffset == leftLength);
-
-            for (const auto &entry: orderList) {
-                BlockHeader *pBH = (BlockHeader *) (buffer + entry.offset);
-                uint8_t *bufferPtr = (uint8_t *) (buffer + entry.offset + sizeof(BlockHeader));
-                auto iter = restoreMap.find(pBH->fp);
-                // if we allow arrangement to fall behind, below assert must be commented.
-                assert(iter->second.size() > 0);
-                if (iter != restoreMap.end()) {
-                    for (auto item : iter->second) {
-                        totalLength += pBH->length;
-                        // item.length could be the length before delta (not the actual delta size), when delta chunk is migrated as adjacent.
-                        RestoreWriteTask *restoreWriteTask = new RestoreWriteTask(bufferPtr, item.pos,
-                                                                                  pBH->length, item.type, item.base,
-                                                                                  item.deltaLength);
-                        GlobalRestoreWritePipelinePtr->addTask(restoreWriteTask);
+            // deltas go first, so a delta whose base is in the same container is the one kept aside, not the base.
+            for (int pass = 0; pass < 2; pass++) {
+                uint64_t readoffset = 0;
+                while (readoffset < leftLength) {
+                    BlockHeader *pBH = (BlockHeader *) (buffer + readoffset);
+                    assert(leftLength > sizeof(BlockHeader));
+                    assert(leftLength >= sizeof(BlockHeader) + pBH->length);
+                    if ((bool) pBH->type == (pass == 0)) {
+                        restoreChunk(pBH, (uint8_t *) pBH + sizeof(BlockHeader), restoreParseTask);
                     }
-                } else {
-                    assert(0);
+                    readoffset += sizeof(BlockHeader) + pBH->length;
                 }
+                assert(readoffset == leftLength);
             }
 
-            delete restoreParseTask;
+            restoreParseTask->release();
+            GlobalRestoreWritePipelinePtr->containerDone();
             gettimeofday(&t1, NULL);
             duration += (t1.tv_sec-t0.tv_sec)*1000000 + t1.tv_usec - t0.tv_usec;
+            containerLatency->record((t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
+        }
+    }
+
+    // every position the chunk restores to, as a plain chunk, a delta or the base of a delta.
+    void restoreChunk(BlockHeader *pBH, uint8_t *bufferPtr, RestoreParseTask *restoreParseTask) {
+        auto iter = restoreMap.find(pBH->fp);
+        if (iter == restoreMap.end()) {
+            // only a ranged restore leaves chunks of the selected containers unreferenced.
+            // if we allow arrangement to fall behind, below assert must be commented.
+            assert(rangeOffset != 0 || rangeLength != (uint64_t) -1);
+            return;
+        }
+        for (auto item : iter->second) {
+            totalLength += pBH->length;
+            if (item.type) {
+                GlobalRestoreWritePipelinePtr->addDelta(bufferPtr, pBH->length, item.pos, restoreParseTask);
+                chunkReference++;
+            } else if (item.base) {
+                // item.length could be the length before delta (not the actual delta size), when delta chunk is migrated as adjacent.
+                GlobalRestoreWritePipelinePtr->addBase(bufferPtr, pBH->length, item.deltaLength, item.pos,
+                                                       restoreParseTask);
+                chunkReference++;
+            } else {
+                GlobalRestoreWritePipelinePtr->writeChunk(bufferPtr, pBH->length, item.pos);
+            }
         }
     }
 
     bool runningFlag;
-    std::thread *worker;
+    std::vector<std::thread *> workers;
     uint64_t taskAmount;
     std::list<RestoreParseTask *> taskList;
     MutexLock mutexLock;
     Condition condition;
+    CountdownLatch recipeLatch;
 
-    uint64_t totalLength = 0;
+    std::atomic<uint64_t> totalLength{0};
+    std::atomic<uint64_t> chunkReference{0};
+    std::atomic<uint64_t> readLength{0};
+    uint64_t restoreSize = 0;
+    uint64_t rangeOffset;
+    uint64_t rangeLength;
 
     std::unordered_map<SHA1FP, std::list<RestoreMapListEntry>, TupleHasher, TupleEqualer> restoreMap;
 
-    uint64_t duration = 0;
+    std::atomic<uint64_t> duration{0};
+
+    QueueMetrics queueMetrics;
+    MetricsHistogram *containerLatency;
 };
 
 static RestoreParserPipeline *GlobalRestoreParserPipelinePtr;
@@ -0,0 +1,96 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_RESTOREPLANNER_H
+#define MEGA_RESTOREPLANNER_H
+
+#include <string>
+#include <list>
+#include <vector>
+#include "../Utility/StorageTask.h"
+#include "../Utility/FileOperator.h"
+#include "../Utility/ContainerCatalog.h"
+
+struct ContainerReadEntry {
+    ContainerLocation location;
+    uint64_t index;
+};
+
+// Lists the containers which may hold chunks of the target version, newest first.
+class RestorePlanner {
+public:
+    uint64_t listContainers(RestoreTask *restoreTask, std::vector<ContainerReadEntry> &list) {
+        containerList = &list;
+        containerList->clear();
+        counter = 0;
+
+        uint64_t baseClass = 0;
+        std::list<uint64_t> categoryList, volumeList;
+        if(restoreTask->fallBehind == 0 || (restoreTask->maxVersion - restoreTask->fallBehind) >= restoreTask->targetVersion){
+            for (uint64_t i = restoreTask->targetVersion; i < restoreTask->maxVersion; i++) {
+                volumeList.push_back(i);
+                printf("Column # %lu is required\n", i);
+            }
+            uint64_t baseCategory = 1;
+            baseClass = baseCategory;
+            for (uint64_t i = baseCategory; i < baseCategory + restoreTask->targetVersion; i++) {
+                categoryList.push_front(i);
+              printf("Cat. # %lu is required\n", i);
+            }
+          printf("append Cat. # %lu is optional\n", baseCategory);
+        }else{
+            assert(0); // todo: do not consider fall behind currently
+        }
+
+        for (auto &item : volumeList) {
+            listVolumeFile(item, restoreTask->targetVersion);
+        }
+
+        for (auto &item : categoryList) {
+            if (item == baseClass) {
+                listAppendCategoryFile(baseClass, restoreTask->maxVersion);
+            }
+            listCategoryFile(item, restoreTask->maxVersion);
+        }
+        return counter;
+    }
+
+private:
+    int listVolumeFile(uint64_t versionId, uint64_t restoreVersion) {
+        for (int i = restoreVersion; i >= 1; i--) {
+            listFiles(ContainerKind::Archived, i, versionId);
+        }
+        return 0;
+    }
+
+
+    int listCategoryFile(uint64_t classId, uint64_t column) {
+        listFiles(ContainerKind::Active, classId, column);
+        return 0;
+    }
+
+    int listAppendCategoryFile(uint64_t classId, uint64_t column) {
+        printf("Trying to load append file.\n");
+        listFiles(ContainerKind::Append, classId, column);
+        return 0;
+    }
+
+    // the containers of a category are listed from the last one.
+    void listFiles(ContainerKind kind, uint64_t classId, uint64_t column) {
+        std::vector<ContainerLocation> locationList;
+        ContainerLocation location;
+        while (GlobalContainerCatalog.locate(kind, classId, column, locationList.size(), &location)) {
+            locationList.push_back(location);
+        }
+        counter += locationList.size();
+        for (auto iter = locationList.rbegin(); iter != locationList.rend(); iter++) {
+            containerList->push_back({*iter, column});
+        }
+    }
+
+    std::vector<ContainerReadEntry> *containerList = nullptr;
+    uint64_t counter = 0;
+};
+
+#endif //MEGA_RESTOREPLANNER_H
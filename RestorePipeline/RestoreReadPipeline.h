@@ -10,16 +10,23 @@
 #define MEGA_RESTOREREADPIPELINE_H
 
 #include <fcntl.h>
+#include <vector>
+#include <atomic>
 #include "RestoreDecomPipeline.h"
-
-extern std::string ClassFileAppendPath;
+#include "../Utility/ContainerIndex.h"
+#include "RestorePlanner.h"
 
 struct ReadPos {
     uint64_t offset;
     uint64_t length;
 };
 
-struct timeval t0, t1, rt0, rt1;
+DEFINE_uint64(RestoreReadThreads,
+              2, "threads reading containers during restore");
+DEFINE_bool(SelectiveRestore,
+            true, "only read containers holding chunks referenced by the target recipe");
+
+struct timeval t0, t1;
 
 class RestoreReadPipeline {
 public:
@@ -36,7 +43,7 @@ public:
     }
 
     ~RestoreReadPipeline() {
-        printf("[RestoreRead] total: %lu, read time:%lu\n", duration, readTime);
+        printf("[RestoreRead] total: %lu, read time:%lu\n", duration, (uint64_t) readTime);
         runningFlag = false;
         condition.notifyAll();
         worker->join();
@@ -61,39 +68,24 @@ private:
             }
             gettimeofday(&t0, NULL);
 
-            uint64_t baseClass = 0;
-            std::list<uint64_t> categoryList, volumeList;
-            if(restoreTask->fallBehind == 0 || (restoreTask->maxVersion - restoreTask->fallBehind) >= restoreTask->targetVersion){
-                for (uint64_t i = restoreTask->targetVersion; i < restoreTask->maxVersion; i++) {
-                    volumeList.push_back(i);
-                    printf("Column # %lu is required\n", i);
-                }
-                uint64_t baseCategory = 1;
-                baseClass = baseCategory;
-                for (uint64_t i = baseCategory; i < baseCategory + restoreTask->targetVersion; i++) {
-                    categoryList.push_front(i);
-                  printf("Cat. # %lu is required\n", i);
-                }
-              printf("append Cat. # %lu is optional\n", baseCategory);
-            }else{
-                assert(0); // todo: do not consider fall behind currently
+            RestorePlanner restorePlanner;
+            counter = restorePlanner.listContainers(restoreTask, readList);
+            if (FLAGS_SelectiveRestore) {
+                selectContainers();
             }
+            GlobalRestoreWritePipelinePtr->setContainerAmount(readList.size());
 
-            for (auto &item : volumeList) {
-                readFromVolumeFile(item, restoreTask->targetVersion);
+            nextRead = 0;
+            std::vector<std::thread *> readers;
+            for (uint64_t i = 0; i < FLAGS_RestoreReadThreads; i++) {
+                readers.push_back(new std::thread(std::bind(&RestoreReadPipeline::containerReadCallback, this)));
             }
-
-            for (auto &item : categoryList) {
-                if (item == baseClass) {
-                    readFromAppendCategoryFile(baseClass, restoreTask->maxVersion);
-                }
-                readFromCategoryFile(item, restoreTask->maxVersion);
+            for (auto reader: readers) {
+                reader->join();
+                delete reader;
             }
 
-
-            printf("read done: %lu\n", counter);
-            RestoreParseTask *restoreParseTask = new RestoreParseTask(true);
-            GlobalRestoreDecomPipelinePtr->addTask(restoreParseTask);
+            printf("read done: %lu, skipped: %lu\n", counter - skipped, skipped);
 
             gettimeofday(&t1, NULL);
             duration += (t1.tv_sec-t0.tv_sec)*1000000 + t1.tv_usec - t0.tv_usec;
@@ -101,126 +93,63 @@ private:
         }
     }
 
-    int readFromVolumeFile(uint64_t versionId, uint64_t restoreVersion) {
-        for (int i = restoreVersion; i >= 1; i--) {
-            uint64_t cid = 0;
-            while (1) {
-                sprintf(filePath, VersionFilePath.data(), i, versionId, cid);
-                FileOperator archivedReader(filePath, FileOpenType::TRY);
-                if (!archivedReader.ok()) {
-                    break;
-                }
-              cid++;
-              counter++;
-            }
-            uint64_t cidMax = cid - 1;
-
-            for (int j = cidMax; j >= 0; j--) {
-                sprintf(filePath, VersionFilePath.data(), i, versionId, j);
-                FileOperator archivedReader(filePath, FileOpenType::Read);
-                uint8_t *readBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-                gettimeofday(&rt0, NULL);
-                uint64_t readLength = archivedReader.read(readBuffer, RestoreReadBufferLength);
-                gettimeofday(&rt1, NULL);
-                readTime += (rt1.tv_sec - rt0.tv_sec) * 1000000 + rt1.tv_usec - rt0.tv_usec;;
-
-//                uint8_t *decompressBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-//                gettimeofday(&dt0, NULL);
-//                size_t decompressedSize = ZSTD_decompress(decompressBuffer, RestoreReadBufferLength, readBuffer,
-//                                                          readLength);
-//                gettimeofday(&dt1, NULL);
-//                decompressionTime += (dt1.tv_sec - dt0.tv_sec) * 1000000 + dt1.tv_usec - dt0.tv_usec;;
-//                assert(!ZSTD_isError(decompressedSize));
-//                free(readBuffer);
-
-                RestoreParseTask *restoreParseTask = new RestoreParseTask(readBuffer, readLength,
-                                                                          readLength);
-                restoreParseTask->index = versionId;
-                GlobalRestoreDecomPipelinePtr->addTask(restoreParseTask);
-            }
-        }
-
-    }
-
+    void containerReadCallback() {
+        pthread_setname_np(pthread_self(), "RReading");
+        struct timeval rt0, rt1;
 
-    int readFromCategoryFile(uint64_t classId, uint64_t column) {
-        uint64_t cid = 0;
         while (1) {
-            sprintf(filePath, ClassFilePath.data(), classId, column, cid);
-            FileOperator activeReader(filePath, FileOpenType::TRY);
-            if (!activeReader.ok()) {
+            uint64_t sequence = nextRead++;
+            if (sequence >= readList.size()) {
                 break;
             }
-          cid++;
-          counter++;
-        }
-        uint64_t cidMax = cid - 1;
+            GlobalRestoreWritePipelinePtr->waitWindow(sequence);
 
-        for (int j = cidMax; j >= 0; j--) {
-            sprintf(filePath, ClassFilePath.data(), classId, column, j);
-            FileOperator activeReader(filePath, FileOpenType::Read);
             uint8_t *readBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
             gettimeofday(&rt0, NULL);
-            uint64_t readLength = activeReader.read(readBuffer, RestoreReadBufferLength);
+            uint64_t readLength = GlobalContainerCatalog.read(readList[sequence].location, readBuffer,
+                                                              RestoreReadBufferLength);
             gettimeofday(&rt1, NULL);
-            readTime += (rt1.tv_sec - rt0.tv_sec) * 1000000 + rt1.tv_usec - rt0.tv_usec;;
-
-//            uint8_t *decompressBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-//            gettimeofday(&dt0, NULL);
-//            size_t decompressedSize = ZSTD_decompress(decompressBuffer, RestoreReadBufferLength, readBuffer,
-//                                                      readLength);
-//            gettimeofday(&dt1, NULL);
-//            decompressionTime += (dt1.tv_sec - dt0.tv_sec) * 1000000 + dt1.tv_usec - dt0.tv_usec;;
-//            assert(!ZSTD_isError(decompressedSize));
-//            free(readBuffer);
+            readTime += (rt1.tv_sec - rt0.tv_sec) * 1000000 + rt1.tv_usec - rt0.tv_usec;
+            if (readLength != readList[sequence].location.length) {
+                printf("Container in Segment%lu at %lu can not be read\n", readList[sequence].location.segment,
+                       readList[sequence].location.offset);
+                free(readBuffer);
+                GlobalRestoreWritePipelinePtr->containerFailed();
+                continue;
+            }
 
             RestoreParseTask *restoreParseTask = new RestoreParseTask(readBuffer, readLength, readLength);
-            restoreParseTask->index = column;
+            restoreParseTask->index = readList[sequence].index;
+            restoreParseTask->sequence = sequence;
             GlobalRestoreDecomPipelinePtr->addTask(restoreParseTask);
         }
     }
 
-    int readFromAppendCategoryFile(uint64_t classId, uint64_t column) {
-        printf("Trying to load append file.\n");
-
-        uint64_t cid = 0;
-        while (1) {
-            sprintf(filePath, ClassFileAppendPath.data(), classId, column, cid);
-            FileOperator activeReader(filePath, FileOpenType::TRY);
-            if (!activeReader.ok()) {
-                break;
+    // drops containers whose fingerprints show none of their chunks is referenced by the recipe.
+    void selectContainers() {
+        GlobalRestoreParserPipelinePtr->waitRecipe();
+        std::vector<ContainerReadEntry> selectedList;
+        std::vector<SHA1FP> fpList;
+        for (auto &entry: readList) {
+            bool required = true;
+            if (GlobalContainerCatalog.loadIndex(entry.location, fpList)) {
+                required = false;
+                for (const auto &fp: fpList) {
+                    if (GlobalRestoreParserPipelinePtr->isRequired(fp)) {
+                        required = true;
+                        break;
+                    }
+                }
+            }
+            if (required) {
+                selectedList.push_back(entry);
+            } else {
+                skipped++;
             }
-          cid++;
-          counter++;
-        }
-        uint64_t cidMax = cid - 1;
-
-        for (int j = cidMax; j >= 0; j--) {
-            sprintf(filePath, ClassFileAppendPath.data(), classId, column, j);
-            FileOperator activeReader(filePath, FileOpenType::Read);
-            uint8_t *readBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-            gettimeofday(&rt0, NULL);
-            uint64_t readLength = activeReader.read(readBuffer, RestoreReadBufferLength);
-            gettimeofday(&rt1, NULL);
-            readTime += (rt1.tv_sec - rt0.tv_sec) * 1000000 + rt1.tv_usec - rt0.tv_usec;;
-
-//            uint8_t *decompressBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-//            gettimeofday(&dt0, NULL);
-//            size_t decompressedSize = ZSTD_decompress(decompressBuffer, RestoreReadBufferLength, readBuffer,
-//                                                      readLength);
-//            gettimeofday(&dt1, NULL);
-//            decompressionTime += (dt1.tv_sec - dt0.tv_sec) * 1000000 + dt1.tv_usec - dt0.tv_usec;;
-//            assert(!ZSTD_isError(decompressedSize));
-//            free(readBuffer);
-
-            RestoreParseTask *restoreParseTask = new RestoreParseTask(readBuffer, readLength, readLength);
-            restoreParseTask->index = column;
-            GlobalRestoreDecomPipelinePtr->addTask(restoreParseTask);
         }
+        readList.swap(selectedList);
     }
 
-
-    char filePath[256];
     bool runningFlag;
     std::thread *worker;
     uint64_t taskAmount;
@@ -228,11 +157,15 @@ private:
     MutexLock mutexLock;
     Condition condition;
 
-    uint64_t readTime = 0;
+    std::vector<ContainerReadEntry> readList;
+    std::atomic<uint64_t> nextRead{0};
+
+    std::atomic<uint64_t> readTime{0};
 
     uint64_t duration = 0;
 
     uint64_t counter = 0;
+    uint64_t skipped = 0;
 };
 
 static RestoreReadPipeline *GlobalRestoreReadPipelinePtr;
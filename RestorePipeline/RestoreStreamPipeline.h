@@ -0,0 +1,359 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_RESTORESTREAMPIPELINE_H
+#define MEGA_RESTORESTREAMPIPELINE_H
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <zstd.h>
+#include "gflags/gflags.h"
+#include "RestoreReadPipeline.h"
+#include "RestorePlanner.h"
+#include "../Utility/RecipeFormat.h"
+#include "../Utility/ContainerIndex.h"
+#include "../Utility/BasePrefetcher.h"
+#include "../Utility/xxhash.h"
+
+DEFINE_uint64(StreamCacheContainers,
+              16, "decompressed containers kept in memory by streaming restore, at least 2");
+DEFINE_uint64(StreamLookahead,
+              268435456, "bytes of output ahead of the write cursor whose containers are prefetched");
+DEFINE_uint64(StreamBufferSize,
+              4194304, "bytes gathered before each write to the output stream");
+
+struct StreamEntry {
+    SHA1FP fp;
+    SHA1FP baseFP;
+    uint64_t pos;
+    uint32_t length;
+    uint32_t oriLength;
+    bool type;
+};
+
+struct StreamContainer {
+    uint8_t *buffer = nullptr;
+    uint64_t length = 0;
+    uint64_t lastUse = 0;
+    std::unordered_map<SHA1FP, uint64_t, TupleHasher, TupleEqualer> chunks;
+};
+
+// Restores a version, or a range of it, strictly in logical order, so the output can be a pipe.
+// Each chunk is located through the fingerprints stored with its container, containers are prefetched along the
+// recipe and kept decompressed in a small cache which also serves the bases of delta chunks.
+class RestoreStreamer {
+public:
+    RestoreStreamer(const std::string &path, int fd, uint64_t offset = 0, uint64_t length = -1)
+            : recipePath(path), outFd(fd), rangeOffset(offset), rangeLength(length),
+              prefetcher(RestoreReadBufferLength) {
+        lookupCounter = GlobalMetrics.counter("restore_stream_cache_lookups_total");
+        hitCounter = GlobalMetrics.counter("restore_stream_cache_hits_total");
+        outputBytes = GlobalMetrics.counter("restore_stream_output_bytes_total");
+        GlobalMetrics.ratio("restore_stream_cache_hit_rate", "restore_stream_cache_hits_total",
+                            "restore_stream_cache_lookups_total");
+        outBuffer = (uint8_t *) malloc(FLAGS_StreamBufferSize);
+        decodeBuffer = (uint8_t *) malloc(ChunkBufferLength());
+        decompressBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
+        readBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
+    }
+
+    int run(RestoreTask *restoreTask) {
+        struct timeval t0, t1;
+        gettimeofday(&t0, NULL);
+
+        loadRecipe();
+
+        RestorePlanner restorePlanner;
+        restorePlanner.listContainers(restoreTask, containerList);
+        locateChunks();
+
+        uint64_t prefetchCursor = 0;
+        for (uint64_t i = 0; i < entryList.size(); i++) {
+            while (prefetchCursor < entryList.size() &&
+                   entryList[prefetchCursor].pos < entryList[i].pos + FLAGS_StreamLookahead) {
+                prefetch(locationMap[entryList[prefetchCursor].fp]);
+                if (entryList[prefetchCursor].type) {
+                    prefetch(locationMap[entryList[prefetchCursor].baseFP]);
+                }
+                prefetchCursor++;
+            }
+
+            const StreamEntry &entry = entryList[i];
+            uint64_t id = locationMap[entry.fp];
+            uint64_t baseId = entry.type ? locationMap[entry.baseFP] : 0;
+            if (id == (uint64_t) -1 || baseId == (uint64_t) -1) {
+                flush();
+                printf("The stream stops at %lu, a chunk of it is not in the store\n", entry.pos);
+                return 1;
+            }
+            StreamContainer *container = getContainer(id);
+            StreamContainer *baseContainer = entry.type ? getContainer(baseId) : nullptr;
+            if (!container || (entry.type && !baseContainer)) {
+                // the output is a stream, nothing after the lost chunk can be written in order.
+                flush();
+                printf("The stream stops at %lu, a container of it can not be restored\n", entry.pos);
+                return 1;
+            }
+            uint8_t *data = container->buffer + container->chunks[entry.fp];
+            if (entry.type) {
+                uint8_t *base = baseContainer->buffer + baseContainer->chunks[entry.baseFP];
+                BlockHeader *baseHeader = (BlockHeader *) (base - sizeof(BlockHeader));
+                usize_t oriSize = 0;
+                int r = xd3_decode_memory(data, entry.length, base, baseHeader->length,
+                                          decodeBuffer, &oriSize, ChunkBufferLength(),
+                                          XD3_COMPLEVEL_1 | XD3_NOCOMPRESS);
+                if (r != 0 || oriSize != entry.oriLength) {
+                    flush();
+                    printf("The stream stops at %lu, a delta chunk of it can not be decoded\n", entry.pos);
+                    return 1;
+                }
+                addDigest(decodeBuffer, oriSize, entry.pos);
+                emit(decodeBuffer, oriSize, entry.pos);
+                deltaCounter++;
+            } else {
+                addDigest(data, entry.length, entry.pos);
+                emit(data, entry.length, entry.pos);
+            }
+        }
+        flush();
+
+        gettimeofday(&t1, NULL);
+        duration = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
+        return checkDigest();
+    }
+
+    // the whole version is streamed, the output is checked against its digest. 0 is no digest.
+    void setDigest(uint64_t digest) {
+        expectedDigest = digest;
+    }
+
+    uint64_t getTotalSize() {
+        return rangeEnd - rangeBegin;
+    }
+
+    ~RestoreStreamer() {
+        printf("[RestoreStream] total:%lu us, output:%lu Bytes, chunks:%lu, delta chunks:%lu\n", duration,
+               outputLength, (uint64_t) entryList.size(), deltaCounter);
+        printf("[RestoreStream] containers:%lu, loads:%lu, cache hits:%lu, prefetch hits:%lu, prefetch waits:%lu\n",
+               (uint64_t) containerList.size(), loadCounter, cacheHit, prefetchHit, prefetcher.getWaitCounter());
+        prefetcher.reset();
+        for (auto &entry: cache) {
+            free(entry.second->buffer);
+            delete entry.second;
+        }
+        free(outBuffer);
+        free(decodeBuffer);
+        free(decompressBuffer);
+        free(readBuffer);
+    }
+
+private:
+    void loadRecipe() {
+        RecipeReader recipeReader((char *) recipePath.data());
+        uint64_t versionSize = recipeReader.getTotalSize();
+        rangeBegin = std::min(rangeOffset, versionSize);
+        rangeEnd = rangeBegin + std::min(rangeLength, versionSize - rangeBegin);
+        recipeReader.scan(rangeBegin, rangeEnd, [&](const BlockHeader &blockHeader, uint64_t pos) {
+            entryList.push_back({blockHeader.fp, blockHeader.baseFP, pos, (uint32_t) blockHeader.length,
+                                 (uint32_t) blockHeader.oriLength, (bool) blockHeader.type});
+            locationMap[blockHeader.fp] = -1;
+            if (blockHeader.type) {
+                locationMap[blockHeader.baseFP] = -1;
+            }
+        });
+        printf("total size:%lu, restore range:[%lu, %lu)\n", versionSize, rangeBegin, rangeEnd);
+        if (rangeBegin || rangeEnd != versionSize) {
+            expectedDigest = 0;
+        }
+    }
+
+    // the first (newest) container holding a chunk serves it, the same one the file restore would apply last.
+    void locateChunks() {
+        uint64_t unlocated = locationMap.size();
+        std::vector<SHA1FP> fpList;
+        for (uint64_t i = 0; i < containerList.size() && unlocated; i++) {
+            if (!GlobalContainerCatalog.loadIndex(containerList[i].location, fpList)) {
+                // no fingerprints stored, learn the fingerprints from the container itself.
+                fpList.clear();
+                StreamContainer *container = getContainer(i);
+                if (!container) {
+                    // its chunks stay unlocated, unless an older container holds them too.
+                    continue;
+                }
+                for (const auto &chunk: container->chunks) {
+                    fpList.push_back(chunk.first);
+                }
+            }
+            for (const auto &fp: fpList) {
+                auto iter = locationMap.find(fp);
+                if (iter != locationMap.end() && iter->second == (uint64_t) -1) {
+                    iter->second = i;
+                    unlocated--;
+                }
+            }
+        }
+    }
+
+    // -1: the chunk is not in the store, the stream stops when it gets there.
+    void prefetch(uint64_t id) {
+        if (id == (uint64_t) -1 || cache.find(id) != cache.end() || requested.find(id) != requested.end()) {
+            return;
+        }
+        if (prefetcher.addTask(id, containerList[id].location)) {
+            requested.insert(id);
+        }
+    }
+
+    // nullptr: the container can not be read or decompressed.
+    StreamContainer *getContainer(uint64_t id) {
+        tick++;
+        lookupCounter->add();
+        auto iter = cache.find(id);
+        if (iter != cache.end()) {
+            cacheHit++;
+            hitCounter->add();
+            iter->second->lastUse = tick;
+            return iter->second;
+        }
+
+        StreamContainer *container = new StreamContainer;
+        uint64_t compressedLength;
+        uint8_t *buffer = nullptr;
+        if (requested.erase(id) && prefetcher.acquire(id, &buffer, &container->length, &compressedLength)) {
+            prefetchHit++;
+            container->buffer = buffer;
+        } else {
+            const ContainerLocation &location = containerList[id].location;
+            compressedLength = GlobalContainerCatalog.read(location, readBuffer, RestoreReadBufferLength);
+            if (compressedLength == location.length) {
+                container->length = ZSTD_decompress(decompressBuffer, RestoreReadBufferLength, readBuffer,
+                                                    compressedLength);
+            }
+            if (compressedLength != location.length || ZSTD_isError(container->length)) {
+                printf("Container in Segment%lu at %lu can not be read\n", location.segment, location.offset);
+                delete container;
+                return nullptr;
+            }
+            container->buffer = (uint8_t *) malloc(container->length);
+            memcpy(container->buffer, decompressBuffer, container->length);
+        }
+        loadCounter++;
+
+        uint64_t offset = 0;
+        while (offset < container->length) {
+            BlockHeader *blockHeader = (BlockHeader *) (container->buffer + offset);
+            container->chunks[blockHeader->fp] = offset + sizeof(BlockHeader);
+            offset += sizeof(BlockHeader) + blockHeader->length;
+        }
+        container->lastUse = tick;
+
+        if (cache.size() >= std::max(FLAGS_StreamCacheContainers, (uint64_t) 2)) {
+            // the entry being restored touched at most the last two containers, which are never the oldest.
+            auto victim = cache.begin();
+            for (auto cacheIter = cache.begin(); cacheIter != cache.end(); cacheIter++) {
+                if (cacheIter->second->lastUse < victim->second->lastUse) {
+                    victim = cacheIter;
+                }
+            }
+            free(victim->second->buffer);
+            delete victim->second;
+            cache.erase(victim);
+        }
+        cache[id] = container;
+        return container;
+    }
+
+    // writes the part of a chunk inside the range, the stream is contiguous as chunks come in order.
+    void emit(uint8_t *data, uint64_t length, uint64_t pos) {
+        uint64_t begin = std::max(pos, rangeBegin);
+        uint64_t end = std::min(pos + length, rangeEnd);
+        if (begin >= end) {
+            return;
+        }
+        data += begin - pos;
+        length = end - begin;
+        while (length) {
+            uint64_t n = std::min(length, FLAGS_StreamBufferSize - outUsed);
+            memcpy(outBuffer + outUsed, data, n);
+            outUsed += n;
+            data += n;
+            length -= n;
+            if (outUsed == FLAGS_StreamBufferSize) {
+                flush();
+            }
+        }
+    }
+
+    void flush() {
+        uint64_t written = 0;
+        while (written < outUsed) {
+            ssize_t r = ::write(outFd, outBuffer + written, outUsed - written);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                printf("Can not write restore stream : %s\n", strerror(errno));
+                exit(1);
+            }
+            written += r;
+        }
+        outputLength += outUsed;
+        outputBytes->add(outUsed);
+        outUsed = 0;
+    }
+
+    void addDigest(const uint8_t *data, uint64_t length, uint64_t pos) {
+        if (expectedDigest) {
+            digestSum += XXH64(data, length, pos);
+        }
+    }
+
+    // 0: the output matches the digest of the version, or there is none.
+    int checkDigest() {
+        if (!expectedDigest) {
+            return 0;
+        }
+        if (digestSum != expectedDigest) {
+            printf("The restored version does not match its digest\n");
+            return 1;
+        }
+        printf("The restored version matches its digest %016lx\n", expectedDigest);
+        return 0;
+    }
+
+    std::string recipePath;
+    int outFd;
+    uint64_t rangeOffset;
+    uint64_t rangeLength;
+    uint64_t rangeBegin = 0;
+    uint64_t rangeEnd = 0;
+
+    std::vector<StreamEntry> entryList;
+    std::vector<ContainerReadEntry> containerList;
+    std::unordered_map<SHA1FP, uint64_t, TupleHasher, TupleEqualer> locationMap;
+    std::unordered_map<uint64_t, StreamContainer *> cache;
+    std::unordered_set<uint64_t> requested;
+    BasePrefetcher prefetcher;
+    uint64_t tick = 0;
+
+    uint8_t *outBuffer;
+    uint64_t outUsed = 0;
+    uint8_t *decodeBuffer;
+    uint8_t *decompressBuffer;
+    uint8_t *readBuffer;
+
+    uint64_t duration = 0;
+    uint64_t outputLength = 0;
+    uint64_t deltaCounter = 0;
+    uint64_t loadCounter = 0;
+    uint64_t cacheHit = 0;
+    uint64_t prefetchHit = 0;
+    uint64_t expectedDigest = 0;
+    uint64_t digestSum = 0;
+
+    MetricsCounter *lookupCounter;
+    MetricsCounter *hitCounter;
+    MetricsCounter *outputBytes;
+};
+
+#endif //MEGA_RESTORESTREAMPIPELINE_H
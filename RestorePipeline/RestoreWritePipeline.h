@@ -10,111 +10,235 @@
 #define MEGA_RESTOREWRITEPIPELINE_H
 
 #include <zstd.h>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <algorithm>
+#include "gflags/gflags.h"
+#include "../Utility/DurabilityManager.h"
+#include "../Utility/xxhash.h"
+#include "../RollHash/ChunkingProfile.h"
 
-#define ChunkBufferSize 65536
 
-class FileFlusher {
+DEFINE_uint64(RestoreWindow,
+              32, "max containers in flight during restore");
+DEFINE_uint64(RestoreDecodeThreads,
+              4, "threads decoding delta chunks during restore");
+
+class RestoreWritePipeline {
 public:
-    FileFlusher(FileOperator *f) : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock),
-                                   fileOperator(f) {
-        worker = new std::thread(std::bind(&FileFlusher::fileFlusherCallback, this));
+    RestoreWritePipeline(std::string restorePath, CountdownLatch *cd) : countdownLatch(cd), runningFlag(true),
+                                                                        taskAmount(0), mutexLock(), condition(mutexLock),
+                                                                        windowCondition(mutexLock) {
+        fileOperator = new FileOperator((char*)restorePath.data(), FileOpenType::Write);
+        fd = fileOperator->getFd();
+        for (uint64_t i = 0; i < FLAGS_RestoreDecodeThreads; i++) {
+            workers.push_back(new std::thread(std::bind(&RestoreWritePipeline::restoreDecodeCallback, this)));
+        }
     }
 
-    int addTask(uint64_t task) {
-        MutexLockGuard mutexLockGuard(mutexLock);
-        taskList.push_back(task);
-        taskAmount++;
-        condition.notify();
+    // plain chunks do not depend on anything else, so parser workers write them in place concurrently.
+    int writeChunk(uint8_t *buffer, uint64_t length, uint64_t pos) {
+        struct timeval wt1, wt2;
+        gettimeofday(&wt1, NULL);
+        writeRange(buffer, length, pos);
+        gettimeofday(&wt2, NULL);
+        writeTime += (wt2.tv_sec - wt1.tv_sec) * 1000000 + wt2.tv_usec - wt1.tv_usec;
+        addDigest(buffer, length, pos);
+        chunkCounter++;
+        return 0;
     }
 
-    ~FileFlusher(){
-        addTask(-1);
-        worker->join();
+    // a delta chunk and its base meet by the position they restore to, whichever comes first is copied aside.
+    int addDelta(uint8_t *buffer, uint64_t length, uint64_t pos, RestoreParseTask *owner) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        RestoreDecodeTask *&task = pendingMap[pos];
+        if (task == nullptr) {
+            task = new RestoreDecodeTask(pos);
+        }
+        if (task->delta) {
+            return 0;
+        }
+        if (task->base) {
+            task->setDelta(buffer, length, owner);
+            dispatch(task);
+        } else {
+            task->copyDelta(buffer, length);
+            copiedBytes += length;
+        }
+        return 0;
     }
 
-
-private:
-
-    void fileFlusherCallback(){
-        pthread_setname_np(pthread_self(), "Restore Flushing Thread");
-        uint64_t task;
-        while (likely(runningFlag)) {
-            {
-                MutexLockGuard mutexLockGuard(mutexLock);
-                while (!taskAmount) {
-                    condition.wait();
-                    if (unlikely(!runningFlag)) break;
-                }
-                if (unlikely(!runningFlag)) continue;
-                taskAmount--;
-                task = taskList.front();
-                taskList.pop_front();
-            }
-
-            if(task == -1){
-                break;
-            }
-
-            fileOperator->fdatasync();
+    int addBase(uint8_t *buffer, uint64_t length, uint64_t deltaLength, uint64_t pos, RestoreParseTask *owner) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        RestoreDecodeTask *&task = pendingMap[pos];
+        if (task == nullptr) {
+            task = new RestoreDecodeTask(pos);
+        }
+        if (task->base) {
+            return 0;
         }
+        if (task->delta) {
+            assert(task->deltaLength == deltaLength);
+            task->setBase(buffer, length, owner);
+            dispatch(task);
+        } else {
+            task->copyBase(buffer, length);
+            copiedBytes += length;
+        }
+        return 0;
     }
 
-    std::thread* worker;
-    bool runningFlag;
-    uint64_t taskAmount;
-    std::list<uint64_t> taskList;
-    MutexLock mutexLock;
-    Condition condition;
-    FileOperator* fileOperator;
-};
+    int containerDone() {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        finishedContainers++;
+        windowCondition.notifyAll();
+        checkFinish();
+        return 0;
+    }
 
-class RestoreWritePipeline {
-public:
-    RestoreWritePipeline(std::string restorePath, CountdownLatch *cd) : taskAmount(0), runningFlag(true), mutexLock(),
-                                               condition(mutexLock), countdownLatch(cd) {
-        fileOperator = new FileOperator((char*)restorePath.data(), FileOpenType::Write);
-        worker = new std::thread(std::bind(&RestoreWritePipeline::restoreWriteCallback, this));
+    // a container which can not be read or decompressed counts as finished, the restore fails at its end.
+    int containerFailed() {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        failedContainers++;
+        finishedContainers++;
+        windowCondition.notifyAll();
+        checkFinish();
+        return 0;
     }
 
-    int addTask(RestoreWriteTask *restoreWriteTask) {
+    int setContainerAmount(uint64_t amount) {
         MutexLockGuard mutexLockGuard(mutexLock);
-        taskList.push_back(restoreWriteTask);
-        taskAmount++;
-        condition.notify();
+        containerAmount = amount;
+        checkFinish();
+        return 0;
+    }
+
+    // bounds how far reading, decompression and parsing may run ahead of finished containers.
+    void waitWindow(uint64_t sequence) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        while (sequence >= finishedContainers + FLAGS_RestoreWindow) {
+            windowCondition.wait();
+        }
     }
 
     ~RestoreWritePipeline() {
-        printf("[RestoreWrite] total :%lu us\n", duration);
-        printf("[RestoreWrite] extra read time:%lu us, decoding time:%lu us, write time:%lu\n", readTime, decodingTime,
-               writeTime);
-        printf("write amplification: %f (%lu / %lu Bytes)\n", (float) extraIO / normalIO, extraIO, normalIO);
-        printf("total chunks:%lu, delta chunks:%lu\n", chunkCounter, deltaCounter);
-        runningFlag = false;
-        condition.notifyAll();
-        worker->join();
-    }
-
-    int setSize(uint64_t size){
-        totalSize = size;
+        printf("[RestoreWrite] decoding time:%lu us, write time:%lu us\n", (uint64_t) decodingTime,
+               (uint64_t) writeTime);
+        printf("[RestoreWrite] delta payload kept in memory:%lu Bytes\n", copiedBytes);
+        printf("total chunks:%lu, delta chunks:%lu\n", (uint64_t) chunkCounter, (uint64_t) deltaCounter);
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            runningFlag = false;
+            condition.notifyAll();
+        }
+        for (auto worker: workers) {
+            worker->join();
+            delete worker;
+        }
+        for (auto &entry: pendingMap) {
+            delete entry.second;
+        }
+    }
+
+    // positions handed in are offsets in the version, only [begin, end) of it goes to the output.
+    int setRange(uint64_t begin, uint64_t end) {
+        rangeBegin = begin;
+        rangeEnd = end;
+        totalSize = end - begin;
         if (fileOperator){
-            fileOperator->trunc(size);
+            fileOperator->trunc(totalSize);
         }
+        return 0;
     }
 
     uint64_t getTotalSize(){
         return totalSize;
     }
 
+    // the whole version is restored, the output is checked against its digest. 0 is no digest.
+    void setDigest(uint64_t digest) {
+        expectedDigest = digest;
+    }
+
+    // 0: every container was restored and written, and the output matches the digest of the version, if there is one.
+    int getResult() {
+        return failedContainers || writeFailed || undecodedChunks || digestMismatch;
+    }
+
 private:
-    void restoreWriteCallback() {
-        pthread_setname_np(pthread_self(), "RWriting");
-        RestoreWriteTask *restoreWriteTask;
-        int fd = fileOperator->getFd();
-        FileFlusher fileFlusher(fileOperator);
-        uint8_t *deltaBuffer = (uint8_t *) malloc(ChunkBufferSize);
-        uint8_t *oriBuffer = (uint8_t *) malloc(ChunkBufferSize);
+    void writeRange(uint8_t *buffer, uint64_t length, uint64_t pos) {
+        uint64_t begin = std::max(pos, rangeBegin);
+        uint64_t end = std::min(pos + length, rangeEnd);
+        if (begin >= end) {
+            return;
+        }
+        ssize_t r = pwrite(fd, buffer + (begin - pos), end - begin, begin - rangeBegin);
+        if (r != (ssize_t) (end - begin)) {
+            // a short write leaves part of the chunk out as much as a failed one, the first is reported.
+            if (!writeFailed.exchange(true)) {
+                printf("Can not write the restored data at %lu : %s\n", begin - rangeBegin,
+                       r < 0 ? strerror(errno) : "short write");
+            }
+            return;
+        }
+        durability.written(fd, begin - rangeBegin, end - begin);
+        normalIO += end - begin;
+    }
+
+    // chunks are written in no particular order, the sum of their digests does not depend on it.
+    void addDigest(uint8_t *buffer, uint64_t length, uint64_t pos) {
+        if (!expectedDigest) return;
+        digestSum += XXH64(buffer, length, pos);
+        digestLength += length;
+    }
+
+    // called with mutexLock held, every write has returned.
+    void checkDigest() {
+        if (!expectedDigest) return;
+        if (digestLength != totalSize || digestSum != expectedDigest) {
+            digestMismatch = 1;
+            printf("The restored version does not match its digest\n");
+        } else {
+            printf("The restored version matches its digest %016lx\n", expectedDigest);
+        }
+    }
+
+    // called with mutexLock held.
+    void dispatch(RestoreDecodeTask *task) {
+        taskList.push_back(task);
+        taskAmount++;
+        decodeInflight++;
+        condition.notify();
+    }
+
+    // called with mutexLock held.
+    void checkFinish() {
+        if (finished || finishedContainers != containerAmount || decodeInflight) {
+            return;
+        }
+        finished = true;
+        if (failedContainers) {
+            printf("%lu containers can not be restored, the output is incomplete\n", failedContainers);
+        } else if (writeFailed) {
+            printf("The restored data can not be written, the output is incomplete\n");
+        } else if (!pendingMap.empty()) {
+            // a delta chunk without its base, or the other way round, means the restore set is incomplete.
+            undecodedChunks = pendingMap.size();
+            printf("%lu delta chunks can not be decoded, the output is incomplete\n", undecodedChunks);
+        } else {
+            checkDigest();
+        }
+        durability.commit();
+        countdownLatch->countDown();
+    }
+
+    void restoreDecodeCallback() {
+        pthread_setname_np(pthread_self(), "RDecoding");
+        uint8_t *oriBuffer = (uint8_t *) malloc(ChunkBufferLength());
         usize_t oriSize = 0;
-        struct timeval t0, t1, dt1, dt2, rt1, rt2, wt1, wt2;
+        RestoreDecodeTask *task;
+        struct timeval dt1, dt2, wt1, wt2;
 
         while (likely(runningFlag)) {
             {
@@ -125,88 +249,75 @@ private:
                 }
                 if (unlikely(!runningFlag)) continue;
                 taskAmount--;
-                restoreWriteTask = taskList.front();
+                task = taskList.front();
                 taskList.pop_front();
             }
-            gettimeofday(&t0, NULL);
-
-            if (unlikely(restoreWriteTask->endFlag)) {
-                delete restoreWriteTask;
-                fileOperator->fdatasync();
-                countdownLatch->countDown();
-                gettimeofday(&t1, NULL);
-                duration += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
-                break;
-            }
-            chunkCounter++;
 
-            if (restoreWriteTask->base) {
-                gettimeofday(&rt1, NULL);
-                pread(fd, deltaBuffer, restoreWriteTask->deltaLength, restoreWriteTask->pos);
-                gettimeofday(&rt2, NULL);
-                extraIO += restoreWriteTask->deltaLength;
-                readTime += (rt2.tv_sec - rt1.tv_sec) * 1000000 + rt2.tv_usec - rt1.tv_usec;;
-                gettimeofday(&dt1, NULL);
-
-                int r = xd3_decode_memory(deltaBuffer, restoreWriteTask->deltaLength, restoreWriteTask->buffer,
-                                          restoreWriteTask->length,
-                                          oriBuffer, &oriSize, ChunkBufferSize,
-                                          XD3_COMPLEVEL_1 | XD3_NOCOMPRESS);
-                gettimeofday(&dt2, NULL);
-                deltaCounter++;
-                decodingTime += (dt2.tv_sec - dt1.tv_sec) * 1000000 + dt2.tv_usec - dt1.tv_usec;
-                assert(r == 0);
-                gettimeofday(&wt1, NULL);
-                pwrite(fd, oriBuffer, oriSize, restoreWriteTask->pos);
-                gettimeofday(&wt2, NULL);
-                writeTime += (wt2.tv_sec - wt1.tv_sec) * 1000000 + wt2.tv_usec - wt1.tv_usec;
-                normalIO += oriSize;
-            } else {
-                gettimeofday(&wt1, NULL);
-//                fileOperator->seek(restoreWriteTask->pos);
-//                fileOperator->write(restoreWriteTask->buffer, restoreWriteTask->length);
-                pwrite(fd, restoreWriteTask->buffer, restoreWriteTask->length, restoreWriteTask->pos);
-                gettimeofday(&wt2, NULL);
-                writeTime += (wt2.tv_sec - wt1.tv_sec) * 1000000 + wt2.tv_usec - wt1.tv_usec;
-                normalIO += restoreWriteTask->length;
-            }
+            gettimeofday(&dt1, NULL);
+            int r = xd3_decode_memory(task->delta, task->deltaLength, task->base, task->baseLength,
+                                      oriBuffer, &oriSize, ChunkBufferLength(),
+                                      XD3_COMPLEVEL_1 | XD3_NOCOMPRESS);
+            gettimeofday(&dt2, NULL);
+            decodingTime += (dt2.tv_sec - dt1.tv_sec) * 1000000 + dt2.tv_usec - dt1.tv_usec;
+            assert(r == 0);
+            gettimeofday(&wt1, NULL);
+            writeRange(oriBuffer, oriSize, task->pos);
+            gettimeofday(&wt2, NULL);
+            writeTime += (wt2.tv_sec - wt1.tv_sec) * 1000000 + wt2.tv_usec - wt1.tv_usec;
+            addDigest(oriBuffer, oriSize, task->pos);
+            deltaCounter++;
+            chunkCounter++;
 
-            syncCounter++;
-            if(syncCounter > 1024){
-                fileFlusher.addTask(1);
-                syncCounter = 0;
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                // pendingMap only holds the chunks waiting for their other half or being decoded.
+                pendingMap.erase(task->pos);
+                decodeInflight--;
+                checkFinish();
             }
-
-            delete restoreWriteTask;
-            gettimeofday(&t1, NULL);
-            duration += (t1.tv_sec-t0.tv_sec)*1000000 + t1.tv_usec - t0.tv_usec;
+            delete task;
         }
-        free(deltaBuffer);
         free(oriBuffer);
     }
 
 
     CountdownLatch *countdownLatch;
     bool runningFlag;
-    std::thread *worker;
+    std::vector<std::thread *> workers;
     uint64_t taskAmount;
-    std::list<RestoreWriteTask *> taskList;
+    std::list<RestoreDecodeTask *> taskList;
+    std::unordered_map<uint64_t, RestoreDecodeTask *> pendingMap;
+    uint64_t decodeInflight = 0;
+    uint64_t finishedContainers = 0;
+    uint64_t failedContainers = 0;
+    uint64_t undecodedChunks = 0;
+    uint64_t containerAmount = -1;
+    bool finished = false;
     MutexLock mutexLock;
     Condition condition;
+    Condition windowCondition;
     FileOperator *fileOperator = nullptr;
+    // the restored file is not part of the store, it is synced in groups whatever the store does.
+    DurabilityManager durability{SyncPolicy::Group};
+    int fd;
 
     uint64_t totalSize = 0;
-    uint64_t deltaCounter = 0, chunkCounter = 0;
-
-    uint64_t duration = 0;
-    uint64_t decodingTime = 0;
-    uint64_t writeTime = 0;
-    uint64_t readTime = 0;
-
-    uint64_t syncCounter = 0;
-
-    uint64_t extraIO = 0;
-    uint64_t normalIO = 0;
+    uint64_t rangeBegin = 0;
+    uint64_t rangeEnd = -1;
+    std::atomic<uint64_t> deltaCounter{0};
+    std::atomic<uint64_t> chunkCounter{0};
+    uint64_t copiedBytes = 0;
+
+    std::atomic<uint64_t> decodingTime{0};
+    std::atomic<uint64_t> writeTime{0};
+
+    std::atomic<uint64_t> normalIO{0};
+    std::atomic<bool> writeFailed{false};
+
+    std::atomic<uint64_t> digestSum{0};
+    std::atomic<uint64_t> digestLength{0};
+    uint64_t expectedDigest = 0;
+    int digestMismatch = 0;
 };
 
 static RestoreWritePipeline *GlobalRestoreWritePipelinePtr;
@@ -0,0 +1,282 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_VERIFIER_H
+#define MEGA_VERIFIER_H
+
+#include <set>
+#include <atomic>
+#include <map>
+#include <vector>
+#include <cstdarg>
+#include <unordered_map>
+#include "gflags/gflags.h"
+#include "isa-l_crypto/mh_sha1.h"
+#include "../xdelta/xdelta3.h"
+#include "../MetadataManager/MetadataManager.h"
+#include "../Utility/ContainerCatalog.h"
+#include "../Utility/ContainerScanner.h"
+#include "../Utility/RecipeFormat.h"
+
+DEFINE_uint64(VerifyThreads,
+              4, "threads decompressing and checking containers during verify");
+DEFINE_uint64(VerifyReadRate,
+              0, "bytes per second verify reads from the store, 0 is unlimited");
+DEFINE_uint64(VerifyCpuPercent,
+              100, "share of a core, in percent, every verify thread may use");
+
+struct VerifyDelta {
+    SHA1FP fp;
+    SHA1FP baseFP;
+    uint64_t chunk;
+    uint64_t oriLength;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// what one container holds, deltas are kept until their bases are read.
+struct ContainerCheck {
+    std::vector<std::pair<SHA1FP, uint8_t>> chunkList;
+    std::vector<VerifyDelta> deltaList;
+    std::vector<uint8_t> deltaData;
+};
+
+// Checks the whole store without restoring it. The first scan decompresses every container, recomputes the
+// fingerprint of every full chunk and compares the fingerprint index stored behind the container with its content.
+// Deltas are kept in memory, they are the smallest part of the store, and a second scan reads only the containers
+// holding their bases and decodes every delta against its base. Last, every chunk every recipe refers to has to
+// be in a container, a delta together with its base. Problems are reported with the container they are in.
+class Verifier {
+public:
+    Verifier() : scanner(FLAGS_VerifyThreads, FLAGS_VerifyReadRate, FLAGS_VerifyCpuPercent), reportLock() {
+    }
+
+    // 0: no problem was found.
+    int run(uint64_t totalVersion) {
+        printf("-----------------------Verifying-----------------------\n");
+        CatalogMap entries = GlobalContainerCatalog.getEntries();
+        for (const auto &entry: entries) {
+            keyList.push_back(entry.first);
+            locationList.push_back(entry.second);
+        }
+        checkList.resize(keyList.size());
+        printf("%lu containers to verify with %lu threads\n", (uint64_t) keyList.size(), FLAGS_VerifyThreads);
+
+        scanner.scan(locationList, [this](uint64_t index, const uint8_t *raw, uint64_t rawLength) {
+            checkContainer(index, raw, rawLength);
+        });
+        printf("Checked %lu chunks in %lu bytes (%lu decompressed) in %lu us\n", chunkCounter.load(),
+               scanner.getReadBytes(), scanner.getRawBytes(), scanner.getScanTime());
+
+        checkDeltas();
+        printf("Decoded %lu deltas against their bases\n", deltaCounter.load());
+
+        uint64_t unresolved = checkRecipes(totalVersion);
+
+        printf("%lu problems in %lu containers, %lu unresolved recipe references\n", problems,
+               (uint64_t) corruptedSet.size(), unresolved);
+        if (!problems && !unresolved) {
+            printf("The store is consistent\n");
+            return 0;
+        }
+        return 1;
+    }
+
+private:
+    void checkContainer(uint64_t index, const uint8_t *raw, uint64_t rawLength) {
+        if (!raw) {
+            report(index, "can not be read, does not match its checksum or can not be decompressed");
+            return;
+        }
+        ContainerCheck &check = checkList[index];
+        uint64_t offset = 0, chunk = 0;
+        while (offset < rawLength) {
+            if (offset + sizeof(BlockHeader) > rawLength) {
+                report(index, "ends within the header of chunk %lu", chunk);
+                break;
+            }
+            const BlockHeader *blockHeader = (const BlockHeader *) (raw + offset);
+            const uint8_t *data = raw + offset + sizeof(BlockHeader);
+            if (offset + sizeof(BlockHeader) + blockHeader->length > rawLength) {
+                report(index, "ends within chunk %lu", chunk);
+                break;
+            }
+            if (blockHeader->type) {
+                check.deltaList.push_back({blockHeader->fp, blockHeader->baseFP, chunk, blockHeader->oriLength,
+                                           check.deltaData.size(), blockHeader->length});
+                check.deltaData.insert(check.deltaData.end(), data, data + blockHeader->length);
+            } else if (!sameFP(fingerprint(data, blockHeader->length), blockHeader->fp)) {
+                report(index, "chunk %lu does not match its fingerprint", chunk);
+            }
+            check.chunkList.push_back({blockHeader->fp, (uint8_t) blockHeader->type});
+            offset += sizeof(BlockHeader) + blockHeader->length;
+            chunk++;
+        }
+        chunkCounter += chunk;
+
+        std::vector<SHA1FP> fpList;
+        if (GlobalContainerCatalog.loadIndex(locationList[index], fpList)) {
+            bool same = fpList.size() == check.chunkList.size();
+            for (uint64_t i = 0; same && i < fpList.size(); i++) {
+                same = sameFP(fpList[i], check.chunkList[i].first);
+            }
+            if (!same) {
+                report(index, "has a fingerprint index which does not match its content");
+            }
+        } else if (locationList[index].indexLength) {
+            report(index, "has a fingerprint index which can not be read or does not match its checksum");
+        }
+    }
+
+    // deltas are grouped by the container of their base, every base container is read once.
+    void checkDeltas() {
+        std::unordered_map<SHA1FP, uint64_t, TupleHasher, TupleEqualer> fullMap;
+        for (uint64_t rank = 0; rank < checkList.size(); rank++) {
+            for (const auto &chunk: checkList[rank].chunkList) {
+                if (!chunk.second) {
+                    fullMap.emplace(chunk.first, rank);
+                }
+            }
+        }
+
+        std::map<uint64_t, std::vector<std::pair<uint64_t, uint64_t>>> baseGroups;
+        for (uint64_t rank = 0; rank < checkList.size(); rank++) {
+            const auto &deltaList = checkList[rank].deltaList;
+            for (uint64_t i = 0; i < deltaList.size(); i++) {
+                auto iter = fullMap.find(deltaList[i].baseFP);
+                if (iter == fullMap.end()) {
+                    report(rank, "delta chunk %lu has no base", deltaList[i].chunk);
+                    continue;
+                }
+                baseGroups[iter->second].push_back({rank, i});
+            }
+        }
+
+        std::vector<uint64_t> baseRanks;
+        std::vector<ContainerLocation> baseLocations;
+        for (const auto &group: baseGroups) {
+            baseRanks.push_back(group.first);
+            baseLocations.push_back(locationList[group.first]);
+        }
+        scanner.scan(baseLocations, [&](uint64_t index, const uint8_t *raw, uint64_t rawLength) {
+            decodeDeltas(baseGroups.at(baseRanks[index]), raw, rawLength);
+        });
+    }
+
+    void decodeDeltas(const std::vector<std::pair<uint64_t, uint64_t>> &group, const uint8_t *raw,
+                      uint64_t rawLength) {
+        std::unordered_map<SHA1FP, std::pair<const uint8_t *, uint64_t>, TupleHasher, TupleEqualer> baseMap;
+        for (uint64_t offset = 0; raw && offset + sizeof(BlockHeader) <= rawLength;) {
+            const BlockHeader *blockHeader = (const BlockHeader *) (raw + offset);
+            if (offset + sizeof(BlockHeader) + blockHeader->length > rawLength) {
+                break;
+            }
+            if (!blockHeader->type) {
+                baseMap.emplace(blockHeader->fp, std::make_pair(raw + offset + sizeof(BlockHeader),
+                                                                (uint64_t) blockHeader->length));
+            }
+            offset += sizeof(BlockHeader) + blockHeader->length;
+        }
+
+        std::vector<uint8_t> decoded;
+        for (const auto &member: group) {
+            const ContainerCheck &check = checkList[member.first];
+            const VerifyDelta &delta = check.deltaList[member.second];
+            auto iter = baseMap.find(delta.baseFP);
+            if (iter == baseMap.end()) {
+                report(member.first, "delta chunk %lu has no readable base", delta.chunk);
+                continue;
+            }
+            decoded.resize(delta.oriLength + 1);
+            usize_t decodedSize = 0;
+            int r = xd3_decode_memory(check.deltaData.data() + delta.offset, delta.length, iter->second.first,
+                                      iter->second.second, decoded.data(), &decodedSize, decoded.size(),
+                                      XD3_COMPLEVEL_1 | XD3_NOCOMPRESS);
+            if (r != 0 || decodedSize != delta.oriLength ||
+                !sameFP(fingerprint(decoded.data(), decodedSize), delta.fp)) {
+                report(member.first, "delta chunk %lu does not decode to its fingerprint", delta.chunk);
+            }
+            deltaCounter++;
+        }
+    }
+
+    // 0 unresolved references in all recipes.
+    uint64_t checkRecipes(uint64_t totalVersion) {
+        std::unordered_map<SHA1FP, uint8_t, TupleHasher, TupleEqualer> chunkMap;
+        for (const auto &check: checkList) {
+            for (const auto &chunk: check.chunkList) {
+                chunkMap[chunk.first] |= chunk.second ? 2 : 1;
+            }
+        }
+
+        uint64_t unresolved = 0;
+        for (uint64_t version = 1; version <= totalVersion; version++) {
+            char recipePath[256];
+            if (!GlobalContainerCatalog.getRecipePath(version, recipePath)) {
+                printf("Version %lu has no recipe\n", version);
+                unresolved++;
+                continue;
+            }
+            RecipeReader recipeReader(recipePath);
+            uint64_t missing = 0;
+            auto resolves = [&](const SHA1FP &fp, uint8_t kind) {
+                auto iter = chunkMap.find(fp);
+                return iter != chunkMap.end() && (iter->second & kind);
+            };
+            recipeReader.scan(0, recipeReader.getTotalSize(), [&](const BlockHeader &blockHeader, uint64_t) {
+                if (blockHeader.type) {
+                    missing += !resolves(blockHeader.fp, 2) || !resolves(blockHeader.baseFP, 1);
+                } else {
+                    missing += !resolves(blockHeader.fp, 1);
+                }
+            });
+            printf("Version %lu: %lu chunks, %lu do not resolve\n", version, recipeReader.getChunkCount(), missing);
+            unresolved += missing;
+        }
+        return unresolved;
+    }
+
+    static SHA1FP fingerprint(const uint8_t *data, uint64_t length) {
+        SHA1FP fp;
+        memset(&fp, 0, sizeof(SHA1FP));
+        mh_sha1_ctx ctx;
+        mh_sha1_init(&ctx);
+        mh_sha1_update_avx2(&ctx, data, (uint32_t) length);
+        mh_sha1_finalize_avx2(&ctx, &fp);
+        return fp;
+    }
+
+    static bool sameFP(const SHA1FP &a, const SHA1FP &b) {
+        return TupleEqualer()(a, b);
+    }
+
+    void report(uint64_t index, const char *format, ...) {
+        static const char *kindName[] = {"Active", "Append", "Archived"};
+        const CatalogKey &key = keyList[index];
+        const ContainerLocation &location = locationList[index];
+        MutexLockGuard mutexLockGuard(reportLock);
+        printf("Corrupted: %s container (%lu,%lu,%lu) in Segment%lu at %lu ", kindName[(int) key.kind],
+               key.category, key.version, key.cid, location.segment, location.offset);
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        printf("\n");
+        corruptedSet.insert(index);
+        problems++;
+    }
+
+    std::vector<CatalogKey> keyList;
+    std::vector<ContainerLocation> locationList;
+    std::vector<ContainerCheck> checkList;
+    ContainerScanner scanner;
+
+    MutexLock reportLock;
+    std::set<uint64_t> corruptedSet;
+    uint64_t problems = 0;
+    std::atomic<uint64_t> chunkCounter{0};
+    std::atomic<uint64_t> deltaCounter{0};
+};
+
+#endif //MEGA_VERIFIER_H
@@ -0,0 +1,165 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_CHUNKINGPROFILE_H
+#define MEGA_CHUNKINGPROFILE_H
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include "gflags/gflags.h"
+#include "../Utility/StorageTask.h"
+
+extern uint64_t ContainerSize;
+
+DEFINE_string(ChunkingMethod,
+              "FastCDC", "chunking method in chunking");
+DEFINE_int32(ExpectSize,
+             8192, "average chunk size, a power of two from 256 to 2097152 with 16MiB containers");
+DEFINE_uint64(MinChunkSize,
+              0, "smallest chunk, 0 is a quarter of ExpectSize");
+DEFINE_uint64(MaxChunkSize,
+              0, "largest chunk, 0 is eight times ExpectSize, at most 3355379 with 16MiB containers");
+DEFINE_uint64(NormalLevel,
+              2, "FastCDC normalization level, bits the two masks differ from the average by, 0 to 4");
+DEFINE_string(ChunkingProfile,
+              "", "small, default, large or vm, which replace the size flags above, empty uses them");
+
+// a container is flushed once it holds ContainerSize bytes, its buffer has room for one more chunk of this size.
+uint64_t LargestChunkSize() {
+    return (uint64_t) (ContainerSize * 1.2) - ContainerSize - sizeof(BlockHeader);
+}
+
+// the largest power of two below LargestChunkSize().
+uint64_t LargestExpectSize() {
+    uint64_t size = 256;
+    while (size * 2 < LargestChunkSize()) {
+        size *= 2;
+    }
+    return size;
+}
+
+enum class ChunkingMethodType : uint64_t {
+    Unrecorded,
+    FastCDC,
+    Rabin,
+    Fixed,
+};
+
+// How the versions of a store are chunked. It is recorded in the manifest by the first write, later writes
+// chunk the same way so that their chunks keep deduplicating against the store.
+struct ChunkingProfile {
+    uint64_t method;
+    uint64_t expectSize;
+    uint64_t minSize;
+    uint64_t maxSize;
+    uint64_t normalLevel;
+
+    bool operator==(const ChunkingProfile &other) const {
+        return method == other.method && expectSize == other.expectSize && minSize == other.minSize &&
+               maxSize == other.maxSize && normalLevel == other.normalLevel;
+    }
+
+    bool operator!=(const ChunkingProfile &other) const {
+        return !(*this == other);
+    }
+
+    // 0: the sizes can be chunked with.
+    int check() const {
+        if (method == (uint64_t) ChunkingMethodType::Unrecorded || method > (uint64_t) ChunkingMethodType::Fixed) {
+            printf("Unknown chunking method\n");
+            return -1;
+        }
+        if (expectSize < 256 || expectSize > LargestExpectSize() || (expectSize & (expectSize - 1))) {
+            printf("The average chunk size %lu is not a power of two from 256 to %lu\n", expectSize,
+                   LargestExpectSize());
+            return -1;
+        }
+        if (maxSize > LargestChunkSize()) {
+            printf("Chunks of %lu bytes do not fit into a container, the largest is %lu\n", maxSize,
+                   LargestChunkSize());
+            return -1;
+        }
+        if (!minSize || minSize >= expectSize || maxSize <= expectSize) {
+            printf("Chunk sizes %lu <= %lu <= %lu are not in order\n", minSize, expectSize, maxSize);
+            return -1;
+        }
+        if (normalLevel > 4) {
+            printf("Normalization level %lu is above 4\n", normalLevel);
+            return -1;
+        }
+        return 0;
+    }
+
+    void print(const char *prefix) const {
+        static const char *methodName[] = {"unrecorded", "FastCDC", "Rabin", "Fixed"};
+        printf("%s%s, average %lu, min %lu, max %lu, normalization level %lu\n", prefix,
+               methodName[std::min(method, (uint64_t) ChunkingMethodType::Fixed)], expectSize, minSize, maxSize,
+               normalLevel);
+    }
+
+    // the profile the flags ask for.
+    static int fromFlags(ChunkingProfile *profile) {
+        if (FLAGS_ChunkingMethod == "FastCDC") {
+            profile->method = (uint64_t) ChunkingMethodType::FastCDC;
+        } else if (FLAGS_ChunkingMethod == "Rabin") {
+            profile->method = (uint64_t) ChunkingMethodType::Rabin;
+        } else if (FLAGS_ChunkingMethod == "Fixed") {
+            profile->method = (uint64_t) ChunkingMethodType::Fixed;
+        } else {
+            printf("Unknown chunking method %s\n", FLAGS_ChunkingMethod.data());
+            return -1;
+        }
+        if (FLAGS_ChunkingProfile.empty()) {
+            profile->expectSize = FLAGS_ExpectSize;
+            profile->minSize = FLAGS_MinChunkSize ? FLAGS_MinChunkSize : profile->expectSize / 4;
+            profile->maxSize = FLAGS_MaxChunkSize ? FLAGS_MaxChunkSize
+                                                  : std::min(profile->expectSize * 8, LargestChunkSize());
+            profile->normalLevel = FLAGS_NormalLevel;
+        } else if (FLAGS_ChunkingProfile == "small") {
+            setSizes(profile, 4096, 1024, 32768, 2);
+        } else if (FLAGS_ChunkingProfile == "default") {
+            setSizes(profile, 8192, 2048, 65536, 2);
+        } else if (FLAGS_ChunkingProfile == "large") {
+            setSizes(profile, 16384, 4096, 131072, 2);
+        } else if (FLAGS_ChunkingProfile == "vm") {
+            // few and large chunks keep the index of large images small.
+            setSizes(profile, 65536, 16384, 262144, 2);
+        } else {
+            printf("Unknown chunking profile %s\n", FLAGS_ChunkingProfile.data());
+            return -1;
+        }
+        return profile->check();
+    }
+
+    // whether any flag of the profile was given on the command line.
+    static bool requested() {
+        const char *flagList[] = {"ChunkingMethod", "ExpectSize", "MinChunkSize", "MaxChunkSize", "NormalLevel",
+                                  "ChunkingProfile"};
+        for (const char *flag: flagList) {
+            if (!gflags::GetCommandLineFlagInfoOrDie(flag).is_default) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static void setSizes(ChunkingProfile *profile, uint64_t expect, uint64_t min, uint64_t max, uint64_t level) {
+        profile->expectSize = expect;
+        profile->minSize = min;
+        profile->maxSize = max;
+        profile->normalLevel = level;
+    }
+};
+
+ChunkingProfile GlobalChunkingProfile = {(uint64_t) ChunkingMethodType::FastCDC, 8192, 2048, 65536, 2};
+
+// bytes a buffer needs to hold any chunk of the store.
+uint64_t ChunkBufferLength() {
+    return std::max(GlobalChunkingProfile.maxSize, (uint64_t) 65536);
+}
+
+#endif //MEGA_CHUNKINGPROFILE_H
@@ -0,0 +1,91 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_FASTCDC_H
+#define MEGA_FASTCDC_H
+
+#include <algorithm>
+#include "Gear.h"
+
+// bits of the gear fingerprint the masks are made of, in the order they are taken. the first n of them make the mask
+// with n bits, which gives the masks of the original 4096, 8192 and 16384 configurations.
+const int MaskBitOrder[] = {46, 22, 40, 17, 44, 25, 20, 43, 16, 24, 47, 32, 33, 34, 35, 28,
+                            29, 38, 19, 42, 27, 31, 21, 45, 23, 37, 18, 41, 30, 39, 26, 36};
+
+// FastCDC cut point search with normalized chunking, shared by the chunking pipeline and the benchmarks.
+// Before the average size a cut point needs normalLevel bits more than log2(expectSize), after it as many less.
+class FastCDC {
+public:
+    FastCDC(int expectSize) : FastCDC(expectSize, expectSize / 4, expectSize * 8, 2) {
+    }
+
+    FastCDC(int expectSize, int minSize, int maxSize, int normalLevel)
+            : ExpectSize(expectSize), MaxChunkSize(maxSize), MinChunkSize(minSize) {
+        matrix = gear.getMatrix();
+        int bits = 0;
+        while ((1ull << (bits + 1)) <= ExpectSize) {
+            bits++;
+        }
+        chunkMask = deriveMask(bits + normalLevel);
+        chunkMask2 = deriveMask(bits - normalLevel);
+    }
+
+    // a mask of n bits, 1 <= n <= 32.
+    static uint64_t deriveMask(int n) {
+        uint64_t mask = 0;
+        n = std::max(1, std::min(n, (int) (sizeof(MaskBitOrder) / sizeof(int))));
+        for (int i = 0; i < n; i++) {
+            mask |= 1ull << MaskBitOrder[i];
+        }
+        return mask;
+    }
+
+    // length of the chunk starting at p, n bytes are available.
+    int chunk(unsigned char *p, uint64_t n) {
+
+        uint64_t fingerprint = 0;
+        uint64_t i = MinChunkSize, Mid = MinChunkSize + ExpectSize;
+
+        if (n <= MinChunkSize) //the minimal  subChunk Size.
+            return n;
+        if (n > MaxChunkSize)
+            n = MaxChunkSize;
+        else if (n < Mid)
+            Mid = n;
+        while (i < Mid) {
+            fingerprint = (fingerprint << 1) + (matrix[p[i]]);
+            if ((!(fingerprint & chunkMask))) { //AVERAGE*2, *4, *8
+                return i;
+            }
+            i++;
+        }
+        while (i < n) {
+            fingerprint = (fingerprint << 1) + (matrix[p[i]]);
+            if ((!(fingerprint & chunkMask2))) { //Average/2, /4, /8
+                return i;
+            }
+            i++;
+        }
+        return i;
+    }
+
+    int getMaxChunkSize() const {
+        return MaxChunkSize;
+    }
+
+    int getMinChunkSize() const {
+        return MinChunkSize;
+    }
+
+private:
+    Gear gear;
+    uint64_t *matrix;
+    uint64_t chunkMask = 0;
+    uint64_t chunkMask2 = 0;
+    uint64_t ExpectSize;
+    uint64_t MaxChunkSize;
+    uint64_t MinChunkSize;
+};
+
+#endif //MEGA_FASTCDC_H
@@ -0,0 +1,315 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#include <sys/time.h>
+#include <assert.h>
+#include <vector>
+#include <thread>
+#include <random>
+#include <zstd.h>
+#include "gflags/gflags.h"
+#include "isa-l_crypto/mh_sha1.h"
+#include "../RollHash/FastCDC.h"
+#include "../RollHash/Rabin.h"
+#include "../Utility/FileOperator.h"
+#include "../MetadataManager/MetadataManager.h"
+#include "../xdelta/xdelta3.h"
+#include "../Utility/Metrics.h"
+
+// MetadataManager.h refers to these, they are owned by main.cpp in the MeGA binary.
+uint64_t TotalVersion = 0;
+std::string KVPath;
+
+DEFINE_string(BenchData,
+              "", "file the benchmarks run on, empty generates synthetic data");
+DEFINE_uint64(BenchDataSize,
+              67108864, "bytes of synthetic data");
+DEFINE_double(BenchDuplicate,
+              0.5, "share of synthetic data built from repeated fragments, the rest is random");
+DEFINE_double(BenchMutation,
+              0.01, "share of bytes changed between a base chunk and its similar chunk in the delta benchmarks");
+DEFINE_int32(BenchChunkSize,
+             8192, "average chunk size, a power of two for FastCDC");
+DEFINE_int32(BenchLevel,
+             ZSTD_CLEVEL_DEFAULT, "zstd compression level");
+DEFINE_uint64(BenchContainerSize,
+              16777216, "bytes compressed at once by the container benchmarks");
+DEFINE_uint64(BenchThreads,
+              1, "threads running each benchmark, each on its own slice of the data");
+DEFINE_double(BenchMinTime,
+              1.0, "seconds each benchmark runs at least");
+DEFINE_string(BenchFilter,
+              "", "only run benchmarks whose name contains this string");
+
+// the part of the data one thread works on, and what its benchmark prepared from it before timing.
+struct BenchSlice {
+    uint8_t *data;
+    uint64_t length;
+    uint8_t *similar;
+    std::vector<std::vector<uint8_t>> encoded;
+};
+
+struct BenchResult {
+    uint64_t bytes = 0;
+    uint64_t ops = 0;
+};
+
+struct Benchmark {
+    const char *name;
+    BenchResult (*run)(BenchSlice &slice);
+    void (*prepare)(BenchSlice &slice);
+    bool singleThread;
+};
+
+BenchResult BenchFastCDC(BenchSlice &slice) {
+    static thread_local FastCDC fastCDC(FLAGS_BenchChunkSize);
+    BenchResult result;
+    uint64_t pos = 0;
+    while (pos < slice.length) {
+        pos += fastCDC.chunk(slice.data + pos, slice.length - pos);
+        result.ops++;
+    }
+    result.bytes = slice.length;
+    return result;
+}
+
+// the cut condition and the skip after a cut of the Rabin chunking pipeline.
+BenchResult BenchRabin(BenchSlice &slice) {
+    static thread_local Rabin rabin;
+    uint64_t rabinMask = FLAGS_BenchChunkSize - 1;
+    uint64_t minChunkSize = FLAGS_BenchChunkSize / 4;
+    BenchResult result;
+    for (uint64_t pos = 0; pos < slice.length; pos++) {
+        uint64_t fp = rabin.rolling(slice.data + pos);
+        if ((fp & rabinMask) == 0x78) {
+            result.ops++;
+            pos += minChunkSize;
+        }
+    }
+    result.bytes = slice.length;
+    return result;
+}
+
+BenchResult BenchMhSha1(BenchSlice &slice) {
+    mh_sha1_ctx ctx;
+    SHA1FP fp;
+    BenchResult result;
+    for (uint64_t pos = 0; pos < slice.length; pos += FLAGS_BenchChunkSize) {
+        uint64_t length = std::min((uint64_t) FLAGS_BenchChunkSize, slice.length - pos);
+        mh_sha1_init(&ctx);
+        mh_sha1_update_avx2(&ctx, slice.data + pos, (uint32_t) length);
+        mh_sha1_finalize_avx2(&ctx, &fp);
+        result.ops++;
+    }
+    result.bytes = slice.length;
+    return result;
+}
+
+BenchResult BenchOdess(BenchSlice &slice) {
+    SimilarityFeatures features;
+    BenchResult result;
+    for (uint64_t pos = 0; pos < slice.length; pos += FLAGS_BenchChunkSize) {
+        uint64_t length = std::min((uint64_t) FLAGS_BenchChunkSize, slice.length - pos);
+        odessCalculation(slice.data + pos, length, &features);
+        result.ops++;
+    }
+    result.bytes = slice.length;
+    return result;
+}
+
+// every chunk of the similar copy is encoded against the chunk at the same place of the data.
+BenchResult BenchXdeltaEncode(BenchSlice &slice) {
+    static thread_local std::vector<uint8_t> deltaBuffer(FLAGS_BenchChunkSize);
+    BenchResult result;
+    for (uint64_t pos = 0; pos + FLAGS_BenchChunkSize <= slice.length; pos += FLAGS_BenchChunkSize) {
+        usize_t deltaSize;
+        xd3_encode_memory(slice.similar + pos, FLAGS_BenchChunkSize, slice.data + pos, FLAGS_BenchChunkSize,
+                          deltaBuffer.data(), &deltaSize, deltaBuffer.size(), XD3_COMPLEVEL_1 | XD3_NOCOMPRESS);
+        result.bytes += FLAGS_BenchChunkSize;
+        result.ops++;
+    }
+    return result;
+}
+
+void PrepareXdeltaDecode(BenchSlice &slice) {
+    std::vector<uint8_t> deltaBuffer(FLAGS_BenchChunkSize);
+    for (uint64_t pos = 0; pos + FLAGS_BenchChunkSize <= slice.length; pos += FLAGS_BenchChunkSize) {
+        usize_t deltaSize;
+        int r = xd3_encode_memory(slice.similar + pos, FLAGS_BenchChunkSize, slice.data + pos, FLAGS_BenchChunkSize,
+                                  deltaBuffer.data(), &deltaSize, deltaBuffer.size(),
+                                  XD3_COMPLEVEL_1 | XD3_NOCOMPRESS);
+        // chunks the delta does not pay off for are stored as they are, just like in dedup.
+        if (r != 0) deltaSize = 0;
+        slice.encoded.emplace_back(deltaBuffer.begin(), deltaBuffer.begin() + deltaSize);
+    }
+}
+
+BenchResult BenchXdeltaDecode(BenchSlice &slice) {
+    static thread_local std::vector<uint8_t> decodeBuffer(FLAGS_BenchChunkSize);
+    BenchResult result;
+    for (uint64_t i = 0; i < slice.encoded.size(); i++) {
+        if (slice.encoded[i].empty()) continue;
+        usize_t oriSize;
+        int r = xd3_decode_memory(slice.encoded[i].data(), slice.encoded[i].size(),
+                                  slice.data + i * FLAGS_BenchChunkSize, FLAGS_BenchChunkSize,
+                                  decodeBuffer.data(), &oriSize, decodeBuffer.size(), XD3_COMPLEVEL_1 | XD3_NOCOMPRESS);
+        assert(r == 0 && oriSize == (usize_t) FLAGS_BenchChunkSize);
+        result.bytes += oriSize;
+        result.ops++;
+    }
+    return result;
+}
+
+BenchResult BenchZstdCompress(BenchSlice &slice) {
+    static thread_local ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    static thread_local std::vector<uint8_t> compressBuffer(ZSTD_compressBound(FLAGS_BenchContainerSize));
+    BenchResult result;
+    for (uint64_t pos = 0; pos < slice.length; pos += FLAGS_BenchContainerSize) {
+        uint64_t length = std::min(FLAGS_BenchContainerSize, slice.length - pos);
+        size_t r = ZSTD_compressCCtx(cctx, compressBuffer.data(), compressBuffer.size(), slice.data + pos, length,
+                                     FLAGS_BenchLevel);
+        assert(!ZSTD_isError(r));
+        result.bytes += length;
+        result.ops++;
+    }
+    return result;
+}
+
+void PrepareZstdDecompress(BenchSlice &slice) {
+    std::vector<uint8_t> compressBuffer(ZSTD_compressBound(FLAGS_BenchContainerSize));
+    for (uint64_t pos = 0; pos < slice.length; pos += FLAGS_BenchContainerSize) {
+        uint64_t length = std::min(FLAGS_BenchContainerSize, slice.length - pos);
+        size_t r = ZSTD_compress(compressBuffer.data(), compressBuffer.size(), slice.data + pos, length,
+                                 FLAGS_BenchLevel);
+        assert(!ZSTD_isError(r));
+        slice.encoded.emplace_back(compressBuffer.begin(), compressBuffer.begin() + r);
+    }
+}
+
+BenchResult BenchZstdDecompress(BenchSlice &slice) {
+    static thread_local ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    static thread_local std::vector<uint8_t> decompressBuffer(FLAGS_BenchContainerSize);
+    BenchResult result;
+    for (const auto &container: slice.encoded) {
+        size_t r = ZSTD_decompressDCtx(dctx, decompressBuffer.data(), decompressBuffer.size(), container.data(),
+                                       container.size());
+        assert(!ZSTD_isError(r));
+        result.bytes += r;
+        result.ops++;
+    }
+    return result;
+}
+
+// odessCalculation and the Rabin tables keep their state in globals, so they are never run by several threads.
+Benchmark Benchmarks[] = {
+        {"chunking/fastcdc",  BenchFastCDC,        nullptr,               false},
+        {"chunking/rabin",    BenchRabin,          nullptr,               true},
+        {"hashing/mh_sha1",   BenchMhSha1,         nullptr,               false},
+        {"features/odess",    BenchOdess,          nullptr,               true},
+        {"delta/xd3_encode",  BenchXdeltaEncode,   nullptr,               false},
+        {"delta/xd3_decode",  BenchXdeltaDecode,   PrepareXdeltaDecode,   false},
+        {"container/zstd_compress",   BenchZstdCompress,   nullptr,               false},
+        {"container/zstd_decompress", BenchZstdDecompress, PrepareZstdDecompress, false},
+};
+
+// half of the synthetic data repeats fragments seen before, the rest is random, so that compression and
+// chunking see something between text and noise.
+void GenerateData(std::vector<uint8_t> &data) {
+    std::mt19937_64 randomEngine(0x7fcaf1);
+    data.resize(FLAGS_BenchDataSize);
+    uint64_t pos = 0;
+    while (pos < data.size()) {
+        uint64_t length = std::min((uint64_t) 64 + randomEngine() % 4096, data.size() - pos);
+        if (pos > 65536 && (randomEngine() % 1000) < FLAGS_BenchDuplicate * 1000) {
+            uint64_t from = randomEngine() % (pos - length);
+            memmove(data.data() + pos, data.data() + from, length);
+        } else {
+            for (uint64_t i = 0; i < length; i++) {
+                data[pos + i] = (uint8_t) randomEngine();
+            }
+        }
+        pos += length;
+    }
+}
+
+void MutateData(const std::vector<uint8_t> &data, std::vector<uint8_t> &similar) {
+    std::mt19937_64 randomEngine(0x5eed);
+    similar = data;
+    uint64_t mutations = similar.size() * FLAGS_BenchMutation;
+    for (uint64_t i = 0; i < mutations; i++) {
+        similar[randomEngine() % similar.size()] = (uint8_t) randomEngine();
+    }
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    std::vector<uint8_t> data, similar;
+    if (FLAGS_BenchData.empty()) {
+        GenerateData(data);
+    } else {
+        uint64_t size = FileOperator::size((char *) FLAGS_BenchData.data());
+        FileOperator dataFile((char *) FLAGS_BenchData.data(), FileOpenType::Read);
+        data.resize(size);
+        data.resize(dataFile.read(data.data(), size));
+    }
+    MutateData(data, similar);
+    odessInit();
+
+    printf("data:%s, size:%lu, chunk size:%d, zstd level:%d, threads:%lu\n",
+           FLAGS_BenchData.empty() ? "synthetic" : FLAGS_BenchData.data(), (uint64_t) data.size(),
+           FLAGS_BenchChunkSize, FLAGS_BenchLevel, FLAGS_BenchThreads);
+    printf("%-28s %8s %12s %12s %12s\n", "Benchmark", "Threads", "Iterations", "ns/op", "MB/s");
+
+    for (auto &benchmark: Benchmarks) {
+        if (!FLAGS_BenchFilter.empty() && std::string(benchmark.name).find(FLAGS_BenchFilter) == std::string::npos) {
+            continue;
+        }
+        uint64_t threads = benchmark.singleThread ? 1 : std::max(FLAGS_BenchThreads, (uint64_t) 1);
+        std::vector<BenchSlice> slices(threads);
+        uint64_t sliceLength = data.size() / threads;
+        for (uint64_t i = 0; i < threads; i++) {
+            slices[i].data = data.data() + i * sliceLength;
+            slices[i].similar = similar.data() + i * sliceLength;
+            slices[i].length = sliceLength;
+            if (benchmark.prepare) benchmark.prepare(slices[i]);
+        }
+
+        std::vector<BenchResult> results(threads);
+        std::vector<uint64_t> iterations(threads, 0);
+        std::vector<std::thread *> workers;
+        uint64_t deadline = MonotonicNow() + (uint64_t) (FLAGS_BenchMinTime * 1e9);
+        uint64_t t0 = MonotonicNow();
+        for (uint64_t i = 0; i < threads; i++) {
+            workers.push_back(new std::thread([&, i]() {
+                // every thread finishes whole passes over its slice.
+                do {
+                    BenchResult result = benchmark.run(slices[i]);
+                    results[i].bytes += result.bytes;
+                    results[i].ops += result.ops;
+                    iterations[i]++;
+                } while (MonotonicNow() < deadline);
+            }));
+        }
+        for (auto worker: workers) {
+            worker->join();
+            delete worker;
+        }
+        uint64_t elapsed = MonotonicNow() - t0;
+
+        BenchResult total;
+        uint64_t totalIterations = 0;
+        for (uint64_t i = 0; i < threads; i++) {
+            total.bytes += results[i].bytes;
+            total.ops += results[i].ops;
+            totalIterations += iterations[i];
+        }
+        // ns/op is the time one thread spends on one chunk or container.
+        printf("%-28s %8lu %12lu %12.1f %12.1f\n", benchmark.name, threads, totalIterations,
+               total.ops ? (double) elapsed * threads / total.ops : 0.0, total.bytes / (elapsed / 1e9) / 1e6);
+    }
+
+    odessDeinit();
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#include <random>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include "gflags/gflags.h"
+
+DEFINE_string(GenOutput,
+              "", "directory the versions v1..vN and the batch list are written to");
+DEFINE_uint64(GenVersions,
+              10, "number of versions");
+DEFINE_uint64(GenSize,
+              268435456, "bytes of the first version");
+DEFINE_uint64(GenSeed,
+              1, "seed of the generator, the same seed gives the same versions");
+DEFINE_double(GenDuplicate,
+              0.3, "share of the first version repeating fragments seen before in the same version");
+DEFINE_double(GenModify,
+              0.1, "share of segments modified in place in each new version, they become similar chunks");
+DEFINE_double(GenMutation,
+              0.005, "share of bytes changed inside a modified segment");
+DEFINE_double(GenShift,
+              0.02, "share of segments with a small insertion or deletion in front, shifting the chunk boundaries");
+DEFINE_double(GenNew,
+              0.02, "share of segments replaced by new data in each new version");
+DEFINE_double(GenGrowth,
+              0.01, "new data appended to each new version, as a share of its size");
+DEFINE_uint64(GenSegment,
+              65536, "average length of the segments the changes are applied to");
+
+std::mt19937_64 RandomEngine;
+
+double Probability() {
+    return (RandomEngine() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void AppendRandom(std::vector<uint8_t> &data, uint64_t length) {
+    for (uint64_t i = 0; i < length; i++) {
+        data.push_back((uint8_t) RandomEngine());
+    }
+}
+
+// new data: random runs mixed with repeats of earlier fragments, so that it is neither noise nor text.
+void AppendNew(std::vector<uint8_t> &data, uint64_t length, double duplicate) {
+    uint64_t end = data.size() + length;
+    uint64_t start = data.size();
+    while (data.size() < end) {
+        uint64_t run = std::min((uint64_t) 64 + RandomEngine() % 4096, end - data.size());
+        if (data.size() - start > 65536 && Probability() < duplicate) {
+            uint64_t from = start + RandomEngine() % (data.size() - start - run);
+            for (uint64_t i = 0; i < run; i++) {
+                data.push_back(data[from + i]);
+            }
+        } else {
+            AppendRandom(data, run);
+        }
+    }
+}
+
+void NextVersion(const std::vector<uint8_t> &previous, std::vector<uint8_t> &next) {
+    next.clear();
+    next.reserve(previous.size() * (1 + FLAGS_GenGrowth) + FLAGS_GenSegment);
+    uint64_t pos = 0;
+    while (pos < previous.size()) {
+        uint64_t length = std::min(FLAGS_GenSegment / 2 + RandomEngine() % FLAGS_GenSegment, previous.size() - pos);
+        if (Probability() < FLAGS_GenShift) {
+            if (RandomEngine() % 2) {
+                AppendRandom(next, 1 + RandomEngine() % 64);
+            } else {
+                uint64_t skip = std::min((uint64_t) 1 + RandomEngine() % 64, length);
+                pos += skip;
+                length -= skip;
+            }
+        }
+        double op = Probability();
+        if (op < FLAGS_GenNew) {
+            AppendNew(next, length, FLAGS_GenDuplicate);
+        } else if (op < FLAGS_GenNew + FLAGS_GenModify) {
+            uint64_t begin = next.size();
+            next.insert(next.end(), previous.begin() + pos, previous.begin() + pos + length);
+            uint64_t mutations = std::max((uint64_t) 1, (uint64_t) (length * FLAGS_GenMutation));
+            for (uint64_t i = 0; i < mutations && length; i++) {
+                next[begin + RandomEngine() % length] = (uint8_t) RandomEngine();
+            }
+        } else {
+            next.insert(next.end(), previous.begin() + pos, previous.begin() + pos + length);
+        }
+        pos += length;
+    }
+    AppendNew(next, previous.size() * FLAGS_GenGrowth, FLAGS_GenDuplicate);
+}
+
+int WriteVersion(const std::vector<uint8_t> &data, const std::string &path) {
+    FILE *file = fopen(path.data(), "wb");
+    if (!file) {
+        printf("Can not open file %s : %s\n", path.data(), strerror(errno));
+        return -1;
+    }
+    fwrite(data.data(), 1, data.size(), file);
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_GenOutput.empty()) {
+        printf("Usage: MeGA_workload --GenOutput=[directory] [--GenVersions=10 --GenSize=268435456 ..]\n");
+        return 1;
+    }
+    RandomEngine.seed(FLAGS_GenSeed);
+
+    std::vector<uint8_t> current, next;
+    std::string listPath = FLAGS_GenOutput + "/list";
+    FILE *listFile = fopen(listPath.data(), "w");
+    if (!listFile) {
+        printf("Can not open file %s : %s\n", listPath.data(), strerror(errno));
+        return 1;
+    }
+
+    AppendNew(current, FLAGS_GenSize, FLAGS_GenDuplicate);
+    for (uint64_t version = 1; version <= FLAGS_GenVersions; version++) {
+        if (version > 1) {
+            NextVersion(current, next);
+            current.swap(next);
+        }
+        std::string path = FLAGS_GenOutput + "/v" + std::to_string(version);
+        if (WriteVersion(current, path)) return 1;
+        fprintf(listFile, "%s\n", path.data());
+        printf("Version %lu: %s, %lu bytes\n", version, path.data(), (uint64_t) current.size());
+    }
+    fclose(listFile);
+    return 0;
+}
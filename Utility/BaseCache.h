@@ -11,18 +11,32 @@
 
 #include <unordered_map>
 #include <map>
+#include "BasePrefetcher.h"
+#include "ChunkAllocator.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "ContainerCatalog.h"
 
 DEFINE_uint64(CacheSize,
               128, "Cache Size");
 
-extern std::string ClassFileAppendPath;
 extern uint64_t ContainerSize;
 uint64_t PreloadSize = ContainerSize * 1.2;
 
 int UpdateScore = 2;
 
+struct BaseChunkPositions {
+    uint64_t category: 22;
+    uint64_t quantizedOffset: 42;
+};
+
 class ContainerCache {
 public:
+    // chunks of one container live and die together, so they are carved from an arena.
+    ContainerCache() : arena(4 * 1024 * 1024) {
+
+    }
+
     int getRecord(const BasePos *basePos, BlockEntry *cacheBlock) {
       {
         auto iterCache = cacheMap.find(basePos->sha1Fp);
@@ -38,7 +52,7 @@ public:
       {
         auto iter = cacheMap.find(sha1Fp);
         if (iter == cacheMap.end()) {
-          uint8_t *cacheBuffer = (uint8_t *) malloc(length);
+          uint8_t *cacheBuffer = arena.alloc(length);
           memcpy(cacheBuffer, buffer, length);
           cacheMap[sha1Fp] = {
                   cacheBuffer, length
@@ -48,27 +62,37 @@ public:
     }
 
     void clear() {
-      for (const auto &blockEntry: cacheMap) {
-        free(blockEntry.second.block);
-      }
+      arena.reset();
       cacheMap.clear();
     }
 
+    void statistics() {
+      printf("[ContainerCache] allocations:%lu, mallocs:%lu\n", arena.getRequestCounter(), arena.getMallocCounter());
+    }
+
     ~ContainerCache() {
       clear();
     }
 
 private:
     std::unordered_map<SHA1FP, BlockEntry, TupleHasher, TupleEqualer> cacheMap;
+    ChunkArena arena;
 };
 
 uint64_t threshold = FLAGS_CacheSize * ContainerSize;
 
 class BaseCache {
 public:
-    BaseCache() : totalSize(0), index(0), cacheMap(65536), write(0), read(0) {
+    BaseCache() : totalSize(0), index(0), cacheMap(65536), write(0), read(0), prefetcher(PreloadSize) {
       preloadBuffer = (uint8_t *) malloc(PreloadSize);
       decompressBuffer = (uint8_t *) malloc(PreloadSize);
+      lookupCounter = GlobalMetrics.counter("base_cache_lookups_total");
+      hitCounter = GlobalMetrics.counter("base_cache_hits_total");
+      loadCounter = GlobalMetrics.counter("base_cache_loads_total");
+      prefetchHitCounter = GlobalMetrics.counter("base_cache_prefetch_hits_total");
+      loadLatency = GlobalMetrics.histogram("base_cache_load_latency_us");
+      GlobalMetrics.ratio("base_cache_hit_rate", "base_cache_hits_total", "base_cache_lookups_total");
+      GlobalMetrics.ratio("base_cache_prefetch_hit_rate", "base_cache_prefetch_hits_total", "base_cache_loads_total");
     }
 
     void setCurrentVersion(uint64_t version) {
@@ -92,36 +116,61 @@ public:
         printf("cache write:%lu, cache read:%lu, prefetching size : %lu\n", write, read, prefetching);
         printf("total size:%lu, items:%lu\n", totalSize, items);
         printf("self hit:%lu ReadBeforeWrite:%lu\n", selfHit, ReadBeforeWrite);
+        printf("prefetch hit:%lu, prefetch wait:%lu, prefetch unused:%lu\n", prefetchHit,
+               prefetcher.getWaitCounter(), prefetcher.getUnusedCounter());
     }
 
+    void prefetch(const BasePos &basePos) {
+        if (basePos.CategoryOrder == currentVersion) {
+            // containers of the current version may be still in memory of the write pipeline.
+            return;
+        }
+        ContainerLocation location;
+        locateContainer(basePos, &location);
+        prefetcher.addTask(getContainerKey(basePos), location);
+    }
+
+    void resetPrefetch() {
+        prefetcher.reset();
+    }
+
+    // the chunks of a container which can not be read are not cached, their lookups miss.
     void loadBaseChunks(const BasePos& basePos) {
+        TRACE_SPAN("base_load", basePos.cid, basePos.CategoryOrder);
         gettimeofday(&t0, NULL);
-        char pathBuffer[256];
 
         int r = 0;
         uint64_t decompressSize;
         uint64_t readSize = 0;
 
+        uint8_t *containerBuffer = preloadBuffer;
+
         if (basePos.CategoryOrder == currentVersion) {
-            sprintf(pathBuffer, ClassFilePath.data(), basePos.CategoryOrder, currentVersion, basePos.cid);
             r = GlobalWriteFilePipelinePtr->getContainer(basePos.CategoryOrder, currentVersion, basePos.cid,
                                                          preloadBuffer, &readSize);
             selfHit++;
-        } else if (basePos.CategoryOrder) {
-            sprintf(pathBuffer, ClassFilePath.data(), basePos.CategoryOrder, currentVersion - 1, basePos.cid);
-        } else {
-            sprintf(pathBuffer, ClassFileAppendPath.data(), 1, currentVersion - 1, basePos.cid);
+        } else if (prefetcher.acquire(getContainerKey(basePos), &containerBuffer, &readSize, &decompressSize)) {
+            prefetching += decompressSize;
+            prefetchHit++;
+            prefetchHitCounter->add();
+            r = 1;
         }
 
         if (r == 0) {
-            FileOperator basefile(pathBuffer, FileOpenType::Read);
-            decompressSize = basefile.read(decompressBuffer, PreloadSize);
-            basefile.releaseBufferedData();
-
+            // containers of the current version are in the catalog once the write pipeline released them.
+            ContainerLocation location;
+            locateContainer(basePos, &location);
+            decompressSize = GlobalContainerCatalog.read(location, decompressBuffer, PreloadSize, true);
+            if (decompressSize == location.length) {
+                readSize = ZSTD_decompress(preloadBuffer, PreloadSize, decompressBuffer, decompressSize);
+            }
+            if (decompressSize != location.length || ZSTD_isError(readSize)) {
+                printf("Container in Segment%lu at %lu can not be read, its chunks are no bases\n",
+                       location.segment, location.offset);
+                return;
+            }
             prefetching += decompressSize;
-            readSize = ZSTD_decompress(preloadBuffer, PreloadSize, decompressBuffer, decompressSize);
-            assert(!ZSTD_isError(readSize));
-        } else {
+        } else if (containerBuffer == preloadBuffer) {
             ReadBeforeWrite++;
         }
 
@@ -133,11 +182,11 @@ public:
         uint64_t leftLength = readSize;
 
         while (leftLength > sizeof(BlockHeader)) {// todo: min chunksize configured to 2048
-            headPtr = (BlockHeader *) (preloadBuffer + preLoadPos);
+            headPtr = (BlockHeader *) (containerBuffer + preLoadPos);
             if (headPtr->length + sizeof(BlockHeader) > leftLength) {
                 break;
             } else if (!headPtr->type) {
-                addRecord(headPtr->fp, preloadBuffer + preLoadPos + sizeof(BlockHeader),
+                addRecord(headPtr->fp, containerBuffer + preLoadPos + sizeof(BlockHeader),
                           headPtr->length);
             }
 
@@ -146,8 +195,13 @@ public:
             leftLength = readSize - preLoadPos;
         }
         assert(preLoadPos == readSize);
+        if (containerBuffer != preloadBuffer) {
+            free(containerBuffer);
+        }
         gettimeofday(&t1, NULL);
         loadingTime += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
+        loadCounter->add();
+        loadLatency->record((t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
     }
 
     void addRecord(const SHA1FP &sha1Fp, uint8_t *buffer, uint64_t length) {
@@ -190,6 +244,7 @@ public:
         {
             //MutexLockGuard cacheLockGuard(cacheLock);
             access++;
+            lookupCounter->add();
             int vadID = -1;
             for (int i = 0; i < 6; i++) {
                 if (chunks[i].valid) {
@@ -200,6 +255,7 @@ public:
                         //
                     } else {
                         success++;
+                        hitCounter->add();
                         *cacheBlock = iterCache->second;
                         read += cacheBlock->length;
                         {
@@ -212,9 +268,8 @@ public:
             loadBaseChunks(chunks[vadID]);
             auto iterCache = cacheMap.find(chunks[vadID].sha1Fp);
             if (iterCache == cacheMap.end()) {
-                printf("id:%d, co:%u\n", vadID, chunks[vadID].CategoryOrder);
+                return 0;
             }
-            assert(iterCache != cacheMap.end());
             *cacheBlock = iterCache->second;
             {
                 freshLastVisit(iterCache);
@@ -243,9 +298,11 @@ public:
         {
             //MutexLockGuard cacheLockGuard(cacheLock);
             access++;
+            lookupCounter->add();
             auto iterCache = cacheMap.find(basePos->sha1Fp);
             if (iterCache != cacheMap.end()) {
                 success++;
+                hitCounter->add();
                 *cacheBlock = iterCache->second;
                 read += cacheBlock->length;
                 return 1;
@@ -268,6 +325,28 @@ public:
     }
 
 private:
+    void locateContainer(const BasePos &basePos, ContainerLocation *location) {
+        int r;
+        if (basePos.CategoryOrder == currentVersion) {
+            r = GlobalContainerCatalog.locate(ContainerKind::Active, basePos.CategoryOrder, currentVersion,
+                                              basePos.cid, location);
+        } else if (basePos.CategoryOrder) {
+            r = GlobalContainerCatalog.locate(ContainerKind::Active, basePos.CategoryOrder, currentVersion - 1,
+                                              basePos.cid, location);
+        } else {
+            r = GlobalContainerCatalog.locate(ContainerKind::Append, 1, currentVersion - 1, basePos.cid, location);
+        }
+        assert(r);
+    }
+
+    uint64_t getContainerKey(const BasePos &basePos) {
+        uint64_t key;
+        BaseChunkPositions *bcp = (BaseChunkPositions *) &key;
+        bcp->category = basePos.CategoryOrder;
+        bcp->quantizedOffset = basePos.cid;
+        return key;
+    }
+
     void freshLastVisit(
             std::unordered_map<SHA1FP, BlockEntry, TupleHasher, TupleEqualer>::iterator iter) {
         //MutexLockGuard lruLockGuard(lruLock);
@@ -303,6 +382,15 @@ private:
     uint64_t prefetching = 0;
 
     uint64_t ReadBeforeWrite = 0;
+
+    BasePrefetcher prefetcher;
+    uint64_t prefetchHit = 0;
+
+    MetricsCounter *lookupCounter;
+    MetricsCounter *hitCounter;
+    MetricsCounter *loadCounter;
+    MetricsCounter *prefetchHitCounter;
+    MetricsHistogram *loadLatency;
 };
 
 #endif //MEGA_BASECACHE_H
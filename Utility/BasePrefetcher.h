@@ -0,0 +1,224 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_BASEPREFETCHER_H
+#define MEGA_BASEPREFETCHER_H
+
+#include <string>
+#include <list>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <unordered_map>
+#include <zstd.h>
+#include "gflags/gflags.h"
+#include "Lock.h"
+#include "Likely.h"
+#include "ContainerCatalog.h"
+
+DEFINE_uint64(PrefetchThreads,
+              4, "threads loading base containers in background, 0 disables prefetching");
+DEFINE_uint64(PrefetchDepth,
+              16, "max base containers loaded or being loaded but not yet consumed");
+
+enum class PrefetchState {
+    Pending,
+    Loading,
+    Ready,
+};
+
+struct PrefetchEntry {
+    ContainerLocation location;
+    PrefetchState state = PrefetchState::Pending;
+    bool discard = false;
+    uint8_t *buffer = nullptr;
+    uint64_t length = 0;
+    uint64_t compressedLength = 0;
+};
+
+// Reads and decompresses base containers selected by the delta selector on a small thread pool,
+// so that the dedup thread only blocks on containers which have not arrived yet.
+// Prefetched containers are handed over as whole decompressed buffers, parsing them into the
+// cache stays on the consumer thread.
+class BasePrefetcher {
+public:
+    BasePrefetcher(uint64_t bs) : runningFlag(true), taskAmount(0), inflight(0), bufferSize(bs), mutexLock(),
+                                  taskCondition(mutexLock), readyCondition(mutexLock) {
+        for (uint64_t i = 0; i < FLAGS_PrefetchThreads; i++) {
+            workers.push_back(new std::thread(std::bind(&BasePrefetcher::prefetchCallback, this)));
+        }
+    }
+
+    int addTask(uint64_t key, const ContainerLocation &location) {
+        if (workers.empty()) return 0;
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = entryMap.find(key);
+        if (iter != entryMap.end()) {
+            // it is requested again before the discarded load finishes, keep the result this time.
+            iter->second.discard = false;
+            return 0;
+        }
+        PrefetchEntry &entry = entryMap[key];
+        entry.location = location;
+        taskList.push_back(key);
+        taskAmount++;
+        taskCondition.notify();
+        return 1;
+    }
+
+    // 1: buffer holds the decompressed container, and the caller takes its ownership.
+    // 0: the container is not prefetched, or could not be loaded, the caller has to load it by itself.
+    int acquire(uint64_t key, uint8_t **buffer, uint64_t *length, uint64_t *compressedLength) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = entryMap.find(key);
+        if (iter == entryMap.end()) {
+            return 0;
+        }
+        if (iter->second.state == PrefetchState::Pending) {
+            // nobody picked it up yet, loading it on the calling thread is not slower than waiting.
+            for (auto taskIter = taskList.begin(); taskIter != taskList.end(); taskIter++) {
+                if (*taskIter == key) {
+                    taskList.erase(taskIter);
+                    taskAmount--;
+                    break;
+                }
+            }
+            entryMap.erase(iter);
+            return 0;
+        }
+        iter->second.discard = false;
+        while (iter->second.state != PrefetchState::Ready) {
+            waitCounter++;
+            readyCondition.wait();
+            iter = entryMap.find(key);
+            assert(iter != entryMap.end());
+        }
+        *buffer = iter->second.buffer;
+        *length = iter->second.length;
+        *compressedLength = iter->second.compressedLength;
+        entryMap.erase(iter);
+        inflight--;
+        taskCondition.notify();
+        // a container which failed to load is reported by the caller loading it again.
+        return *buffer != nullptr;
+    }
+
+    // drops everything the current segment did not consume.
+    void reset() {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        taskList.clear();
+        taskAmount = 0;
+        for (auto iter = entryMap.begin(); iter != entryMap.end();) {
+            if (iter->second.state == PrefetchState::Loading) {
+                iter->second.discard = true;
+                iter++;
+            } else {
+                if (iter->second.state == PrefetchState::Ready) {
+                    free(iter->second.buffer);
+                    inflight--;
+                    unusedCounter++;
+                }
+                iter = entryMap.erase(iter);
+            }
+        }
+        taskCondition.notifyAll();
+    }
+
+    uint64_t getWaitCounter() const {
+        return waitCounter;
+    }
+
+    uint64_t getUnusedCounter() const {
+        return unusedCounter;
+    }
+
+    ~BasePrefetcher() {
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            runningFlag = false;
+            taskCondition.notifyAll();
+        }
+        for (auto worker: workers) {
+            worker->join();
+            delete worker;
+        }
+        for (const auto &entry: entryMap) {
+            if (entry.second.state == PrefetchState::Ready) {
+                free(entry.second.buffer);
+            }
+        }
+    }
+
+private:
+    void prefetchCallback() {
+        pthread_setname_np(pthread_self(), "Prefetching");
+        uint8_t *readBuffer = (uint8_t *) malloc(bufferSize);
+        uint64_t key;
+        ContainerLocation location;
+
+        while (likely(runningFlag)) {
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                while (runningFlag && (!taskAmount || inflight >= FLAGS_PrefetchDepth)) {
+                    taskCondition.wait();
+                }
+                if (unlikely(!runningFlag)) break;
+                taskAmount--;
+                key = taskList.front();
+                taskList.pop_front();
+                PrefetchEntry &entry = entryMap[key];
+                entry.state = PrefetchState::Loading;
+                location = entry.location;
+                inflight++;
+            }
+
+            uint64_t compressedLength = GlobalContainerCatalog.read(location, readBuffer, bufferSize, true);
+            uint8_t *decompressBuffer = nullptr;
+            uint64_t length = 0;
+            if (compressedLength == location.length) {
+                decompressBuffer = (uint8_t *) malloc(bufferSize);
+                length = ZSTD_decompress(decompressBuffer, bufferSize, readBuffer, compressedLength);
+                if (ZSTD_isError(length)) {
+                    free(decompressBuffer);
+                    decompressBuffer = nullptr;
+                }
+            }
+
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                auto iter = entryMap.find(key);
+                assert(iter != entryMap.end());
+                if (iter->second.discard) {
+                    free(decompressBuffer);
+                    entryMap.erase(iter);
+                    inflight--;
+                    taskCondition.notify();
+                } else {
+                    iter->second.state = PrefetchState::Ready;
+                    iter->second.buffer = decompressBuffer;
+                    iter->second.length = length;
+                    iter->second.compressedLength = compressedLength;
+                    readyCondition.notifyAll();
+                }
+            }
+        }
+        free(readBuffer);
+    }
+
+    bool runningFlag;
+    std::vector<std::thread *> workers;
+    uint64_t taskAmount;
+    uint64_t inflight;
+    uint64_t bufferSize;
+    std::list<uint64_t> taskList;
+    std::unordered_map<uint64_t, PrefetchEntry> entryMap;
+    MutexLock mutexLock;
+    Condition taskCondition;
+    Condition readyCondition;
+
+    uint64_t waitCounter = 0;
+    uint64_t unusedCounter = 0;
+};
+
+#endif //MEGA_BASEPREFETCHER_H
@@ -0,0 +1,145 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_CHUNKALLOCATOR_H
+#define MEGA_CHUNKALLOCATOR_H
+
+#include <vector>
+#include <cstdlib>
+#include "Lock.h"
+#include "Noncopyable.h"
+
+// Fixed-size buffers handed from one producing thread to the stages behind it.
+// get() is called by a single producer thread and works on a private free list,
+// put() can be called from any thread and only takes the lock to append to the return list,
+// which the producer swaps in when its private list runs dry.
+class BufferPool : noncopyable {
+public:
+    BufferPool(uint64_t bs, uint64_t spb = 64) : bufferSize(bs), slabBuffers(spb) {
+
+    }
+
+    uint8_t *get() {
+        requestCounter++;
+        if (freeList.empty()) {
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                freeList.swap(returnList);
+            }
+            if (freeList.empty()) {
+                grow();
+            }
+        }
+        uint8_t *buffer = freeList.back();
+        freeList.pop_back();
+        return buffer;
+    }
+
+    void put(uint8_t *buffer) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        returnList.push_back(buffer);
+    }
+
+    uint64_t getRequestCounter() const {
+        return requestCounter;
+    }
+
+    uint64_t getMallocCounter() const {
+        return mallocCounter;
+    }
+
+    ~BufferPool() {
+        for (auto slab: slabList) {
+            free(slab);
+        }
+    }
+
+private:
+    void grow() {
+        uint8_t *slab = (uint8_t *) malloc(bufferSize * slabBuffers);
+        mallocCounter++;
+        slabList.push_back(slab);
+        for (uint64_t i = 0; i < slabBuffers; i++) {
+            freeList.push_back(slab + i * bufferSize);
+        }
+    }
+
+    uint64_t bufferSize;
+    uint64_t slabBuffers;
+    std::vector<uint8_t *> freeList;
+    std::vector<uint8_t *> returnList;
+    std::vector<uint8_t *> slabList;
+    MutexLock mutexLock;
+
+    uint64_t requestCounter = 0;
+    uint64_t mallocCounter = 0;
+};
+
+// Bump allocator for buffers which all die together, e.g. when a container is sealed.
+// It is owned by one thread; reset() rewinds it and keeps the blocks for the next round.
+class ChunkArena : noncopyable {
+public:
+    ChunkArena(uint64_t bs) : blockSize(bs) {
+
+    }
+
+    uint8_t *alloc(uint64_t length) {
+        requestCounter++;
+        if (length > blockSize) {
+            uint8_t *buffer = (uint8_t *) malloc(length);
+            mallocCounter++;
+            largeList.push_back(buffer);
+            return buffer;
+        }
+        if (currentBlock == blockList.size() || blockUsed + length > blockSize) {
+            if (currentBlock < blockList.size()) {
+                currentBlock++;
+            }
+            if (currentBlock == blockList.size()) {
+                blockList.push_back((uint8_t *) malloc(blockSize));
+                mallocCounter++;
+            }
+            blockUsed = 0;
+        }
+        uint8_t *buffer = blockList[currentBlock] + blockUsed;
+        blockUsed += length;
+        return buffer;
+    }
+
+    void reset() {
+        for (auto buffer: largeList) {
+            free(buffer);
+        }
+        largeList.clear();
+        currentBlock = 0;
+        blockUsed = 0;
+    }
+
+    uint64_t getRequestCounter() const {
+        return requestCounter;
+    }
+
+    uint64_t getMallocCounter() const {
+        return mallocCounter;
+    }
+
+    ~ChunkArena() {
+        reset();
+        for (auto block: blockList) {
+            free(block);
+        }
+    }
+
+private:
+    uint64_t blockSize;
+    std::vector<uint8_t *> blockList;
+    std::vector<uint8_t *> largeList;
+    uint64_t currentBlock = 0;
+    uint64_t blockUsed = 0;
+
+    uint64_t requestCounter = 0;
+    uint64_t mallocCounter = 0;
+};
+
+#endif //MEGA_CHUNKALLOCATOR_H
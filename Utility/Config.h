@@ -14,12 +14,13 @@
 #include "toml.hpp"
 
 extern std::string LogicFilePath;
-extern std::string ClassFilePath;
-extern std::string VersionFilePath;
 extern std::string ManifestPath;
 extern std::string KVPath;
 extern std::string HomePath;
-extern std::string ClassFileAppendPath;
+extern std::string CatalogPath;
+extern std::string CatalogSnapshotPath;
+extern std::string IndexSnapshotPath;
+extern std::string SegmentFilePath;
 extern uint64_t RetentionTime;
 
 uint64_t ContainerSize = 16 * 1024 * 1024;
@@ -30,12 +31,13 @@ public:
       auto data = toml::parse(p);
       std::string path = toml::find<std::string>(data, "path");
       LogicFilePath = path + "/logicFiles/Recipe%lu";
-      ClassFilePath = path + "/storageFiles/Active_Cat(%lu,%lu)Container%lu";
-      VersionFilePath = path + "/storageFiles/Archived_Cat(%lu,%lu)Container%lu";
       ManifestPath = path + "/manifest";
       KVPath = path + "kvstore";
       HomePath = path;
-      ClassFileAppendPath = path + "/storageFiles/Active_Cat(%lu,%lu)Append_Container%lu";
+      CatalogPath = path + "/catalog";
+      CatalogSnapshotPath = path + "/catalog.%lu";
+      IndexSnapshotPath = path + "/kvstore.%lu";
+      SegmentFilePath = path + "/storageFiles/Segment%lu";
       int64_t rt = toml::find<int64_t>(data, "retention");
       RetentionTime = rt;
       printf("-----------------------Configure-----------------------\n");
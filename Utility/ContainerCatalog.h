@@ -0,0 +1,728 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_CONTAINERCATALOG_H
+#define MEGA_CONTAINERCATALOG_H
+
+#include <map>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include "gflags/gflags.h"
+#include "Lock.h"
+#include "FileOperator.h"
+#include "ContainerIndex.h"
+#include "DurabilityManager.h"
+#include "Manifest.h"
+#include "xxhash.h"
+
+DEFINE_uint64(SegmentSize,
+              1073741824, "containers are appended to a segment file until it reaches this size");
+
+extern std::string CatalogPath;
+extern std::string SegmentFilePath;
+extern std::string LogicFilePath;
+extern std::string HomePath;
+
+enum class ContainerKind : uint8_t {
+    Active,
+    Append,
+    Archived,
+};
+
+struct CatalogKey {
+    ContainerKind kind;
+    uint64_t category;
+    uint64_t version;
+    uint64_t cid;
+
+    bool operator<(const CatalogKey &other) const {
+        if (kind != other.kind) return kind < other.kind;
+        if (category != other.category) return category < other.category;
+        if (version != other.version) return version < other.version;
+        return cid < other.cid;
+    }
+};
+
+// a container is length bytes at offset in its segment, followed by indexLength bytes of fingerprints. the
+// checksums are XXH64 of both parts, 0 for containers stored before they were recorded.
+struct ContainerLocation {
+    uint64_t segment;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t indexLength;
+    uint64_t checksum;
+    uint64_t indexChecksum;
+};
+
+struct CatalogRecord {
+    uint8_t kind;
+    uint8_t padding[7];
+    uint64_t category;
+    uint64_t version;
+    uint64_t cid;
+    ContainerLocation location;
+};
+
+// digest: sum of the XXH64 of every chunk of the version seeded by its position, 0 if it was written without one.
+struct RecipeRecord {
+    uint64_t version;
+    uint64_t fileID;
+    uint64_t digest;
+};
+
+struct CatalogHeader {
+    char magic[8];
+    uint64_t nextSegmentID;
+    uint64_t count;
+    uint64_t nextRecipeID;
+    uint64_t recipeCount;
+};
+
+#define CatalogMagic "MeGACAT1"
+
+typedef std::map<CatalogKey, ContainerLocation> CatalogMap;
+typedef std::map<uint64_t, uint64_t> RecipeMap;
+
+// Where each container of a category (active, its append part, or archived in a volume) is stored, and which
+// file holds the recipe of each version. Containers are packed into append-only segment files, recipes are
+// named by an id which never changes, so retention rewrites the catalog instead of probing and renaming files.
+// The catalog is saved as a snapshot of each generation the manifest commits. Containers and recipes which
+// leave it are kept until the generation without them is committed, then the space of a container is punched
+// out of its segment, and a segment without live containers is unlinked. Every read of a container is checked
+// against the checksum recorded when it was appended.
+class ContainerCatalog {
+public:
+    ContainerCatalog() : mutexLock(), writeLock() {
+    }
+
+    ~ContainerCatalog() {
+        if (writeFd >= 0) {
+            GlobalDurabilityManager.closing(writeFd);
+            close(writeFd);
+        }
+        for (const auto &entry: readFdMap) {
+            close(entry.second.fd);
+        }
+        for (const auto &entry: retiredFdMap) {
+            close(entry.first);
+        }
+    }
+
+    int load(uint64_t generation) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        catalogMap.clear();
+        recipeMap.clear();
+        digestMap.clear();
+        segmentLive.clear();
+        nextSegmentID = 0;
+        nextRecipeID = 1;
+        std::string catalogPath = GetCatalogPath(generation);
+        FileOperator catalogFile((char *) catalogPath.data(), FileOpenType::TRY);
+        if (!catalogFile.ok()) {
+            if (generation) {
+                printf("Catalog %s is missing\n", catalogPath.data());
+                return -1;
+            }
+            return importLegacy();
+        }
+        CatalogHeader header;
+        if (catalogFile.read((uint8_t *) &header, sizeof(CatalogHeader)) != sizeof(CatalogHeader) ||
+            memcmp(header.magic, CatalogMagic, 8)) {
+            printf("Catalog %s is damaged\n", catalogPath.data());
+            return -1;
+        }
+        std::vector<CatalogRecord> recordList(header.count);
+        std::vector<RecipeRecord> recipeList(header.recipeCount);
+        catalogFile.read((uint8_t *) recordList.data(), header.count * sizeof(CatalogRecord));
+        catalogFile.read((uint8_t *) recipeList.data(), header.recipeCount * sizeof(RecipeRecord));
+        for (const auto &record: recordList) {
+            catalogMap[{(ContainerKind) record.kind, record.category, record.version, record.cid}] = record.location;
+            segmentLive[record.location.segment]++;
+        }
+        for (const auto &record: recipeList) {
+            recipeMap[record.version] = record.fileID;
+            if (record.digest) {
+                digestMap[record.fileID] = record.digest;
+            }
+        }
+        nextSegmentID = header.nextSegmentID;
+        nextRecipeID = header.nextRecipeID;
+        printf("Catalog: %lu containers in %lu segments, %lu recipes\n", (uint64_t) catalogMap.size(),
+               (uint64_t) segmentLive.size(), (uint64_t) recipeMap.size());
+        return 0;
+    }
+
+    int save(uint64_t generation) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        return saveCatalog(GetCatalogPath(generation));
+    }
+
+    // what left the catalog before the generation just committed is released.
+    void collect() {
+        std::vector<ContainerLocation> locationList;
+        std::vector<uint64_t> recipeList;
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            locationList.swap(releaseList);
+            recipeList.swap(recipeReleaseList);
+        }
+        uint64_t unlinked = releaseContainers(locationList);
+        char path[256];
+        for (auto fileID: recipeList) {
+            sprintf(path, LogicFilePath.data(), fileID);
+            ::remove(path);
+        }
+        if (!locationList.empty() || !recipeList.empty()) {
+            printf("Catalog: %lu containers released, %lu segments and %lu recipes deleted\n",
+                   (uint64_t) locationList.size(), unlinked, (uint64_t) recipeList.size());
+        }
+    }
+
+    // a write task stopped after its last commit. segments, container space and recipes the committed
+    // catalog does not refer to are its garbage.
+    void recover() {
+        std::map<uint64_t, std::vector<ContainerLocation>> segmentMap;
+        std::vector<uint64_t> recipeList;
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            for (const auto &entry: catalogMap) {
+                segmentMap[entry.second.segment].push_back(entry.second);
+            }
+            for (const auto &entry: recipeMap) {
+                recipeList.push_back(entry.second);
+            }
+        }
+
+        std::vector<uint64_t> orphanList;
+        std::string storagePath = HomePath + "/storageFiles";
+        DIR *dir = opendir(storagePath.data());
+        if (dir) {
+            struct dirent *dirEntry;
+            while ((dirEntry = readdir(dir)) != nullptr) {
+                uint64_t segment;
+                int length = 0;
+                if (sscanf(dirEntry->d_name, "Segment%lu%n", &segment, &length) == 1 && !dirEntry->d_name[length] &&
+                    segmentMap.find(segment) == segmentMap.end()) {
+                    orphanList.push_back(segment);
+                }
+            }
+            closedir(dir);
+        }
+        uint64_t unlinked = unlinkSegments(orphanList);
+
+        // gaps between live containers and the tail after the last one.
+        char path[256];
+        uint64_t punched = 0;
+        for (auto &entry: segmentMap) {
+            sprintf(path, SegmentFilePath.data(), entry.first);
+            int fd = open(path, O_WRONLY);
+            if (fd < 0) {
+                continue;
+            }
+            std::sort(entry.second.begin(), entry.second.end(),
+                      [](const ContainerLocation &a, const ContainerLocation &b) { return a.offset < b.offset; });
+            uint64_t end = 0;
+            for (const auto &location: entry.second) {
+                if (location.offset > end) {
+                    punched += allocatedBytes(fd, end, location.offset);
+                    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, end, location.offset - end);
+                }
+                end = std::max(end, location.offset + location.length + location.indexLength);
+            }
+            uint64_t size = FileOperator::size(path);
+            if (size > end) {
+                punched += allocatedBytes(fd, end, size);
+                ftruncate(fd, end);
+            }
+            close(fd);
+        }
+
+        std::sort(recipeList.begin(), recipeList.end());
+        uint64_t removed = 0;
+        std::string recipeDirectory = HomePath + "/logicFiles";
+        dir = opendir(recipeDirectory.data());
+        if (dir) {
+            struct dirent *dirEntry;
+            while ((dirEntry = readdir(dir)) != nullptr) {
+                uint64_t fileID;
+                int length = 0;
+                if (sscanf(dirEntry->d_name, "Recipe%lu%n", &fileID, &length) == 1 && !dirEntry->d_name[length] &&
+                    !std::binary_search(recipeList.begin(), recipeList.end(), fileID)) {
+                    sprintf(path, LogicFilePath.data(), fileID);
+                    removed += ::remove(path) == 0;
+                }
+            }
+            closedir(dir);
+        }
+        printf("Recovery: %lu orphaned segments deleted, %lu bytes of orphaned containers released, "
+               "%lu orphaned recipes deleted\n", unlinked, punched, removed);
+    }
+
+    // 0: there is no such container.
+    int locate(ContainerKind kind, uint64_t category, uint64_t version, uint64_t cid, ContainerLocation *location) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = catalogMap.find({kind, category, version, cid});
+        if (iter == catalogMap.end()) {
+            return 0;
+        }
+        *location = iter->second;
+        return 1;
+    }
+
+    // the compressed container and the fingerprints of its raw content go to the end of the open segment,
+    // a container written again replaces the old one. it is durable after the next commit of the durability
+    // manager at the latest.
+    int append(ContainerKind kind, uint64_t category, uint64_t version, uint64_t cid, uint8_t *compressed,
+               uint64_t compressedLength, uint8_t *raw, uint64_t rawLength) {
+        std::vector<SHA1FP> fpList;
+        ContainerIndex::build(raw, rawLength, fpList);
+        ContainerLocation location;
+        {
+            MutexLockGuard writeLockGuard(writeLock);
+            if (writeFd < 0 || writeSize >= FLAGS_SegmentSize) {
+                openSegment();
+            }
+            location = {writeSegment, writeSize, compressedLength, fpList.size() * sizeof(SHA1FP),
+                        XXH64(compressed, compressedLength, 0),
+                        XXH64(fpList.data(), fpList.size() * sizeof(SHA1FP), 0)};
+            writeFully(compressed, location.length, location.offset);
+            writeFully((uint8_t *) fpList.data(), location.indexLength, location.offset + location.length);
+            GlobalDurabilityManager.written(writeFd, location.offset, location.length + location.indexLength, true);
+            writeSize += location.length + location.indexLength;
+        }
+
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            segmentLive[location.segment]++;
+            auto result = catalogMap.insert({{kind, category, version, cid}, location});
+            if (result.second) {
+                return 0;
+            }
+            releaseList.push_back(result.first->second);
+            result.first->second = location;
+        }
+        return 0;
+    }
+
+    // 0: the container can not be read, or does not match its checksum.
+    uint64_t read(const ContainerLocation &location, uint8_t *buffer, uint64_t capacity, bool dropCache = false) {
+        int fd = acquireReadFd(location.segment);
+        if (fd < 0) {
+            return 0;
+        }
+        ssize_t r = ::pread(fd, buffer, std::min(location.length, capacity), location.offset);
+        if (dropCache) {
+            posix_fadvise(fd, location.offset, location.length + location.indexLength, POSIX_FADV_DONTNEED);
+        }
+        releaseReadFd(location.segment, fd);
+        if (r == (ssize_t) location.length && location.checksum && XXH64(buffer, r, 0) != location.checksum) {
+            printf("Container in Segment%lu at %lu does not match its checksum\n", location.segment,
+                   location.offset);
+            // the reader may stop the process right after, the message goes out first.
+            fflush(stdout);
+            return 0;
+        }
+        return r < 0 ? 0 : r;
+    }
+
+    // 0: the container was stored without fingerprints, or they are damaged, it has to be read.
+    int loadIndex(const ContainerLocation &location, std::vector<SHA1FP> &fpList) {
+        if (!location.indexLength) {
+            return 0;
+        }
+        int fd = acquireReadFd(location.segment);
+        if (fd < 0) {
+            return 0;
+        }
+        fpList.resize(location.indexLength / sizeof(SHA1FP));
+        ssize_t r = ::pread(fd, fpList.data(), location.indexLength, location.offset + location.length);
+        releaseReadFd(location.segment, fd);
+        if (r != (ssize_t) location.indexLength) {
+            return 0;
+        }
+        if (location.indexChecksum && XXH64(fpList.data(), location.indexLength, 0) != location.indexChecksum) {
+            printf("Fingerprints of the container in Segment%lu at %lu do not match their checksum\n",
+                   location.segment, location.offset);
+            return 0;
+        }
+        return 1;
+    }
+
+    int remove(ContainerKind kind, uint64_t category, uint64_t version, uint64_t cid) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = catalogMap.find({kind, category, version, cid});
+        if (iter == catalogMap.end()) {
+            return 0;
+        }
+        releaseList.push_back(iter->second);
+        catalogMap.erase(iter);
+        return 1;
+    }
+
+    void release(const std::vector<ContainerLocation> &locationList) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        releaseList.insert(releaseList.end(), locationList.begin(), locationList.end());
+    }
+
+    // 0: the version has no recipe.
+    int getRecipePath(uint64_t version, char *path) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = recipeMap.find(version);
+        if (iter == recipeMap.end()) {
+            return 0;
+        }
+        sprintf(path, LogicFilePath.data(), iter->second);
+        return 1;
+    }
+
+    int createRecipe(uint64_t version, char *path) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto result = recipeMap.insert({version, nextRecipeID});
+        if (result.second) {
+            nextRecipeID++;
+        }
+        sprintf(path, LogicFilePath.data(), result.first->second);
+        return 0;
+    }
+
+    // digest: of the chunks of the version, checked when the whole version is restored.
+    void setRecipeDigest(uint64_t version, uint64_t digest) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = recipeMap.find(version);
+        if (iter != recipeMap.end()) {
+            digestMap[iter->second] = digest;
+        }
+    }
+
+    // 0: the version was written without a digest.
+    uint64_t getRecipeDigest(uint64_t version) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = recipeMap.find(version);
+        if (iter == recipeMap.end()) {
+            return 0;
+        }
+        auto digestIter = digestMap.find(iter->second);
+        return digestIter == digestMap.end() ? 0 : digestIter->second;
+    }
+
+    // the recipe of the first version goes, the later ones move down by one.
+    void rollRecipes() {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        RecipeMap newMap;
+        for (const auto &entry: recipeMap) {
+            if (entry.first == 1) {
+                recipeReleaseList.push_back(entry.second);
+                digestMap.erase(entry.second);
+            } else {
+                newMap[entry.first - 1] = entry.second;
+            }
+        }
+        recipeMap.swap(newMap);
+    }
+
+    uint64_t count(ContainerKind kind, uint64_t category, uint64_t version) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto begin = catalogMap.lower_bound({kind, category, version, 0});
+        auto end = catalogMap.lower_bound({kind, category, version + 1, 0});
+        return std::distance(begin, end);
+    }
+
+    CatalogMap getEntries() {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        return catalogMap;
+    }
+
+    void setEntries(CatalogMap &entries) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        catalogMap.swap(entries);
+    }
+
+private:
+    // bytes of [begin, end) which are not holes, gaps released before only keep their partial blocks.
+    static uint64_t allocatedBytes(int fd, uint64_t begin, uint64_t end) {
+        uint64_t bytes = 0;
+        while (begin < end) {
+            off_t data = lseek(fd, begin, SEEK_DATA);
+            if (data < 0 || (uint64_t) data >= end) {
+                break;
+            }
+            off_t hole = lseek(fd, data, SEEK_HOLE);
+            uint64_t dataEnd = hole < 0 ? end : std::min(end, (uint64_t) hole);
+            bytes += dataEnd - data;
+            begin = dataEnd;
+        }
+        return bytes;
+    }
+
+    // their space is punched out of the segments, segments left without live containers are unlinked relative
+    // to one directory handle. returns the number of unlinked segments.
+    uint64_t releaseContainers(const std::vector<ContainerLocation> &locationList) {
+        std::map<uint64_t, std::vector<ContainerLocation>> segmentMap;
+        for (const auto &location: locationList) {
+            segmentMap[location.segment].push_back(location);
+        }
+
+        std::vector<uint64_t> emptyList;
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            for (auto iter = segmentMap.begin(); iter != segmentMap.end();) {
+                uint64_t &live = segmentLive[iter->first];
+                live -= std::min(live, (uint64_t) iter->second.size());
+                if (!live && iter->first != writeSegment) {
+                    segmentLive.erase(iter->first);
+                    emptyList.push_back(iter->first);
+                    iter = segmentMap.erase(iter);
+                } else {
+                    iter++;
+                }
+            }
+        }
+
+        char path[256];
+        for (const auto &entry: segmentMap) {
+            sprintf(path, SegmentFilePath.data(), entry.first);
+            int fd = open(path, O_WRONLY);
+            if (fd < 0) {
+                continue;
+            }
+            for (const auto &location: entry.second) {
+                fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, location.offset,
+                          location.length + location.indexLength);
+            }
+            close(fd);
+        }
+        return unlinkSegments(emptyList);
+    }
+
+    // a new segment for each process, and whenever the open one is full. called with writeLock held.
+    void openSegment() {
+        if (writeFd >= 0) {
+            GlobalDurabilityManager.closing(writeFd);
+            close(writeFd);
+        }
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            writeSegment = nextSegmentID++;
+        }
+        char path[256];
+        sprintf(path, SegmentFilePath.data(), writeSegment);
+        writeFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (writeFd < 0) {
+            printf("Can not open file %s : %s\n", path, strerror(errno));
+        }
+        assert(writeFd >= 0);
+        writeSize = 0;
+    }
+
+    void writeFully(uint8_t *buffer, uint64_t length, uint64_t offset) {
+        while (length) {
+            ssize_t r = ::pwrite(writeFd, buffer, length, offset);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                printf("Can not write segment %lu : %s\n", writeSegment, strerror(errno));
+                assert(0);
+                return;
+            }
+            buffer += r;
+            offset += r;
+            length -= r;
+        }
+    }
+
+    // every acquired fd is released after use, so unlinking a segment never closes an fd under a reader.
+    int acquireReadFd(uint64_t segment) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = readFdMap.find(segment);
+        if (iter != readFdMap.end()) {
+            iter->second.users++;
+            return iter->second.fd;
+        }
+        char path[256];
+        sprintf(path, SegmentFilePath.data(), segment);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            printf("Can not open file %s : %s\n", path, strerror(errno));
+            return -1;
+        }
+        readFdMap[segment] = {fd, 1};
+        return fd;
+    }
+
+    void releaseReadFd(uint64_t segment, int fd) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = readFdMap.find(segment);
+        if (iter != readFdMap.end() && iter->second.fd == fd) {
+            iter->second.users--;
+            return;
+        }
+        // the segment was unlinked while the fd was in use, the last user closes it.
+        auto retired = retiredFdMap.find(fd);
+        if (--retired->second == 0) {
+            close(fd);
+            retiredFdMap.erase(retired);
+        }
+    }
+
+    uint64_t unlinkSegments(const std::vector<uint64_t> &segmentList) {
+        if (segmentList.empty()) {
+            return 0;
+        }
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            for (auto segment: segmentList) {
+                auto iter = readFdMap.find(segment);
+                if (iter != readFdMap.end()) {
+                    if (iter->second.users) {
+                        retiredFdMap[iter->second.fd] = iter->second.users;
+                    } else {
+                        close(iter->second.fd);
+                    }
+                    readFdMap.erase(iter);
+                }
+            }
+        }
+        std::string storagePath = HomePath + "/storageFiles";
+        int dirFd = open(storagePath.data(), O_RDONLY | O_DIRECTORY);
+        if (dirFd < 0) {
+            printf("Can not open directory %s : %s\n", storagePath.data(), strerror(errno));
+            return 0;
+        }
+        const char *name = strrchr(SegmentFilePath.data(), '/') + 1;
+        char nameBuffer[256];
+        uint64_t unlinked = 0;
+        for (auto segment: segmentList) {
+            sprintf(nameBuffer, name, segment);
+            if (!unlinkat(dirFd, nameBuffer, 0)) {
+                unlinked++;
+            }
+        }
+        close(dirFd);
+        return unlinked;
+    }
+
+    // written aside and renamed over the old one, a crash leaves either of them.
+    int saveCatalog(const std::string &catalogPath) {
+        std::string tempPath = catalogPath + ".tmp";
+        {
+            FileOperator catalogFile((char *) tempPath.data(), FileOpenType::Write);
+            if (!catalogFile.ok()) {
+                return -1;
+            }
+            CatalogHeader header = {{0}, nextSegmentID, catalogMap.size(), nextRecipeID, recipeMap.size()};
+            memcpy(header.magic, CatalogMagic, 8);
+            catalogFile.write((uint8_t *) &header, sizeof(CatalogHeader));
+            std::vector<CatalogRecord> recordList;
+            recordList.reserve(catalogMap.size());
+            for (const auto &entry: catalogMap) {
+                CatalogRecord record = {(uint8_t) entry.first.kind, {0}, entry.first.category, entry.first.version,
+                                        entry.first.cid, entry.second};
+                recordList.push_back(record);
+            }
+            catalogFile.write((uint8_t *) recordList.data(), recordList.size() * sizeof(CatalogRecord));
+            std::vector<RecipeRecord> recipeList;
+            for (const auto &entry: recipeMap) {
+                auto iter = digestMap.find(entry.second);
+                recipeList.push_back({entry.first, entry.second, iter == digestMap.end() ? 0 : iter->second});
+            }
+            catalogFile.write((uint8_t *) recipeList.data(), recipeList.size() * sizeof(RecipeRecord));
+            fflush(catalogFile.getFP());
+            catalogFile.fdatasync();
+        }
+        return rename(tempPath.data(), catalogPath.data());
+    }
+
+    // a store written before the catalog existed has one file per container, named by category and version.
+    // each becomes a segment of its own without fingerprints, restore reads it to learn them. its recipes are
+    // named by version, which become their ids.
+    int importLegacy() {
+        std::string recipeDirectory = HomePath + "/logicFiles";
+        DIR *dir = opendir(recipeDirectory.data());
+        if (dir) {
+            struct dirent *dirEntry;
+            while ((dirEntry = readdir(dir)) != nullptr) {
+                uint64_t version;
+                int length = 0;
+                if (sscanf(dirEntry->d_name, "Recipe%lu%n", &version, &length) == 1 && !dirEntry->d_name[length]) {
+                    recipeMap[version] = version;
+                    nextRecipeID = std::max(nextRecipeID, version + 1);
+                }
+            }
+            closedir(dir);
+        }
+
+        std::string storagePath = HomePath + "/storageFiles";
+        dir = opendir(storagePath.data());
+        if (!dir) {
+            return recipeMap.empty() ? 0 : saveCatalog(CatalogPath);
+        }
+        std::vector<std::pair<CatalogKey, std::string>> legacyList;
+        struct dirent *dirEntry;
+        while ((dirEntry = readdir(dir)) != nullptr) {
+            const char *name = dirEntry->d_name;
+            uint64_t category, version, cid;
+            int length = 0;
+            if (sscanf(name, "Active_Cat(%lu,%lu)Append_Container%lu%n", &category, &version, &cid, &length) == 3 &&
+                !name[length]) {
+                legacyList.push_back({{ContainerKind::Append, category, version, cid}, name});
+            } else if (sscanf(name, "Active_Cat(%lu,%lu)Container%lu%n", &category, &version, &cid, &length) == 3 &&
+                       !name[length]) {
+                legacyList.push_back({{ContainerKind::Active, category, version, cid}, name});
+            } else if (sscanf(name, "Archived_Cat(%lu,%lu)Container%lu%n", &category, &version, &cid, &length) == 3 &&
+                       !name[length]) {
+                legacyList.push_back({{ContainerKind::Archived, category, version, cid}, name});
+            }
+        }
+        closedir(dir);
+        if (legacyList.empty()) {
+            return recipeMap.empty() ? 0 : saveCatalog(CatalogPath);
+        }
+
+        char oldPath[512], newPath[256];
+        for (const auto &legacy: legacyList) {
+            sprintf(oldPath, "%s/%s", storagePath.data(), legacy.second.data());
+            // containers from before checksums are not checked.
+            ContainerLocation location = {nextSegmentID++, 0, FileOperator::size(oldPath), 0, 0, 0};
+            sprintf(newPath, SegmentFilePath.data(), location.segment);
+            rename(oldPath, newPath);
+            catalogMap[legacy.first] = location;
+            segmentLive[location.segment]++;
+        }
+        printf("Catalog: imported %lu containers and %lu recipes of an older store\n", (uint64_t) legacyList.size(),
+               (uint64_t) recipeMap.size());
+        return saveCatalog(CatalogPath);
+    }
+
+    CatalogMap catalogMap;
+    RecipeMap recipeMap;
+    // recipe file id to the digest of its version.
+    std::map<uint64_t, uint64_t> digestMap;
+    std::map<uint64_t, uint64_t> segmentLive;
+    struct ReadFd {
+        int fd;
+        uint64_t users;
+    };
+    std::map<uint64_t, ReadFd> readFdMap;
+    // fds of unlinked segments still in use, to their remaining users.
+    std::map<int, uint64_t> retiredFdMap;
+    std::vector<ContainerLocation> releaseList;
+    std::vector<uint64_t> recipeReleaseList;
+    uint64_t nextSegmentID = 0;
+    uint64_t nextRecipeID = 1;
+    MutexLock mutexLock;
+
+    // the segment containers are appended to, guarded by writeLock.
+    MutexLock writeLock;
+    uint64_t writeSegment = -1;
+    int writeFd = -1;
+    uint64_t writeSize = 0;
+};
+
+ContainerCatalog GlobalContainerCatalog;
+
+#endif //MEGA_CONTAINERCATALOG_H
@@ -10,11 +10,13 @@
 #define MEGA_CONTAINERCONSTRUCTOR_H
 
 #include "Likely.h"
+#include "ChunkAllocator.h"
+#include "ContainerIndex.h"
+#include "ContainerCatalog.h"
+#include "Trace.h"
 #include <zstd.h>
 #include <atomic>
 
-extern std::string ClassFilePath;
-extern std::string VersionFilePath;
 extern uint64_t ContainerSize;
 uint64_t BufferCapacity = ContainerSize * 1.2;
 
@@ -39,8 +41,7 @@ struct WriteBuffer {
     }
 
     void clear() {
-        memset(buffer, 0, BufferCapacity);
-        memset(compressBuffer, 0, BufferCapacity);
+        // only [0, used) is ever compressed or written, stale bytes behind it do not matter.
         used = 0;
     }
 
@@ -69,7 +70,8 @@ struct Container {
 
 class OfflineReleaser {
 public:
-    OfflineReleaser() : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock) {
+    OfflineReleaser(BufferPool *cp, BufferPool *zp) : runningFlag(true), taskAmount(0), mutexLock(),
+                                                       condition(mutexLock), containerPool(cp), compressPool(zp) {
         worker = new std::thread(std::bind(&OfflineReleaser::ReleaserCallback, this));
     }
 
@@ -125,8 +127,8 @@ private:
                 break;
             }
 
-            free(task->buffer);
-            free(task->compressed);
+            containerPool->put(task->buffer);
+            compressPool->put(task->compressed);
             delete task;
         }
     }
@@ -137,6 +139,8 @@ private:
     std::list<Container *> taskList;
     MutexLock mutexLock;
     Condition condition;
+    BufferPool *containerPool;
+    BufferPool *compressPool;
 };
 
 class OfflineWriter {
@@ -179,12 +183,9 @@ private:
                 break;
             }
 
-            sprintf(pathBuffer, ClassFilePath.data(), task->lcs, task->lce, task->cid);
-            FileOperator *writer = new FileOperator(pathBuffer, FileOpenType::Write);
-            writer->write(task->compressed, task->compressedLength);
-            writer->fsync();
-            writer->releaseBufferedData();
-            delete writer;
+            TRACE_SPAN("flush", task->cid, task->lce);
+            GlobalContainerCatalog.append(ContainerKind::Active, task->lcs, task->lce, task->cid, task->compressed,
+                                          task->compressedLength, task->buffer, task->length);
 
             task->written = true;
             offlineReleaser->notify();
@@ -193,7 +194,6 @@ private:
     }
 
     std::thread *worker;
-    char pathBuffer[256];
     bool runningFlag;
     uint64_t taskAmount;
     std::list<Container *> taskList;
@@ -204,11 +204,13 @@ private:
 
 class OfflineCompressor {
 public:
-    OfflineCompressor(OfflineReleaser *offlineReleaser) : runningFlag(true), taskAmount(0), mutexLock(),
-                                                          condition(mutexLock),
-                                                          offlineWriter(offlineReleaser) {
+    OfflineCompressor(OfflineReleaser *offlineReleaser, BufferPool *zp) : runningFlag(true), taskAmount(0),
+                                                                          mutexLock(), condition(mutexLock),
+                                                                          compressPool(zp),
+                                                                          offlineWriter(offlineReleaser) {
         sizeBeforeCompression = 0;
       sizeAfterCompression = 0;
+      cctx = ZSTD_createCCtx();
       worker = new std::thread(std::bind(&OfflineCompressor::compressCallback, this));
     }
 
@@ -228,6 +230,7 @@ public:
       GlobalMetadataManagerPtr->setAfterCompression(sizeAfterCompression);
       addTask(NULL);
       worker->join();
+      ZSTD_freeCCtx(cctx);
     }
 
 private:
@@ -251,10 +254,11 @@ private:
                 break;
             }
 
-            uint8_t *compressBuffer = (uint8_t *) malloc(BufferCapacity);
+            TRACE_SPAN("compress", task->cid, task->lce);
+            uint8_t *compressBuffer = compressPool->get();
             gettimeofday(&ct0, NULL);
-            size_t compressedSize = ZSTD_compress(compressBuffer, BufferCapacity, task->buffer,
-                                                  task->length, 1);
+            size_t compressedSize = ZSTD_compressCCtx(cctx, compressBuffer, BufferCapacity, task->buffer,
+                                                      task->length, 1);
             gettimeofday(&ct1, NULL);
             compressionTime += (ct1.tv_sec - ct0.tv_sec) * 1000000 + ct1.tv_usec - ct0.tv_usec;
             assert(!ZSTD_isError(compressedSize));
@@ -281,16 +285,22 @@ private:
 
     uint64_t compressionTime = 0;
 
+    // the context is reused by every container instead of being rebuilt by each ZSTD_compress().
+    ZSTD_CCtx *cctx;
+    BufferPool *compressPool;
+
     OfflineWriter offlineWriter;
 };
 
 class ContainerConstructor {
 public:
     ContainerConstructor(uint64_t cv) : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock),
-                                        offlineCompressor(&offlineReleaser) {
+                                        containerPool(BufferCapacity, 1), compressPool(BufferCapacity, 1),
+                                        offlineReleaser(&containerPool, &compressPool),
+                                        offlineCompressor(&offlineReleaser, &compressPool) {
         currentVersion = cv;
 
-        writeBuffer.init();
+        prepareNew();
     }
 
     int getContainer(uint64_t s, uint64_t e, uint64_t c, uint8_t *buffer, uint64_t *length) {
@@ -302,11 +312,14 @@ public:
     }
 
     int writeClass(uint8_t *header, uint64_t headerLen, uint8_t *buffer, uint64_t bufferLen) {
-        writeBuffer.write(header, headerLen);
-        writeBuffer.write(buffer, bufferLen);
+        memcpy(currentContainer->buffer + currentContainer->length, header, headerLen);
+        currentContainer->length += headerLen;
+        memcpy(currentContainer->buffer + currentContainer->length, buffer, bufferLen);
+        currentContainer->length += bufferLen;
 
-        if (writeBuffer.used >= writeBuffer.totalLength) {
+        if (currentContainer->length >= ContainerSize) {
             flush();
+            containerCounter++;
             prepareNew();
         }
         return 0;
@@ -314,25 +327,24 @@ public:
 
     ~ContainerConstructor() {
         flush();
-        writeBuffer.release();
     }
 
 private:
 
     int flush() {
-        Container *con = new Container(currentVersion, currentVersion, containerCounter,
-                                       (uint8_t *) malloc(writeBuffer.used), writeBuffer.used);
-        memcpy(con->buffer, writeBuffer.buffer, writeBuffer.used);
-        offlineCompressor.addTask(con);
-        offlineReleaser.addTask(con);
+        // the container buffer itself moves on to the compressor and comes back to the pool from the releaser.
+        offlineCompressor.addTask(currentContainer);
+        offlineReleaser.addTask(currentContainer);
+        currentContainer = nullptr;
+        return 0;
     }
 
     int prepareNew() {
-        containerCounter++;
-        writeBuffer.clear();
+        currentContainer = new Container(currentVersion, currentVersion, containerCounter, containerPool.get(), 0);
+        return 0;
     }
 
-    WriteBuffer writeBuffer;
+    Container *currentContainer = nullptr;
     uint64_t currentVersion;
 
     uint64_t containerCounter = 0;
@@ -343,6 +355,10 @@ private:
     MutexLock mutexLock;
     Condition condition;
 
+    // declared before the stages so that they outlive the threads returning buffers into them.
+    BufferPool containerPool;
+    BufferPool compressPool;
+
     OfflineReleaser offlineReleaser;
     OfflineCompressor offlineCompressor;
 
@@ -0,0 +1,27 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_CONTAINERINDEX_H
+#define MEGA_CONTAINERINDEX_H
+
+#include <vector>
+#include "StorageTask.h"
+
+// Every container is followed in its segment by the fingerprints it holds, in record order.
+// It lets restore decide which containers a recipe needs without reading and decompressing them.
+class ContainerIndex {
+public:
+    static void build(uint8_t *buffer, uint64_t length, std::vector<SHA1FP> &fpList) {
+        fpList.clear();
+        uint64_t offset = 0;
+        while (offset < length) {
+            BlockHeader *blockHeader = (BlockHeader *) (buffer + offset);
+            fpList.push_back(blockHeader->fp);
+            offset += sizeof(BlockHeader) + blockHeader->length;
+        }
+        assert(offset == length);
+    }
+};
+
+#endif //MEGA_CONTAINERINDEX_H
@@ -0,0 +1,179 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_CONTAINERSCANNER_H
+#define MEGA_CONTAINERSCANNER_H
+
+#include <list>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <unistd.h>
+#include <zstd.h>
+#include "Lock.h"
+#include "Likely.h"
+#include "Metrics.h"
+#include "ContainerCatalog.h"
+
+extern uint64_t ContainerSize;
+
+// raw is nullptr if the container could not be read or decompressed.
+typedef std::function<void(uint64_t index, const uint8_t *raw, uint64_t rawLength)> ScanCallback;
+
+// Reads a list of containers once, in the order they are on disk, and hands each of them decompressed to a pool
+// of workers. At most two containers per worker wait to be processed. The reader can be held to a read rate and
+// every worker to a share of a core, so that a scan can run next to backups.
+class ContainerScanner {
+public:
+    // readRate: bytes read per second, 0 is unlimited. cpuPercent: share of a core a worker may use.
+    ContainerScanner(uint64_t t, uint64_t rate = 0, uint64_t percent = 100)
+            : threads(std::max(t, (uint64_t) 1)), readRate(rate), cpuPercent(std::min(percent, (uint64_t) 100)),
+              taskAmount(0), runningFlag(true), mutexLock(), condition(mutexLock), idleCondition(mutexLock) {
+        if (!cpuPercent) cpuPercent = 1;
+    }
+
+    // callback is called once for every container, on the worker threads, in no particular order.
+    void scan(const std::vector<ContainerLocation> &locationList, const ScanCallback &callback) {
+        std::vector<uint64_t> readList(locationList.size());
+        for (uint64_t i = 0; i < readList.size(); i++) {
+            readList[i] = i;
+        }
+        std::sort(readList.begin(), readList.end(), [&](uint64_t a, uint64_t b) {
+            const ContainerLocation &la = locationList[a], &lb = locationList[b];
+            return la.segment < lb.segment || (la.segment == lb.segment && la.offset < lb.offset);
+        });
+
+        runningFlag = true;
+        std::vector<std::thread *> workers;
+        for (uint64_t i = 0; i < threads; i++) {
+            workers.push_back(new std::thread(std::bind(&ContainerScanner::scanCallback, this, std::cref(callback))));
+        }
+        uint64_t begin = MonotonicNow(), scanned = 0;
+        for (uint64_t index: readList) {
+            const ContainerLocation &location = locationList[index];
+            if (readRate) {
+                uint64_t due = begin + scanned * 1000000000ull / readRate, now = MonotonicNow();
+                if (due > now) {
+                    usleep((due - now) / 1000);
+                }
+            }
+            ScanTask task = {index, (uint8_t *) malloc(location.length), 0};
+            task.length = GlobalContainerCatalog.read(location, task.buffer, location.length, true);
+            if (task.length != location.length) {
+                task.length = 0;
+            }
+            scanned += location.length;
+
+            MutexLockGuard mutexLockGuard(mutexLock);
+            readBytes += task.length;
+            while (inflight >= threads * 2) {
+                idleCondition.wait();
+            }
+            inflight++;
+            taskList.push_back(task);
+            taskAmount++;
+            condition.notify();
+        }
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            while (inflight) {
+                idleCondition.wait();
+            }
+            runningFlag = false;
+            condition.notifyAll();
+        }
+        for (auto worker: workers) {
+            worker->join();
+            delete worker;
+        }
+        scanTime += MonotonicNow() - begin;
+    }
+
+    uint64_t getReadBytes() const {
+        return readBytes;
+    }
+
+    uint64_t getRawBytes() const {
+        return rawBytes;
+    }
+
+    // in microseconds.
+    uint64_t getScanTime() const {
+        return scanTime / 1000;
+    }
+
+private:
+    struct ScanTask {
+        uint64_t index;
+        uint8_t *buffer;
+        uint64_t length;
+    };
+
+    void scanCallback(const ScanCallback &callback) {
+        pthread_setname_np(pthread_self(), "Scanning");
+        ZSTD_DCtx *dctx = ZSTD_createDCtx();
+        uint64_t capacity = ContainerSize * 1.2;
+        uint8_t *raw = (uint8_t *) malloc(capacity);
+        ScanTask task;
+
+        while (likely(runningFlag)) {
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                while (!taskAmount) {
+                    condition.wait();
+                    if (unlikely(!runningFlag)) break;
+                }
+                if (unlikely(!runningFlag)) continue;
+                taskAmount--;
+                task = taskList.front();
+                taskList.pop_front();
+            }
+
+            uint64_t c0 = MonotonicNow();
+            size_t rawLength = 0;
+            if (task.length) {
+                rawLength = ZSTD_decompressDCtx(dctx, raw, capacity, task.buffer, task.length);
+            }
+            free(task.buffer);
+            if (!task.length || ZSTD_isError(rawLength)) {
+                rawLength = 0;
+                callback(task.index, nullptr, 0);
+            } else {
+                callback(task.index, raw, rawLength);
+            }
+            uint64_t busy = MonotonicNow() - c0;
+
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                rawBytes += rawLength;
+                inflight--;
+                idleCondition.notifyAll();
+            }
+            if (cpuPercent < 100) {
+                usleep(busy * (100 - cpuPercent) / cpuPercent / 1000);
+            }
+        }
+        free(raw);
+        ZSTD_freeDCtx(dctx);
+    }
+
+    uint64_t threads;
+    uint64_t readRate;
+    uint64_t cpuPercent;
+
+    uint64_t taskAmount;
+    bool runningFlag;
+    std::list<ScanTask> taskList;
+    MutexLock mutexLock;
+    Condition condition;
+    Condition idleCondition;
+    uint64_t inflight = 0;
+
+    uint64_t readBytes = 0;
+    uint64_t rawBytes = 0;
+    uint64_t scanTime = 0;
+};
+
+#endif //MEGA_CONTAINERSCANNER_H
@@ -0,0 +1,269 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_DURABILITYMANAGER_H
+#define MEGA_DURABILITYMANAGER_H
+
+#include <map>
+#include <list>
+#include <vector>
+#include <string>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include "gflags/gflags.h"
+#include "Lock.h"
+#include "Likely.h"
+#include "Metrics.h"
+
+DEFINE_string(SyncPolicy,
+              "group", "when written data is made durable. container: after every container, group: once "
+                       "SyncGroupBytes or SyncGroupMs have passed, version: only when a version is committed");
+DEFINE_uint64(SyncGroupBytes,
+              67108864, "bytes written between two syncs with the group policy");
+DEFINE_uint64(SyncGroupMs,
+              1000, "milliseconds between two syncs with the group policy");
+DEFINE_uint64(WritebackBytes,
+              8388608, "dirty bytes of a file after which its writeback is started, 0 leaves it to the kernel");
+
+enum class SyncPolicy {
+    Container,
+    Group,
+    Version,
+};
+
+// Decides when written data reaches the device. Writers report each write, writeback is started early with
+// sync_file_range so that the final fdatasync only waits for the tail. With the group policy a sync covers
+// everything written since the last one and runs on a worker thread, writers never wait for the device.
+// commit() returns once everything reported so far is durable, metadata referring to it is written after.
+// A reported file keeps a duplicated descriptor until it is synced, its owner may close it at any time after
+// calling closing().
+class DurabilityManager {
+public:
+    // the policy follows --SyncPolicy, read on first use.
+    DurabilityManager() : mutexLock(), condition(mutexLock), idleCondition(mutexLock) {
+    }
+
+    DurabilityManager(SyncPolicy p) : policy(p), policySet(true), mutexLock(), condition(mutexLock),
+                                      idleCondition(mutexLock) {
+    }
+
+    ~DurabilityManager() {
+        if (worker) {
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                runningFlag = false;
+                condition.notifyAll();
+            }
+            worker->join();
+            delete worker;
+        }
+        for (const auto &file: detachedList) {
+            close(file.fd);
+        }
+        for (const auto &entry: dirtyMap) {
+            close(entry.second.fd);
+        }
+    }
+
+    // length bytes at offset of fd have been written. dropCache: the range leaves the page cache once durable.
+    void written(int fd, uint64_t offset, uint64_t length, bool dropCache = false) {
+        if (getPolicy() == SyncPolicy::Container) {
+            uint64_t begin = MonotonicNow();
+            ::fdatasync(fd);
+            if (dropCache) {
+                posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+            }
+            MutexLockGuard mutexLockGuard(mutexLock);
+            syncCounter++;
+            syncedBytes += length;
+            syncTime += MonotonicNow() - begin;
+            return;
+        }
+
+        uint64_t kickBegin = 0, kickEnd = 0;
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            DirtyFile &file = dirtyMap[fd];
+            if (file.fd < 0) {
+                file.fd = dup(fd);
+                file.begin = offset;
+                file.end = offset + length;
+                file.kickBegin = offset;
+            }
+            file.begin = std::min(file.begin, offset);
+            file.end = std::max(file.end, offset + length);
+            file.dropCache |= dropCache;
+            file.unkicked += length;
+            if (FLAGS_WritebackBytes && file.unkicked >= FLAGS_WritebackBytes) {
+                kickBegin = std::min(file.kickBegin, offset);
+                kickEnd = file.end;
+                file.kickBegin = file.end;
+                file.unkicked = 0;
+            }
+            pendingBytes += length;
+            if (policy == SyncPolicy::Group && (pendingBytes >= FLAGS_SyncGroupBytes ||
+                                                MonotonicNow() - lastSync >= FLAGS_SyncGroupMs * 1000000)) {
+                requestSync();
+            }
+        }
+        if (kickEnd > kickBegin) {
+            sync_file_range(fd, kickBegin, kickEnd - kickBegin, SYNC_FILE_RANGE_WRITE);
+        }
+    }
+
+    // the owner is about to close fd, what it wrote is still synced through the duplicated descriptor.
+    void closing(int fd) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = dirtyMap.find(fd);
+        if (iter != dirtyMap.end()) {
+            detachedList.push_back(iter->second);
+            dirtyMap.erase(iter);
+        }
+    }
+
+    // everything reported so far is durable on return.
+    int commit() {
+        uint64_t begin = MonotonicNow();
+        std::vector<DirtyFile> fileList;
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            while (syncing) {
+                idleCondition.wait();
+            }
+            takeDirty(fileList);
+        }
+        syncFiles(fileList);
+        MutexLockGuard mutexLockGuard(mutexLock);
+        commitCounter++;
+        commitTime += MonotonicNow() - begin;
+        return 0;
+    }
+
+    void getStatistics() {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        printf("[Durability] policy:%s, syncs:%lu, synced:%lu bytes, sync time:%lu us, commits:%lu, "
+               "commit time:%lu us\n", FLAGS_SyncPolicy.data(), syncCounter, syncedBytes, syncTime / 1000,
+               commitCounter, commitTime / 1000);
+    }
+
+private:
+    struct DirtyFile {
+        int fd = -1;
+        uint64_t begin = 0;
+        uint64_t end = 0;
+        uint64_t kickBegin = 0;
+        uint64_t unkicked = 0;
+        bool dropCache = false;
+    };
+
+    SyncPolicy getPolicy() {
+        if (unlikely(!policySet)) {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            if (FLAGS_SyncPolicy == "container") {
+                policy = SyncPolicy::Container;
+            } else if (FLAGS_SyncPolicy == "version") {
+                policy = SyncPolicy::Version;
+            } else {
+                policy = SyncPolicy::Group;
+            }
+            policySet = true;
+        }
+        return policy;
+    }
+
+    // called with mutexLock held.
+    void requestSync() {
+        if (!worker) {
+            worker = new std::thread(std::bind(&DurabilityManager::syncCallback, this));
+        }
+        lastSync = MonotonicNow();
+        pendingBytes = 0;
+        taskAmount++;
+        condition.notify();
+    }
+
+    // called with mutexLock held.
+    void takeDirty(std::vector<DirtyFile> &fileList) {
+        for (const auto &entry: dirtyMap) {
+            fileList.push_back(entry.second);
+        }
+        fileList.insert(fileList.end(), detachedList.begin(), detachedList.end());
+        dirtyMap.clear();
+        detachedList.clear();
+        pendingBytes = 0;
+        lastSync = MonotonicNow();
+    }
+
+    void syncFiles(const std::vector<DirtyFile> &fileList) {
+        if (fileList.empty()) {
+            return;
+        }
+        uint64_t begin = MonotonicNow(), bytes = 0;
+        for (const auto &file: fileList) {
+            ::fdatasync(file.fd);
+            if (file.dropCache) {
+                posix_fadvise(file.fd, file.begin, file.end - file.begin, POSIX_FADV_DONTNEED);
+            }
+            close(file.fd);
+            bytes += file.end - file.begin;
+        }
+        MutexLockGuard mutexLockGuard(mutexLock);
+        syncCounter++;
+        syncedBytes += bytes;
+        syncTime += MonotonicNow() - begin;
+    }
+
+    void syncCallback() {
+        pthread_setname_np(pthread_self(), "Syncing");
+        std::vector<DirtyFile> fileList;
+        while (likely(runningFlag)) {
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                while (!taskAmount) {
+                    condition.wait();
+                    if (unlikely(!runningFlag)) break;
+                }
+                if (unlikely(!runningFlag)) continue;
+                taskAmount = 0;
+                fileList.clear();
+                takeDirty(fileList);
+                syncing = true;
+            }
+            syncFiles(fileList);
+            {
+                MutexLockGuard mutexLockGuard(mutexLock);
+                syncing = false;
+                idleCondition.notifyAll();
+            }
+        }
+    }
+
+    SyncPolicy policy = SyncPolicy::Group;
+    bool policySet = false;
+    std::map<int, DirtyFile> dirtyMap;
+    std::list<DirtyFile> detachedList;
+    uint64_t pendingBytes = 0;
+    uint64_t lastSync = MonotonicNow();
+
+    std::thread *worker = nullptr;
+    bool runningFlag = true;
+    bool syncing = false;
+    uint64_t taskAmount = 0;
+    MutexLock mutexLock;
+    Condition condition;
+    Condition idleCondition;
+
+    uint64_t syncCounter = 0;
+    uint64_t syncedBytes = 0;
+    uint64_t syncTime = 0;
+    uint64_t commitCounter = 0;
+    uint64_t commitTime = 0;
+};
+
+DurabilityManager GlobalDurabilityManager;
+
+#endif //MEGA_DURABILITYMANAGER_H
@@ -103,6 +103,17 @@ public:
 
     }
 
+    // makes the names created, renamed or removed in a directory durable.
+    static int syncDirectory(const std::string &path) {
+        int fd = open(path.data(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            return -1;
+        }
+        int r = ::fsync(fd);
+        close(fd);
+        return r;
+    }
+
     int fdatasync() {
 //        fflush(file);
         return ::fdatasync(fileno(file));
@@ -10,23 +10,98 @@
 #define MEGA_MANIFEST_H
 
 #include <string>
+#include <vector>
 #include "FileOperator.h"
+#include "xxhash.h"
+#include "../RollHash/ChunkingProfile.h"
 
 struct Manifest{
     uint64_t TotalVersion;
     uint64_t ArrangementFallBehind;
+    // the catalog and index snapshots the versions are in, 0: a store from before snapshots.
+    uint64_t Generation;
+    // how the versions are chunked, its method is Unrecorded in a store from before profiles.
+    ChunkingProfile Chunking;
 };
 
 extern std::string ManifestPath;
+extern std::string HomePath;
+extern std::string CatalogPath;
+extern std::string KVPath;
+extern std::string CatalogSnapshotPath;
+extern std::string IndexSnapshotPath;
 
+std::string GetCatalogPath(uint64_t generation) {
+    if (!generation) return CatalogPath;
+    char path[256];
+    sprintf(path, CatalogSnapshotPath.data(), generation);
+    return path;
+}
+
+std::string GetIndexPath(uint64_t generation) {
+    if (!generation) return KVPath;
+    char path[256];
+    sprintf(path, IndexSnapshotPath.data(), generation);
+    return path;
+}
+
+#define ManifestMagic 0x314C4E524A47454Dull
+#define ManifestJournalLength 16
+
+struct ManifestRecord {
+    uint64_t magic;
+    Manifest manifest;
+    uint64_t checksum;
+
+    uint64_t computeChecksum() const {
+        return XXH64(&manifest, sizeof(Manifest), magic);
+    }
+};
+
+// The manifest is a journal of the last commits, the newest valid record is the state of the store. A commit
+// writes the journal aside, syncs it and renames it over the old one, then syncs the directory, so a crash
+// leaves either the old or the new journal. Everything a record refers to is durable before it is written.
 class ManifestWriter{
 public:
     ManifestWriter(const Manifest& manifest){
-        FileOperator fileOperator((char *) ManifestPath.data(), FileOpenType::Write);
-        assert(fileOperator.ok());
-        fileOperator.write((uint8_t *) &manifest, sizeof(Manifest));
+        std::vector<ManifestRecord> journal;
+        ReadJournal(journal);
+        ManifestRecord record = {ManifestMagic, manifest, 0};
+        record.checksum = record.computeChecksum();
+        journal.push_back(record);
+        if (journal.size() > ManifestJournalLength) {
+            journal.erase(journal.begin(), journal.end() - ManifestJournalLength);
+        }
+
+        std::string tempPath = ManifestPath + ".tmp";
+        {
+            FileOperator fileOperator((char *) tempPath.data(), FileOpenType::Write);
+            assert(fileOperator.ok());
+            fileOperator.write((uint8_t *) journal.data(), journal.size() * sizeof(ManifestRecord));
+            fflush(fileOperator.getFP());
+            fileOperator.fdatasync();
+        }
+        int r = rename(tempPath.data(), ManifestPath.data());
+        assert(r == 0);
+        FileOperator::syncDirectory(HomePath);
+    }
+
+    // valid records only, a damaged tail is dropped.
+    static void ReadJournal(std::vector<ManifestRecord> &journal) {
+        uint64_t size = FileOperator::size(ManifestPath);
+        FileOperator fileOperator((char *) ManifestPath.data(), FileOpenType::TRY);
+        if (!fileOperator.ok() || size % sizeof(ManifestRecord)) {
+            return;
+        }
+        journal.resize(size / sizeof(ManifestRecord));
+        journal.resize(fileOperator.read((uint8_t *) journal.data(), size) / sizeof(ManifestRecord));
+        for (uint64_t i = 0; i < journal.size(); i++) {
+            if (journal[i].magic != ManifestMagic || journal[i].checksum != journal[i].computeChecksum()) {
+                journal.resize(i);
+                break;
+            }
+        }
     }
-private:
 };
 
 class ManifestReader{
@@ -34,17 +109,55 @@ public:
     ManifestReader(struct Manifest* manifest){
         printf("-----------------------Manifest-----------------------\n");
         printf("Loading Manifest..\n");
+        memset(manifest, 0, sizeof(Manifest));
+        uint64_t size = FileOperator::size(ManifestPath);
         FileOperator fileOperator((char*)ManifestPath.data(), FileOpenType::Read);
         if(fileOperator.getStatus() == -1){
             printf("0 version in storage\n");
             manifest->TotalVersion = 0;
             manifest->ArrangementFallBehind = 0;
-        }else{
-            fileOperator.read((uint8_t*)manifest, sizeof(Manifest));
+            manifest->Generation = 0;
+        }else if (size == sizeof(uint64_t) * 2) {
+            // written before the journal.
+            fileOperator.read((uint8_t*)manifest, sizeof(uint64_t) * 2);
+            manifest->Generation = 0;
             printf("%lu versions in storage\n", manifest->TotalVersion);
+        }else{
+            std::vector<ManifestRecord> journal;
+            ManifestWriter::ReadJournal(journal);
+            if (journal.empty()) {
+                printf("Manifest %s is damaged\n", ManifestPath.data());
+                assert(0);
+                exit(1);
+            }
+            *manifest = journal.back().manifest;
+            printf("%lu versions in storage, generation %lu\n", manifest->TotalVersion, manifest->Generation);
         };
     }
 private:
 };
 
+// A write task holds the marker while it runs. Finding it at startup means the last one stopped before it
+// committed, and what it wrote after its last commit is garbage to collect.
+class RunMarker {
+public:
+    static bool exists() {
+        return access(getPath().data(), F_OK) == 0;
+    }
+
+    static void set() {
+        FileOperator marker((char *) getPath().data(), FileOpenType::Write);
+        FileOperator::syncDirectory(HomePath);
+    }
+
+    static void clear() {
+        unlink(getPath().data());
+    }
+
+private:
+    static std::string getPath() {
+        return HomePath + "/running";
+    }
+};
+
 #endif //MEGA_MANIFEST_H
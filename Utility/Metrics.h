@@ -0,0 +1,358 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_METRICS_H
+#define MEGA_METRICS_H
+
+#include <map>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include "gflags/gflags.h"
+#include "Lock.h"
+
+DEFINE_string(MetricsPath,
+              "", "file the metrics are exported to at the end of each task, empty disables exporting");
+DEFINE_string(MetricsFormat,
+              "json", "format of the exported metrics, json or prometheus");
+DEFINE_uint64(MetricsInterval,
+              0, "seconds between exports while a task is running, 0 exports only at the end");
+
+// nanoseconds of a clock which is not affected by changes of the wall clock.
+inline uint64_t MonotonicNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+class MetricsCounter {
+public:
+    void add(uint64_t n = 1) {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+class MetricsGauge {
+public:
+    void set(uint64_t v) {
+        value.store(v, std::memory_order_relaxed);
+        uint64_t m = maxValue.load(std::memory_order_relaxed);
+        while (v > m && !maxValue.compare_exchange_weak(m, v, std::memory_order_relaxed));
+    }
+
+    uint64_t get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getMax() const {
+        return maxValue.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value{0};
+    std::atomic<uint64_t> maxValue{0};
+};
+
+// power-of-two buckets, bucket i counts values in [2^(i-1), 2^i), bucket 0 counts zeros.
+#define MetricsBuckets 64
+
+class MetricsHistogram {
+public:
+    // count values equal to value, e.g. a batch of chunks whose average latency is value.
+    void record(uint64_t value, uint64_t count = 1) {
+        int bucket = value ? 64 - __builtin_clzll(value) : 0;
+        if (bucket >= MetricsBuckets) bucket = MetricsBuckets - 1;
+        buckets[bucket].fetch_add(count, std::memory_order_relaxed);
+        total.fetch_add(count, std::memory_order_relaxed);
+        sum.fetch_add(value * count, std::memory_order_relaxed);
+        uint64_t m = maxValue.load(std::memory_order_relaxed);
+        while (value > m && !maxValue.compare_exchange_weak(m, value, std::memory_order_relaxed));
+    }
+
+    uint64_t getCount() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getSum() const {
+        return sum.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getMax() const {
+        return maxValue.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getBucket(int i) const {
+        return buckets[i].load(std::memory_order_relaxed);
+    }
+
+    static uint64_t upperBound(int i) {
+        return i ? ((i < 64) ? (1ull << i) - 1 : (uint64_t) -1) : 0;
+    }
+
+    // upper bound of the bucket holding the q-quantile.
+    uint64_t quantile(double q) const {
+        uint64_t count = getCount();
+        if (!count) return 0;
+        uint64_t rank = (uint64_t) (q * count), seen = 0;
+        for (int i = 0; i < MetricsBuckets; i++) {
+            seen += getBucket(i);
+            if (seen > rank) return std::min(upperBound(i), getMax());
+        }
+        return getMax();
+    }
+
+private:
+    std::atomic<uint64_t> buckets[MetricsBuckets] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> maxValue{0};
+};
+
+// Named counters, gauges and histograms shared by all stages. Stages look their metrics up once
+// and update them without locks; export takes a snapshot of whatever has been registered.
+class MetricsRegistry {
+public:
+    MetricsRegistry() : mutexLock() {
+        startTime = MonotonicNow();
+        lastExportTime = startTime;
+    }
+
+    MetricsCounter *counter(const std::string &name) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto &entry = counters[name];
+        if (!entry) entry = new MetricsCounter;
+        return entry;
+    }
+
+    MetricsGauge *gauge(const std::string &name) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto &entry = gauges[name];
+        if (!entry) entry = new MetricsGauge;
+        return entry;
+    }
+
+    MetricsHistogram *histogram(const std::string &name) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto &entry = histograms[name];
+        if (!entry) entry = new MetricsHistogram;
+        return entry;
+    }
+
+    // exported as hits / lookups, e.g. the hit rate of a cache.
+    void ratio(const std::string &name, const std::string &hits, const std::string &lookups) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        ratios[name] = {hits, lookups};
+    }
+
+    int exportMetrics() {
+        if (FLAGS_MetricsPath.empty()) return 0;
+        MutexLockGuard mutexLockGuard(mutexLock);
+        char tempPath[512];
+        sprintf(tempPath, "%s.tmp", FLAGS_MetricsPath.data());
+        FILE *file = fopen(tempPath, "w");
+        if (!file) {
+            printf("Can not open file %s : %s\n", tempPath, strerror(errno));
+            return -1;
+        }
+        if (FLAGS_MetricsFormat == "prometheus") {
+            writePrometheus(file);
+        } else {
+            writeJSON(file);
+        }
+        fclose(file);
+        // readers of the file never see a partial export.
+        rename(tempPath, FLAGS_MetricsPath.data());
+        return 0;
+    }
+
+    void startReporter() {
+        if (FLAGS_MetricsPath.empty() || !FLAGS_MetricsInterval || reporter) return;
+        reporterRunning = true;
+        reporter = new std::thread(std::bind(&MetricsRegistry::reporterCallback, this));
+    }
+
+    void stopReporter() {
+        if (!reporter) return;
+        reporterRunning = false;
+        reporter->join();
+        delete reporter;
+        reporter = nullptr;
+    }
+
+    ~MetricsRegistry() {
+        stopReporter();
+        for (auto &entry: counters) delete entry.second;
+        for (auto &entry: gauges) delete entry.second;
+        for (auto &entry: histograms) delete entry.second;
+    }
+
+private:
+    void reporterCallback() {
+        pthread_setname_np(pthread_self(), "Metrics Thread");
+        uint64_t last = MonotonicNow();
+        while (reporterRunning) {
+            usleep(100000);
+            if (MonotonicNow() - last >= FLAGS_MetricsInterval * 1000000000ull) {
+                exportMetrics();
+                last = MonotonicNow();
+            }
+        }
+    }
+
+    double getRatio(const std::pair<std::string, std::string> &definition) {
+        auto hits = counters.find(definition.first);
+        auto lookups = counters.find(definition.second);
+        if (hits == counters.end() || lookups == counters.end() || !lookups->second->get()) return 0;
+        return (double) hits->second->get() / lookups->second->get();
+    }
+
+    // counters carry their rate over the time since the previous export and over the whole run.
+    void writeJSON(FILE *file) {
+        uint64_t now = MonotonicNow();
+        double elapsed = (now - lastExportTime) / 1e9;
+        fprintf(file, "{\n  \"uptime_s\": %.3f,\n  \"interval_s\": %.3f,\n", (now - startTime) / 1e9, elapsed);
+
+        fprintf(file, "  \"counters\": {");
+        const char *separator = "\n";
+        for (auto &entry: counters) {
+            uint64_t value = entry.second->get();
+            uint64_t &previous = lastCounterValues[entry.first];
+            fprintf(file, "%s    \"%s\": {\"value\": %lu, \"rate\": %.3f, \"average_rate\": %.3f}", separator,
+                    entry.first.data(), value, elapsed > 0 ? (value - previous) / elapsed : 0.0,
+                    now > startTime ? value / ((now - startTime) / 1e9) : 0.0);
+            previous = value;
+            separator = ",\n";
+        }
+        fprintf(file, "\n  },\n  \"gauges\": {");
+        separator = "\n";
+        for (auto &entry: gauges) {
+            fprintf(file, "%s    \"%s\": {\"value\": %lu, \"max\": %lu}", separator, entry.first.data(),
+                    entry.second->get(), entry.second->getMax());
+            separator = ",\n";
+        }
+        fprintf(file, "\n  },\n  \"ratios\": {");
+        separator = "\n";
+        for (auto &entry: ratios) {
+            fprintf(file, "%s    \"%s\": %.6f", separator, entry.first.data(), getRatio(entry.second));
+            separator = ",\n";
+        }
+        fprintf(file, "\n  },\n  \"histograms\": {");
+        separator = "\n";
+        for (auto &entry: histograms) {
+            MetricsHistogram *h = entry.second;
+            uint64_t count = h->getCount();
+            fprintf(file, "%s    \"%s\": {\"count\": %lu, \"sum\": %lu, \"mean\": %.3f, \"p50\": %lu, \"p90\": %lu, "
+                          "\"p99\": %lu, \"max\": %lu, \"buckets\": [", separator, entry.first.data(), count,
+                    h->getSum(), count ? (double) h->getSum() / count : 0.0, h->quantile(0.5), h->quantile(0.9),
+                    h->quantile(0.99), h->getMax());
+            const char *bucketSeparator = "";
+            for (int i = 0; i < MetricsBuckets; i++) {
+                if (!h->getBucket(i)) continue;
+                fprintf(file, "%s[%lu, %lu]", bucketSeparator, MetricsHistogram::upperBound(i), h->getBucket(i));
+                bucketSeparator = ", ";
+            }
+            fprintf(file, "]}");
+            separator = ",\n";
+        }
+        fprintf(file, "\n  }\n}\n");
+        lastExportTime = now;
+    }
+
+    void writePrometheus(FILE *file) {
+        uint64_t now = MonotonicNow();
+        fprintf(file, "# TYPE mega_uptime_seconds gauge\nmega_uptime_seconds %.3f\n", (now - startTime) / 1e9);
+        for (auto &entry: counters) {
+            fprintf(file, "# TYPE mega_%s counter\nmega_%s %lu\n", entry.first.data(), entry.first.data(),
+                    entry.second->get());
+        }
+        for (auto &entry: gauges) {
+            fprintf(file, "# TYPE mega_%s gauge\nmega_%s %lu\n", entry.first.data(), entry.first.data(),
+                    entry.second->get());
+            fprintf(file, "# TYPE mega_%s_max gauge\nmega_%s_max %lu\n", entry.first.data(), entry.first.data(),
+                    entry.second->getMax());
+        }
+        for (auto &entry: ratios) {
+            fprintf(file, "# TYPE mega_%s gauge\nmega_%s %.6f\n", entry.first.data(), entry.first.data(),
+                    getRatio(entry.second));
+        }
+        for (auto &entry: histograms) {
+            MetricsHistogram *h = entry.second;
+            const char *name = entry.first.data();
+            fprintf(file, "# TYPE mega_%s histogram\n", name);
+            uint64_t cumulative = 0;
+            for (int i = 0; i < MetricsBuckets - 1; i++) {
+                cumulative += h->getBucket(i);
+                if (!h->getBucket(i)) continue;
+                fprintf(file, "mega_%s_bucket{le=\"%lu\"} %lu\n", name, MetricsHistogram::upperBound(i), cumulative);
+            }
+            fprintf(file, "mega_%s_bucket{le=\"+Inf\"} %lu\nmega_%s_sum %lu\nmega_%s_count %lu\n", name,
+                    h->getCount(), name, h->getSum(), name, h->getCount());
+        }
+        lastExportTime = now;
+    }
+
+    std::map<std::string, MetricsCounter *> counters;
+    std::map<std::string, MetricsGauge *> gauges;
+    std::map<std::string, MetricsHistogram *> histograms;
+    std::map<std::string, std::pair<std::string, std::string>> ratios;
+    std::map<std::string, uint64_t> lastCounterValues;
+    MutexLock mutexLock;
+    uint64_t startTime;
+    uint64_t lastExportTime;
+
+    std::thread *reporter = nullptr;
+    std::atomic<bool> reporterRunning{false};
+};
+
+MetricsRegistry GlobalMetrics;
+
+// Depth of a queue between two stages and how long its consumer waited for work.
+// A stage whose input queue stays deep while its consumer never waits is the bottleneck.
+class QueueMetrics {
+public:
+    QueueMetrics(const std::string &name) {
+        depth = GlobalMetrics.gauge(name + "_queue_depth");
+        waitTime = GlobalMetrics.histogram(name + "_queue_wait_us");
+        enqueued = GlobalMetrics.counter(name + "_queue_tasks_total");
+    }
+
+    // called with the queue lock held, after the task is appended.
+    void push(uint64_t currentDepth) {
+        depth->set(currentDepth);
+        enqueued->add();
+    }
+
+    void pop(uint64_t currentDepth) {
+        depth->set(currentDepth);
+    }
+
+    uint64_t waitBegin() {
+        return MonotonicNow();
+    }
+
+    void waitEnd(uint64_t begin) {
+        waitTime->record((MonotonicNow() - begin) / 1000);
+    }
+
+private:
+    MetricsGauge *depth;
+    MetricsHistogram *waitTime;
+    MetricsCounter *enqueued;
+};
+
+#endif //MEGA_METRICS_H
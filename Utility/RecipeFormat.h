@@ -0,0 +1,306 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_RECIPEFORMAT_H
+#define MEGA_RECIPEFORMAT_H
+
+#include <vector>
+#include <unordered_map>
+#include <zstd.h>
+#include "gflags/gflags.h"
+#include "StorageTask.h"
+#include "FileOperator.h"
+#include "DurabilityManager.h"
+#include "../MetadataManager/MetadataManager.h"
+
+DEFINE_uint64(RecipeBlockEntries,
+              4096, "chunks per compressed block in a recipe");
+
+// Recipe v2 layout:
+//   RecipeHeader | block 0 | block 1 | ... | RecipeBlockIndex[blockCount]
+// Each block is a zstd frame of varint-encoded entries. Offsets are not stored, every entry carries its size,
+// and base fingerprints are references into a per-block dictionary. The sparse block index maps the logical
+// offset where each block starts to its place in the file.
+// Recipes without the magic number are v1, a flat array of BlockHeader.
+#define RecipeMagic 0x3256455043455247ull
+
+struct RecipeHeader {
+    uint64_t magic;
+    uint64_t chunkCount;
+    uint64_t deltaCount;
+    uint64_t totalSize;
+    uint64_t blockCount;
+    uint64_t indexOffset;
+};
+
+struct RecipeBlockIndex {
+    uint64_t logicalOffset;
+    uint64_t fileOffset;
+    uint64_t compressedLength;
+    uint64_t rawLength;
+    uint64_t entryCount;
+};
+
+class RecipeWriter {
+public:
+    RecipeWriter(char *path) : recipeFile(path, FileOpenType::Write) {
+        memset(&header, 0, sizeof(RecipeHeader));
+        header.magic = RecipeMagic;
+        recipeFile.write((uint8_t *) &header, sizeof(RecipeHeader));
+        fileOffset = sizeof(RecipeHeader);
+    }
+
+    int append(const BlockHeader &blockHeader) {
+        uint8_t flag = blockHeader.type;
+        rawBlock.push_back(flag);
+        putFP(blockHeader.fp);
+        putVarint(blockHeader.length);
+        if (blockHeader.type) {
+            putVarint(blockHeader.oriLength);
+            auto iter = baseDictionary.find(blockHeader.baseFP);
+            if (iter == baseDictionary.end()) {
+                // the next free id means the fingerprint follows inline and joins the dictionary.
+                uint64_t id = baseDictionary.size();
+                putVarint(id);
+                putFP(blockHeader.baseFP);
+                baseDictionary[blockHeader.baseFP] = id;
+            } else {
+                putVarint(iter->second);
+            }
+            header.deltaCount++;
+            blockSize += blockHeader.oriLength;
+        } else {
+            blockSize += blockHeader.length;
+        }
+        header.chunkCount++;
+        blockEntries++;
+        if (blockEntries >= FLAGS_RecipeBlockEntries) {
+            flushBlock();
+        }
+        return 0;
+    }
+
+    ~RecipeWriter() {
+        flushBlock();
+        header.blockCount = blockIndex.size();
+        header.indexOffset = fileOffset;
+        recipeFile.write((uint8_t *) blockIndex.data(), blockIndex.size() * sizeof(RecipeBlockIndex));
+        recipeFile.seek(0);
+        recipeFile.write((uint8_t *) &header, sizeof(RecipeHeader));
+        fflush(recipeFile.getFP());
+        GlobalDurabilityManager.written(recipeFile.getFd(), 0,
+                                        fileOffset + blockIndex.size() * sizeof(RecipeBlockIndex));
+        GlobalDurabilityManager.closing(recipeFile.getFd());
+        printf("[Recipe] chunks:%lu, delta chunks:%lu, blocks:%lu, v1 size:%lu, v2 size:%lu\n", header.chunkCount,
+               header.deltaCount, header.blockCount, header.chunkCount * sizeof(BlockHeader),
+               fileOffset + blockIndex.size() * sizeof(RecipeBlockIndex));
+        if (compressBuffer) free(compressBuffer);
+    }
+
+private:
+    void flushBlock() {
+        if (!blockEntries) return;
+        uint64_t bound = ZSTD_compressBound(rawBlock.size());
+        if (bound > compressBufferSize) {
+            compressBuffer = (uint8_t *) realloc(compressBuffer, bound);
+            compressBufferSize = bound;
+        }
+        size_t compressedLength = ZSTD_compress(compressBuffer, compressBufferSize, rawBlock.data(), rawBlock.size(),
+                                                ZSTD_CLEVEL_DEFAULT);
+        assert(!ZSTD_isError(compressedLength));
+        recipeFile.write(compressBuffer, compressedLength);
+        blockIndex.push_back({header.totalSize, fileOffset, compressedLength, rawBlock.size(), blockEntries});
+        fileOffset += compressedLength;
+        header.totalSize += blockSize;
+
+        rawBlock.clear();
+        baseDictionary.clear();
+        blockEntries = 0;
+        blockSize = 0;
+    }
+
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            rawBlock.push_back((uint8_t) (value | 0x80));
+            value >>= 7;
+        }
+        rawBlock.push_back((uint8_t) value);
+    }
+
+    void putFP(const SHA1FP &fp) {
+        uint8_t *ptr = (uint8_t *) &fp.fp1;
+        rawBlock.insert(rawBlock.end(), ptr, ptr + sizeof(uint64_t));
+        uint32_t rest[3] = {fp.fp2, fp.fp3, fp.fp4};
+        ptr = (uint8_t *) rest;
+        rawBlock.insert(rawBlock.end(), ptr, ptr + sizeof(rest));
+    }
+
+    FileOperator recipeFile;
+    RecipeHeader header;
+    std::vector<RecipeBlockIndex> blockIndex;
+    std::vector<uint8_t> rawBlock;
+    std::unordered_map<SHA1FP, uint64_t, TupleHasher, TupleEqualer> baseDictionary;
+    uint64_t blockEntries = 0;
+    uint64_t blockSize = 0;
+    uint64_t fileOffset;
+    uint8_t *compressBuffer = nullptr;
+    uint64_t compressBufferSize = 0;
+};
+
+class RecipeReader {
+public:
+    RecipeReader(char *path) : recipeFile(path, FileOpenType::Read) {
+        uint64_t fileSize = FileOperator::size(path);
+        memset(&header, 0, sizeof(RecipeHeader));
+        if (fileSize >= sizeof(RecipeHeader)) {
+            recipeFile.pread((uint8_t *) &header, 0, sizeof(RecipeHeader));
+        }
+        if (header.magic == RecipeMagic) {
+            blockIndex.resize(header.blockCount);
+            recipeFile.pread((uint8_t *) blockIndex.data(), header.indexOffset,
+                             header.blockCount * sizeof(RecipeBlockIndex));
+        } else {
+            // what was read as a header is the first chunks of a v1 recipe.
+            memset(&header, 0, sizeof(RecipeHeader));
+            loadV1(fileSize);
+        }
+    }
+
+    uint64_t getTotalSize() const {
+        return header.totalSize;
+    }
+
+    uint64_t getChunkCount() const {
+        return header.chunkCount;
+    }
+
+    uint64_t getDeltaCount() const {
+        return header.deltaCount;
+    }
+
+    // calls func(blockHeader, pos) for every chunk overlapping [begin, end), only blocks overlapping it are read.
+    template<typename Func>
+    int scan(uint64_t begin, uint64_t end, Func func) {
+        if (begin >= end) return 0;
+        // the last block starting at or before begin is the first one to overlap it.
+        uint64_t first = 0, last = blockIndex.size();
+        while (last - first > 1) {
+            uint64_t mid = (first + last) / 2;
+            if (blockIndex[mid].logicalOffset <= begin) {
+                first = mid;
+            } else {
+                last = mid;
+            }
+        }
+        for (uint64_t i = first; i < blockIndex.size() && blockIndex[i].logicalOffset < end; i++) {
+            if (v1Buffer) {
+                scanV1(begin, end, func);
+            } else {
+                scanBlock(blockIndex[i], begin, end, func);
+            }
+        }
+        return 0;
+    }
+
+    ~RecipeReader() {
+        if (v1Buffer) free(v1Buffer);
+    }
+
+private:
+    template<typename Func>
+    void scanBlock(const RecipeBlockIndex &index, uint64_t begin, uint64_t end, Func func) {
+        std::vector<uint8_t> compressed(index.compressedLength);
+        std::vector<uint8_t> raw(index.rawLength);
+        recipeFile.pread(compressed.data(), index.fileOffset, index.compressedLength);
+        size_t rawLength = ZSTD_decompress(raw.data(), raw.size(), compressed.data(), compressed.size());
+        assert(!ZSTD_isError(rawLength) && rawLength == index.rawLength);
+
+        std::vector<SHA1FP> baseDictionary;
+        const uint8_t *ptr = raw.data();
+        uint64_t pos = index.logicalOffset;
+        BlockHeader blockHeader;
+        for (uint64_t i = 0; i < index.entryCount && pos < end; i++) {
+            memset(&blockHeader, 0, sizeof(BlockHeader));
+            blockHeader.type = *ptr++;
+            blockHeader.fp = getFP(ptr);
+            blockHeader.length = getVarint(ptr);
+            uint64_t size = blockHeader.length;
+            if (blockHeader.type) {
+                blockHeader.oriLength = getVarint(ptr);
+                uint64_t id = getVarint(ptr);
+                if (id == baseDictionary.size()) {
+                    baseDictionary.push_back(getFP(ptr));
+                }
+                blockHeader.baseFP = baseDictionary[id];
+                size = blockHeader.oriLength;
+            }
+            if (pos + size > begin) {
+                func(blockHeader, pos);
+            }
+            pos += size;
+        }
+    }
+
+    template<typename Func>
+    void scanV1(uint64_t begin, uint64_t end, Func func) {
+        uint64_t pos = 0;
+        for (uint64_t i = 0; i < header.chunkCount && pos < end; i++) {
+            BlockHeader *blockHeader = (BlockHeader *) (v1Buffer + i * sizeof(BlockHeader));
+            uint64_t size = blockHeader->type ? blockHeader->oriLength : blockHeader->length;
+            if (pos + size > begin) {
+                func(*blockHeader, pos);
+            }
+            pos += size;
+        }
+    }
+
+    // v1 has no summary, it is read and walked once and then served as a single block.
+    void loadV1(uint64_t fileSize) {
+        assert(fileSize % sizeof(BlockHeader) == 0);
+        v1Buffer = (uint8_t *) malloc(fileSize);
+        recipeFile.pread(v1Buffer, 0, fileSize);
+        header.chunkCount = fileSize / sizeof(BlockHeader);
+        for (uint64_t i = 0; i < header.chunkCount; i++) {
+            BlockHeader *blockHeader = (BlockHeader *) (v1Buffer + i * sizeof(BlockHeader));
+            if (blockHeader->type) {
+                header.deltaCount++;
+                header.totalSize += blockHeader->oriLength;
+            } else {
+                header.totalSize += blockHeader->length;
+            }
+        }
+        blockIndex.push_back({0, 0, 0, fileSize, header.chunkCount});
+    }
+
+    static uint64_t getVarint(const uint8_t *&ptr) {
+        uint64_t value = 0;
+        int shift = 0;
+        while (*ptr & 0x80) {
+            value |= (uint64_t) (*ptr++ & 0x7f) << shift;
+            shift += 7;
+        }
+        value |= (uint64_t) (*ptr++) << shift;
+        return value;
+    }
+
+    static SHA1FP getFP(const uint8_t *&ptr) {
+        SHA1FP fp;
+        memcpy(&fp.fp1, ptr, sizeof(uint64_t));
+        ptr += sizeof(uint64_t);
+        uint32_t rest[3];
+        memcpy(rest, ptr, sizeof(rest));
+        ptr += sizeof(rest);
+        fp.fp2 = rest[0];
+        fp.fp3 = rest[1];
+        fp.fp4 = rest[2];
+        return fp;
+    }
+
+    FileOperator recipeFile;
+    RecipeHeader header;
+    std::vector<RecipeBlockIndex> blockIndex;
+    uint8_t *v1Buffer = nullptr;
+};
+
+#endif //MEGA_RECIPEFORMAT_H
@@ -5,6 +5,7 @@
 #include <list>
 #include <tuple>
 #include <cstring>
+#include <atomic>
 
 struct SHA1FP {
     //std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t> fp;
@@ -105,6 +106,8 @@ struct ChunkTask {
     uint64_t end;
     CountdownLatch *countdownLatch = nullptr;
     uint64_t index;
+    // set once the last chunk of the version is chunked.
+    uint64_t *digest = nullptr;
 };
 
 struct StorageTask {
@@ -114,6 +117,8 @@ struct StorageTask {
     uint64_t fileID;
     uint64_t end;
     CountdownLatch *countdownLatch = nullptr;
+    // digest of the version, set once it has been chunked.
+    uint64_t digest = 0;
 
     void destruction() {
         if (buffer) free(buffer);
@@ -133,6 +138,9 @@ struct RestoreParseTask {
     uint64_t index = 0;
     uint64_t beginPos = 0;
     uint64_t sizeAfterCompression = 0;
+    uint64_t sequence = 0;
+    // chunks passed to the decoders point into buffer, the last one decoded releases the task.
+    std::atomic<uint64_t> refCount{1};
 
     RestoreParseTask(uint8_t *buf, uint64_t len, uint64_t sac) {
         buffer = buf;
@@ -145,6 +153,16 @@ struct RestoreParseTask {
         endFlag = true;
     }
 
+    void reference() {
+        refCount++;
+    }
+
+    void release() {
+        if (--refCount == 0) {
+            delete this;
+        }
+    }
+
     ~RestoreParseTask() {
         if (buffer) {
             free(buffer);
@@ -152,37 +170,109 @@ struct RestoreParseTask {
     }
 };
 
-struct RestoreWriteTask {
-    uint8_t *buffer = nullptr;
+// a delta chunk and its base, both referenced in place when possible, copied when they have to wait for each other.
+struct RestoreDecodeTask {
+    uint8_t *delta = nullptr;
+    uint64_t deltaLength = 0;
+    uint8_t *base = nullptr;
+    uint64_t baseLength = 0;
     uint64_t pos;
-    uint64_t type: 1;
-    uint64_t base: 1;
-    uint64_t length: 62;
-    uint64_t deltaLength;
-    bool endFlag = false;
+    uint8_t *copied = nullptr;
+    RestoreParseTask *owner = nullptr;
 
-    RestoreWriteTask(uint8_t *buf, uint64_t p, uint64_t len, uint64_t t, uint64_t isbase, uint64_t dl) {
-        buffer = (uint8_t *) malloc(len);
-        memcpy(buffer, buf, len);
-        length = len;
-        base = isbase;
-        type = t;
+    RestoreDecodeTask(uint64_t p) {
         pos = p;
+    }
 
-        if (isbase) {
-            deltaLength = dl;
+    void copyDelta(uint8_t *buf, uint64_t len) {
+        copied = (uint8_t *) malloc(len);
+        memcpy(copied, buf, len);
+        delta = copied;
+        deltaLength = len;
+    }
+
+    void copyBase(uint8_t *buf, uint64_t len) {
+        copied = (uint8_t *) malloc(len);
+        memcpy(copied, buf, len);
+        base = copied;
+        baseLength = len;
+    }
+
+    void setDelta(uint8_t *buf, uint64_t len, RestoreParseTask *o) {
+        delta = buf;
+        deltaLength = len;
+        owner = o;
+        owner->reference();
+    }
+
+    void setBase(uint8_t *buf, uint64_t len, RestoreParseTask *o) {
+        base = buf;
+        baseLength = len;
+        owner = o;
+        owner->reference();
+    }
+
+    void releaseBuffers() {
+        if (copied) {
+            free(copied);
+            copied = nullptr;
+        }
+        if (owner) {
+            owner->release();
+            owner = nullptr;
         }
     }
 
-    RestoreWriteTask(bool flag) {
-        endFlag = true;
+    ~RestoreDecodeTask() {
+        releaseBuffers();
     }
+};
 
-    ~RestoreWriteTask() {
-        if (buffer) {
-            free(buffer);
+struct ArrangementFilterTask{
+    uint8_t* readBuffer = nullptr;
+    uint64_t length;
+    uint64_t classId;
+    uint64_t arrangementVersion;
+    bool classEndFlag = false;
+    bool finalEndFlag = false;
+    bool startFlag = false;
+    CountdownLatch* countdownLatch;
+    // chunks passed to the write pipeline point into readBuffer, the last one written releases the task.
+    std::atomic<uint64_t> refCount{1};
+
+    ArrangementFilterTask(uint8_t *buf, uint64_t len, uint64_t cid, uint64_t version) {
+        readBuffer = buf;
+        length = len;
+        classId = cid;
+        arrangementVersion = version;
+    }
+
+    ArrangementFilterTask(bool flag, uint64_t cid) {
+        classEndFlag = true;
+        classId = cid;
+    }
+
+    ArrangementFilterTask(bool flag){
+        finalEndFlag = true;
+    }
+
+    ArrangementFilterTask(){
+
+    }
+
+    void reference() {
+        refCount++;
+    }
+
+    void release() {
+        if (--refCount == 0) {
+            delete this;
         }
     }
+
+    ~ArrangementFilterTask(){
+        if(readBuffer) free(readBuffer);
+    }
 };
 
 struct ArrangementWriteTask{
@@ -195,10 +285,13 @@ struct ArrangementWriteTask{
     bool finalEndFlag = false;
     bool startFlag = false;
     CountdownLatch* countdownLatch;
+    ArrangementFilterTask* owner = nullptr;
 
-    ArrangementWriteTask(uint8_t *buf, uint64_t len, uint64_t pcid, uint64_t version, bool isArch) {
-        writeBuffer = (uint8_t *) malloc(len);
-        memcpy(writeBuffer, buf, len);
+    ArrangementWriteTask(uint8_t *buf, uint64_t len, uint64_t pcid, uint64_t version, bool isArch,
+                         ArrangementFilterTask *o) {
+        writeBuffer = buf;
+        owner = o;
+        owner->reference();
         length = len;
         beforeClassId = pcid;
         arrangementVersion = version;
@@ -219,8 +312,8 @@ struct ArrangementWriteTask{
     }
 
     ~ArrangementWriteTask() {
-        if (writeBuffer) {
-            free(writeBuffer);
+        if (owner) {
+            owner->release();
         }
     }
 };
@@ -237,41 +330,6 @@ struct ArrangementWriteTask{
 //    CountdownLatch* countdownLatch;
 //};
 
-struct ArrangementFilterTask{
-    uint8_t* readBuffer = nullptr;
-    uint64_t length;
-    uint64_t classId;
-    uint64_t arrangementVersion;
-    bool classEndFlag = false;
-    bool finalEndFlag = false;
-    bool startFlag = false;
-    CountdownLatch* countdownLatch;
-
-    ArrangementFilterTask(uint8_t *buf, uint64_t len, uint64_t cid, uint64_t version) {
-        readBuffer = buf;
-        length = len;
-        classId = cid;
-        arrangementVersion = version;
-    }
-
-    ArrangementFilterTask(bool flag, uint64_t cid) {
-        classEndFlag = true;
-        classId = cid;
-    }
-
-    ArrangementFilterTask(bool flag){
-        finalEndFlag = true;
-    }
-
-    ArrangementFilterTask(){
-
-    }
-
-    ~ArrangementFilterTask(){
-        if(readBuffer) free(readBuffer);
-    }
-};
-
 struct ArrangementTask {
     uint64_t arrangementVersion;
     CountdownLatch *countdownLatch = nullptr;
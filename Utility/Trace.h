@@ -0,0 +1,168 @@
+/*
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_TRACE_H
+#define MEGA_TRACE_H
+
+// Tracing is compiled in only with -DMEGA_TRACE (cmake -DMEGA_TRACE=ON), otherwise the macros are empty.
+//   TRACE_SPAN(name, index, version)     a span from here to the end of the scope
+//   TRACE_INSTANT(name, index, version)  a single point, e.g. a chunk entering a queue
+//   TRACE_COMPLETE(name, begin, index, version)  a span which started at begin (MonotonicNow())
+// index is the chunk index or a count, version the version the work belongs to.
+
+#ifdef MEGA_TRACE
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <pthread.h>
+#include "gflags/gflags.h"
+#include "Lock.h"
+#include "Likely.h"
+#include "Metrics.h"
+
+DEFINE_string(TracePath,
+              "trace.json", "file the trace is written to on exit, in Chrome trace format (also read by Perfetto)");
+
+struct TraceEvent {
+    const char *name;
+    uint64_t begin;
+    uint64_t duration;
+    uint64_t index;
+    uint64_t version;
+    char phase;
+};
+
+#define TraceBlockEvents 65536
+#define TraceMaxBlocks 1024
+
+// Events of one thread. Only the owner appends, into fixed blocks which are never moved,
+// the dump reads up to the count published by the owner. Events beyond the last block are dropped.
+struct TraceBuffer {
+    TraceEvent *blocks[TraceMaxBlocks] = {};
+    std::atomic<uint64_t> count{0};
+    uint64_t dropped = 0;
+    uint64_t tid;
+    char threadName[32];
+
+    void append(const TraceEvent &event) {
+        uint64_t n = count.load(std::memory_order_relaxed);
+        uint64_t block = n / TraceBlockEvents;
+        if (unlikely(block >= TraceMaxBlocks)) {
+            dropped++;
+            return;
+        }
+        if (unlikely(!blocks[block])) {
+            blocks[block] = new TraceEvent[TraceBlockEvents];
+        }
+        blocks[block][n % TraceBlockEvents] = event;
+        count.store(n + 1, std::memory_order_release);
+    }
+};
+
+class Tracer {
+public:
+    Tracer() : mutexLock() {
+        startTime = MonotonicNow();
+    }
+
+    TraceBuffer *getBuffer() {
+        static thread_local TraceBuffer *buffer = nullptr;
+        if (unlikely(!buffer)) {
+            buffer = new TraceBuffer;
+            pthread_getname_np(pthread_self(), buffer->threadName, sizeof(buffer->threadName));
+            MutexLockGuard mutexLockGuard(mutexLock);
+            buffer->tid = bufferList.size() + 1;
+            bufferList.push_back(buffer);
+        }
+        return buffer;
+    }
+
+    void record(const char *name, char phase, uint64_t begin, uint64_t end, uint64_t index, uint64_t version) {
+        getBuffer()->append({name, begin, end - begin, index, version, phase});
+    }
+
+    // called once the pipelines are gone, threads still tracing only lose their newest events.
+    int dump() {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        FILE *file = fopen(FLAGS_TracePath.data(), "w");
+        if (!file) {
+            printf("Can not open file %s : %s\n", FLAGS_TracePath.data(), strerror(errno));
+            return -1;
+        }
+        fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        const char *separator = "";
+        uint64_t total = 0, dropped = 0;
+        for (auto buffer: bufferList) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+                    separator, buffer->tid, buffer->threadName);
+            separator = ",\n";
+            uint64_t count = buffer->count.load(std::memory_order_acquire);
+            for (uint64_t i = 0; i < count; i++) {
+                const TraceEvent &event = buffer->blocks[i / TraceBlockEvents][i % TraceBlockEvents];
+                fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f", event.name,
+                        event.phase, buffer->tid, (event.begin - startTime) / 1000.0);
+                if (event.phase == 'X') {
+                    fprintf(file, ",\"dur\":%.3f", event.duration / 1000.0);
+                } else {
+                    fprintf(file, ",\"s\":\"t\"");
+                }
+                fprintf(file, ",\"args\":{\"index\":%lu,\"version\":%lu}}", event.index, event.version);
+            }
+            total += count;
+            dropped += buffer->dropped;
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        printf("[Trace] %lu events of %lu threads written to %s, %lu dropped\n", total,
+               (uint64_t) bufferList.size(), FLAGS_TracePath.data(), dropped);
+        return 0;
+    }
+
+private:
+    std::vector<TraceBuffer *> bufferList;
+    MutexLock mutexLock;
+    uint64_t startTime;
+};
+
+Tracer GlobalTracer;
+
+class TraceSpan {
+public:
+    TraceSpan(const char *n, uint64_t i, uint64_t v) : name(n), index(i), version(v) {
+        begin = MonotonicNow();
+    }
+
+    ~TraceSpan() {
+        GlobalTracer.record(name, 'X', begin, MonotonicNow(), index, version);
+    }
+
+private:
+    const char *name;
+    uint64_t index;
+    uint64_t version;
+    uint64_t begin;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SPAN(name, index, version) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name, index, version)
+#define TRACE_INSTANT(name, index, version) \
+    do { uint64_t traceNow = MonotonicNow(); GlobalTracer.record(name, 'i', traceNow, traceNow, index, version); } while (0)
+#define TRACE_COMPLETE(name, begin, index, version) GlobalTracer.record(name, 'X', begin, MonotonicNow(), index, version)
+#define TRACE_DUMP() GlobalTracer.dump()
+
+#else
+
+#define TRACE_SPAN(name, index, version) do {} while (0)
+#define TRACE_INSTANT(name, index, version) do {} while (0)
+#define TRACE_COMPLETE(name, begin, index, version) do {} while (0)
+#define TRACE_DUMP() do {} while (0)
+
+#endif
+
+#endif //MEGA_TRACE_H
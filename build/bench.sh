@@ -0,0 +1,50 @@
+#!/bin/bash
+
+# Macro-benchmark on a synthetic workload, no dataset or root access needed.
+# Every version is backed up (with arrangement and retention deletion), then restored and compared.
+# usage: ./bench.sh [working path] [versions] [size of v1] [retention] [MeGA_workload flags..]
+# MEGA_FLAGS are passed to every MeGA run, e.g. MEGA_FLAGS="--DeltaSelectorThreshold=30".
+
+work=${1:-/tmp/MeGABench}
+versions=${2:-10}
+size=${3:-268435456}
+retention=${4:-5}
+shift 4 2>/dev/null || shift $#
+
+bin=$(cd "$(dirname "$0")" && pwd)
+mkdir -p ${work}/data ${work}/log
+sh $bin/init.sh ${work}/store
+printf 'path = "%s"\nretention = %s\n' ${work}/store ${retention} > ${work}/config.toml
+
+$bin/MeGA_workload --GenOutput=${work}/data --GenVersions=${versions} --GenSize=${size} "$@" > ${work}/log/generate || exit 1
+
+# the last value printed after a label, - if there is none.
+field() {
+    value=$(grep -o "$1[^,]*" $2 | tail -1 | sed "s/$1//; s/[^0-9.]*$//")
+    echo ${value:--}
+}
+
+printf "%-8s %12s %10s %10s %10s %12s %12s %12s %10s %12s %12s %8s\n" version size write_MB/s dedup delta \
+    arrange_us delete_us restore_MB/s read_amp write_rss_KB restore_rss_KB check
+for version in $(seq 1 ${versions}); do
+    wlog=${work}/log/write_${version}
+    rlog=${work}/log/restore_${version}
+    $bin/MeGA --ConfigFile=${work}/config.toml --task=write --InputFile=${work}/data/v${version} ${MEGA_FLAGS} > $wlog 2>&1 \
+        || { echo "write of version ${version} failed, see $wlog"; exit 1; }
+
+    # the newest version is the last retained one.
+    recipe=$(( version < retention ? version : retention ))
+    $bin/MeGA --ConfigFile=${work}/config.toml --task=restore --RestorePath=${work}/restored --RestoreRecipe=${recipe} \
+        ${MEGA_FLAGS} > $rlog 2>&1 || { echo "restore of version ${version} failed, see $rlog"; exit 1; }
+    if cmp -s ${work}/restored ${work}/data/v${version}; then check=OK; else check=MISMATCH; fi
+    rm -f ${work}/restored
+
+    total=$(field "BackupSize:" $wlog)
+    dedup=$(field "AfterDedup:" $wlog)
+    delta=$(field "AfterDelta:" $wlog)
+    printf "%-8s %12s %10s %10.3f %10.3f %12s %12s %12s %10s %12s %12s %8s\n" ${version} \
+        $(field "Backup Size:" $wlog) $(field "Speed:" $wlog) \
+        $(awk "BEGIN{print $total / $dedup}") $(awk "BEGIN{print $dedup / $delta}") \
+        $(field "Arrangement duration : " $wlog) $(field "Deletion duration : " $wlog) $(field "speed : " $rlog) $(field "Read amplification : " $rlog) \
+        $(field "Peak RSS : " $wlog) $(field "Peak RSS : " $rlog) ${check}
+done
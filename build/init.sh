@@ -7,4 +7,5 @@ mkdir -p ${DIR}/storageFiles/
 rm -f ${DIR}/logicFiles/*
 rm -f ${DIR}/storageFiles/*
 rm -f ${DIR}/manifest
+rm -f ${DIR}/catalog ${DIR}/catalog.* ${DIR}/kvstore.* ${DIR}/running
 rm -f ${DIR}/kvstore
\ No newline at end of file
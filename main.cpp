@@ -7,19 +7,29 @@
  */
 
 #include <iostream>
+#include <csignal>
+#include <sys/resource.h>
 
 #include "DedupPipeline/ReadFilePipeline.h"
 #include "RestorePipeline/RestoreReadPipeline.h"
+#include "RestorePipeline/RestoreStreamPipeline.h"
+#include "RestorePipeline/Verifier.h"
 #include "DedupPipeline/Eliminator.h"
+#include "MetadataManager/IndexRebuilder.h"
 #include "gflags/gflags.h"
 #include "Utility/Config.h"
 #include "Utility/Manifest.h"
+#include "Utility/Trace.h"
 #include "ArrangementPipeline/ArrangementReadPipeline.h"
 
 DEFINE_string(RestorePath,
               "", "restore path");
 DEFINE_int64(RestoreRecipe,
              1, "restore recipe");
+DEFINE_uint64(RestoreOffset,
+              0, "first byte of the version to restore, for restore-range");
+DEFINE_uint64(RestoreLength,
+              0, "bytes to restore from RestoreOffset, 0 means until the end of the version, for restore-range");
 DEFINE_string(task,
               "", "task type");
 DEFINE_string(BatchFilePath,
@@ -31,36 +41,68 @@ DEFINE_string(InputFile,
 DEFINE_bool(ApplyArrangement,
             true, "Whether apply arrangement");
 DEFINE_bool(delta, true, "whether delta compression");
+DEFINE_uint64(CheckpointVersions,
+              16, "batch mode saves the manifest and index after this many versions");
+DEFINE_uint64(CheckpointSeconds,
+              3600, "batch mode saves the manifest and index when this much time passed since the last save");
+DEFINE_bool(BatchPipelining,
+            true, "batch mode reads, chunks and hashes the next version while the current one is deduplicated");
+DEFINE_bool(BatchFollow,
+            false, "batch mode keeps waiting for lines appended to the batch file until SIGINT/SIGTERM");
 
 std::string LogicFilePath;
-std::string ClassFilePath;
-std::string VersionFilePath;
 std::string ManifestPath;
 std::string HomePath;
-std::string ClassFileAppendPath;
+std::string CatalogPath;
+std::string CatalogSnapshotPath;
+std::string IndexSnapshotPath;
+std::string SegmentFilePath;
 uint64_t TotalVersion;
 uint64_t RetentionTime;
 std::string KVPath;
 bool DeltaSwitch;
 
-uint64_t  do_backup(const std::string& path){
+struct BackupTask {
     StorageTask storageTask;
-    CountdownLatch countdownLatch(5); // there are 5 pipelines in the workflow of write.
-    storageTask.path = path;
-    storageTask.countdownLatch = &countdownLatch;
-    storageTask.fileID = TotalVersion;
-    GlobalReadPipelinePtr->addTask(&storageTask);
-    countdownLatch.wait();
-    return storageTask.length;
+    CountdownLatch countdownLatch{5}; // there are 5 pipelines in the workflow of write.
+    struct timeval t0;
+};
+
+BackupTask *submit_backup(const std::string &path, uint64_t fileID) {
+    BackupTask *backupTask = new BackupTask;
+    backupTask->storageTask.path = path;
+    backupTask->storageTask.countdownLatch = &backupTask->countdownLatch;
+    backupTask->storageTask.fileID = fileID;
+    gettimeofday(&backupTask->t0, NULL);
+    GlobalReadPipelinePtr->addTask(&backupTask->storageTask);
+    return backupTask;
+}
+
+// the recipe of the version is in the catalog once its backup finished, the digest of its content goes with it.
+void wait_backup(BackupTask *backupTask) {
+    backupTask->countdownLatch.wait();
+    GlobalContainerCatalog.setRecipeDigest(backupTask->storageTask.fileID, backupTask->storageTask.digest);
+}
+
+uint64_t  do_backup(const std::string& path){
+    BackupTask *backupTask = submit_backup(path, TotalVersion);
+    GlobalDeduplicationPipelinePtr->allowVersion();
+    wait_backup(backupTask);
+    uint64_t length = backupTask->storageTask.length;
+    delete backupTask;
+    return length;
 }
 
-int do_restore(uint64_t version, uint64_t fallBehind) {
+int do_restore(uint64_t version, uint64_t fallBehind, uint64_t offset = 0, uint64_t length = -1) {
   struct timeval t0, t1;
 
   if (version == -1) version = TotalVersion;
 
   char recipePath[256];
-  sprintf(recipePath, LogicFilePath.data(), version);
+  if (!GlobalContainerCatalog.getRecipePath(version, recipePath)) {
+      printf("Version %lu does not exist\n", version);
+      return -1;
+  }
   CountdownLatch countdownLatch(1);
 
   RestoreTask restoreTask = {
@@ -72,7 +114,10 @@ int do_restore(uint64_t version, uint64_t fallBehind) {
     GlobalRestoreReadPipelinePtr = new RestoreReadPipeline();
     GlobalRestoreDecomPipelinePtr = new RestoreDecomPipeline();
     GlobalRestoreWritePipelinePtr = new RestoreWritePipeline(FLAGS_RestorePath, &countdownLatch);  // order is important.
-    GlobalRestoreParserPipelinePtr = new RestoreParserPipeline(version, recipePath);  // order is important.
+    if (!offset && length == (uint64_t) -1) {
+        GlobalRestoreWritePipelinePtr->setDigest(GlobalContainerCatalog.getRecipeDigest(version));
+    }
+    GlobalRestoreParserPipelinePtr = new RestoreParserPipeline(recipePath, offset, length);  // order is important.
 
     gettimeofday(&t0, NULL);
     GlobalRestoreReadPipelinePtr->addTask(&restoreTask);
@@ -80,12 +125,67 @@ int do_restore(uint64_t version, uint64_t fallBehind) {
     gettimeofday(&t1, NULL);
     uint64_t duration = (t1.tv_sec-t0.tv_sec)*1000000 + (t1.tv_usec-t0.tv_usec);
     printf("Total duration : %lu, speed : %f MB/s\n", duration, (float)GlobalRestoreWritePipelinePtr->getTotalSize() / duration);
+    int r = GlobalRestoreWritePipelinePtr->getResult();
 
     delete GlobalRestoreReadPipelinePtr;
     delete GlobalRestoreDecomPipelinePtr;
     delete GlobalRestoreParserPipelinePtr;
     delete GlobalRestoreWritePipelinePtr;
 
+    return r;
+}
+
+int do_restore_stream(uint64_t version, uint64_t fallBehind, uint64_t offset, uint64_t length, int outFd) {
+    if (version == -1) version = TotalVersion;
+
+    char recipePath[256];
+    if (!GlobalContainerCatalog.getRecipePath(version, recipePath)) {
+        printf("Version %lu does not exist\n", version);
+        return -1;
+    }
+    if (outFd < 0) {
+        outFd = open(FLAGS_RestorePath.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outFd < 0) {
+            printf("Can not open file %s : %s\n", FLAGS_RestorePath.data(), strerror(errno));
+            return -1;
+        }
+    }
+
+    RestoreTask restoreTask = {
+            TotalVersion,
+            version,
+            fallBehind
+    };
+
+    int r;
+    {
+        RestoreStreamer restoreStreamer(recipePath, outFd, offset, length);
+        restoreStreamer.setDigest(GlobalContainerCatalog.getRecipeDigest(version));
+        r = restoreStreamer.run(&restoreTask);
+    }
+    close(outFd);
+    return r;
+}
+
+// a store keeps the profile its first write recorded, chunking it any other way would stop the chunks of new
+// versions from deduplicating against the old ones. a store from before profiles records the requested one.
+int resolve_chunking(Manifest &manifest, bool writing) {
+    ChunkingProfile requested;
+    int r = ChunkingProfile::fromFlags(&requested);
+    if (manifest.Chunking.method != (uint64_t) ChunkingMethodType::Unrecorded) {
+        if (writing && ChunkingProfile::requested() && (r || requested != manifest.Chunking)) {
+            manifest.Chunking.print("The store keeps chunking with its recorded profile: ");
+        }
+        GlobalChunkingProfile = manifest.Chunking;
+        return 0;
+    }
+    if (r) {
+        return writing ? r : 0;
+    }
+    GlobalChunkingProfile = requested;
+    if (writing) {
+        manifest.Chunking = requested;
+    }
     return 0;
 }
 
@@ -108,13 +208,233 @@ int do_delete(){
     TotalVersion--;
 }
 
+int finish_version(uint64_t taskLength, const struct timeval &t0, Manifest &manifest);
+
+uint64_t peak_rss() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+uint64_t do_version(const std::string &workloadPath, Manifest &manifest) {
+    TotalVersion++;
+    printf("-----------------------Backing up-----------------------\n");
+    printf("Dedup Task: %s\n", workloadPath.data());
+    struct timeval t0;
+    gettimeofday(&t0, NULL);
+
+    uint64_t taskLength = do_backup(workloadPath);
+
+    finish_version(taskLength, t0, manifest);
+    return taskLength;
+}
+
+// statistics, arrangement and retention of a version whose backup has finished.
+int finish_version(uint64_t taskLength, const struct timeval &t0, Manifest &manifest) {
+    struct timeval t1, at0, at1;
+    gettimeofday(&t1, NULL);
+    uint64_t singleDedup = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
+    printf("[CheckPoint:main] InitTime:%lu, EndTime:%lu\n", t0.tv_sec * 1000000 + t0.tv_usec,
+           t1.tv_sec * 1000000 + t1.tv_usec);
+    printf("Backup duration:%lu us, Backup Size:%lu, Speed:%fMB/s\n", singleDedup, taskLength,
+           (float) taskLength / singleDedup);
+    GlobalReadPipelinePtr->getStatistics();
+    GlobalChunkingPipelinePtr->getStatistics();
+    GlobalHashingPipelinePtr->getStatistics();
+    GlobalDeduplicationPipelinePtr->getStatistics();
+    GlobalWriteFilePipelinePtr->getStatistics();
+    GlobalDurabilityManager.getStatistics();
+    printf("BackupSize:%lu, AfterDedup:%lu, AfterDelta:%lu, AfterCompression:%lu, Total Reduction Ratio:%f\n",
+           GlobalMetadataManagerPtr->getTotalLength(),
+           GlobalMetadataManagerPtr->getAfterDedup(),
+           GlobalMetadataManagerPtr->getAfterDelta(),
+           GlobalMetadataManagerPtr->getAfterCompression(),
+           (float) (GlobalMetadataManagerPtr->getTotalLength()) /
+           (GlobalMetadataManagerPtr->getAfterCompression()));
+
+    printf("----------------------Arrangement------------------------\n");
+    if (FLAGS_ApplyArrangement) {
+        gettimeofday(&at0, NULL);
+        do_arrangement();
+        gettimeofday(&at1, NULL);
+        uint64_t singleArr = (at1.tv_sec - at0.tv_sec) * 1000000 + at1.tv_usec - at0.tv_usec;
+        printf("Arrangement duration : %lu\n", singleArr);
+    } else {
+        printf("Arrangement is disabled by user.\n");
+        manifest.ArrangementFallBehind++;
+    }
+
+    printf("------------------------Retention----------------------\n");
+    if(TotalVersion > RetentionTime){
+        gettimeofday(&at0, NULL);
+        do_delete();
+        gettimeofday(&at1, NULL);
+        printf("Deletion duration : %lu\n", (at1.tv_sec - at0.tv_sec) * 1000000 + at1.tv_usec - at0.tv_usec);
+    }else{
+        printf("Only %lu versions exist, and the retention is %lu, deletion is not required.\n", TotalVersion,
+               RetentionTime);
+    }
+    printf("Peak RSS : %lu KB\n", peak_rss());
+    return 0;
+}
+
+// a checkpoint commits the versions written so far as a new generation: the containers and recipes are made
+// durable first, then the catalog and index snapshots, and the manifest naming them last. a crash at any point
+// leaves the previous generation intact, whatever came after it is collected by recovery.
+int do_checkpoint(Manifest &manifest) {
+    GlobalDurabilityManager.commit();
+    FileOperator::syncDirectory(HomePath + "/storageFiles");
+    FileOperator::syncDirectory(HomePath + "/logicFiles");
+
+    uint64_t previous = manifest.Generation;
+    uint64_t generation = previous + 1;
+    GlobalContainerCatalog.save(generation);
+    GlobalMetadataManagerPtr->save(GetIndexPath(generation));
+
+    manifest.TotalVersion = TotalVersion;
+    manifest.Generation = generation;
+    ManifestWriter manifestWriter(manifest);
+
+    // nothing refers to what the previous generation held alone any more.
+    GlobalContainerCatalog.collect();
+    remove(GetCatalogPath(previous).data());
+    remove(GetIndexPath(previous).data());
+    GlobalMetrics.exportMetrics();
+    return 0;
+}
+
+// the last write task stopped before it committed, its snapshots and data are dropped.
+int do_recover(const Manifest &manifest) {
+    printf("-----------------------Recovery-----------------------\n");
+    printf("The last write task did not finish, collecting what it left after generation %lu\n",
+           manifest.Generation);
+    remove(GetCatalogPath(manifest.Generation + 1).data());
+    remove((GetCatalogPath(manifest.Generation + 1) + ".tmp").data());
+    remove(GetIndexPath(manifest.Generation + 1).data());
+    remove((ManifestPath + ".tmp").data());
+    if (manifest.Generation) {
+        remove(GetCatalogPath(manifest.Generation - 1).data());
+        remove(GetIndexPath(manifest.Generation - 1).data());
+    }
+    GlobalContainerCatalog.recover();
+    return 0;
+}
+
+volatile sig_atomic_t BatchStopFlag = 0;
+
+void batch_stop_handler(int) {
+    BatchStopFlag = 1;
+}
+
+// the next complete line of the batch file, waiting for it in follow mode if wait is set.
+bool read_batch_line(FILE *batchFile, std::string &path, bool wait) {
+    char *line = nullptr;
+    size_t lineCapacity = 0;
+    bool found = false;
+    while (!found) {
+        long lineStart = ftell(batchFile);
+        ssize_t lineLength = getline(&line, &lineCapacity, batchFile);
+        if (lineLength <= 0 || (FLAGS_BatchFollow && line[lineLength - 1] != '\n')) {
+            // nothing more, or a line which is still being appended.
+            clearerr(batchFile);
+            fseek(batchFile, lineStart, SEEK_SET);
+            if (!FLAGS_BatchFollow || !wait || BatchStopFlag) break;
+            sleep(1);
+            continue;
+        }
+        while (lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r')) {
+            line[--lineLength] = '\0';
+        }
+        if (lineLength == 0 || line[0] == '#') continue;
+        path = line;
+        found = true;
+    }
+    free(line);
+    return found;
+}
+
+// backs up every file listed in the batch file, one per line, keeping pipelines and index in memory.
+int do_batch(Manifest &manifest) {
+    FILE *batchFile = fopen(FLAGS_BatchFilePath.data(), "r");
+    if (!batchFile) {
+        printf("Can not open file %s : %s\n", FLAGS_BatchFilePath.data(), strerror(errno));
+        return -1;
+    }
+    signal(SIGINT, batch_stop_handler);
+    signal(SIGTERM, batch_stop_handler);
+
+    uint64_t versions = 0, sinceCheckpoint = 0;
+    struct timeval lastCheckpoint, now;
+    gettimeofday(&lastCheckpoint, NULL);
+    std::string path;
+    BackupTask *current = nullptr, *next = nullptr;
+
+    if (read_batch_line(batchFile, path, true)) {
+        TotalVersion++;
+        current = submit_backup(path, TotalVersion);
+        GlobalDeduplicationPipelinePtr->allowVersion();
+    }
+    while (current) {
+        printf("==================Batch Version %lu==================\n", versions + 1);
+        printf("Dedup Task: %s\n", current->storageTask.path.data());
+        if (FLAGS_BatchPipelining && !BatchStopFlag && read_batch_line(batchFile, path, false)) {
+            // the next version is read, chunked and hashed while this one is deduplicated, written and arranged.
+            // its id is the one left after the retention of this version.
+            uint64_t nextVersion = (TotalVersion > RetentionTime ? TotalVersion - 1 : TotalVersion) + 1;
+            next = submit_backup(path, nextVersion);
+        }
+
+        wait_backup(current);
+        finish_version(current->storageTask.length, current->t0, manifest);
+        delete current;
+        current = nullptr;
+        versions++;
+        sinceCheckpoint++;
+
+        gettimeofday(&now, NULL);
+        if (sinceCheckpoint >= FLAGS_CheckpointVersions ||
+            (uint64_t) (now.tv_sec - lastCheckpoint.tv_sec) >= FLAGS_CheckpointSeconds) {
+            do_checkpoint(manifest);
+            sinceCheckpoint = 0;
+            lastCheckpoint = now;
+        }
+
+        if (next) {
+            TotalVersion++;
+            assert(next->storageTask.fileID == TotalVersion);
+            current = next;
+            next = nullptr;
+            GlobalDeduplicationPipelinePtr->allowVersion();
+        } else if (!BatchStopFlag && read_batch_line(batchFile, path, true)) {
+            TotalVersion++;
+            current = submit_backup(path, TotalVersion);
+            GlobalDeduplicationPipelinePtr->allowVersion();
+        }
+    }
+    fclose(batchFile);
+    printf("Batch finished, %lu versions backed up\n", versions);
+    return 0;
+}
+
 int main(int argc, char **argv) {
     gflags::ParseCommandLineFlags(&argc, &argv, true);
+    int streamFd = -1;
+    if (FLAGS_task == "restore-stream" && (FLAGS_RestorePath.empty() || FLAGS_RestorePath == "-")) {
+        // the restored data owns stdout, messages go to stderr.
+        streamFd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    GlobalMetrics.startReporter();
     std::string statusStr("status");
     std::string restoreStr("restore");
+    std::string restoreRangeStr("restore-range");
+    std::string restoreStreamStr("restore-stream");
     std::string writeStr("write");
     std::string batchStr("batch");
     std::string eliminateStr("delete");
+    std::string rebuildIndexStr("rebuild-index");
+    std::string verifyStr("verify");
+    int exitCode = 0;
     DeltaSwitch = FLAGS_delta;
 
     Manifest manifest;
@@ -122,9 +442,28 @@ int main(int argc, char **argv) {
         ConfigReader configReader(FLAGS_ConfigFile);
         ManifestReader manifestReader(&manifest);
         TotalVersion = manifest.TotalVersion;
+        if (GlobalContainerCatalog.load(manifest.Generation)) {
+            return 1;
+        }
+    }
+    if (FLAGS_task != writeStr && FLAGS_task != batchStr) {
+        resolve_chunking(manifest, false);
+    }
+    bool writing = FLAGS_task == writeStr || FLAGS_task == batchStr || FLAGS_task == eliminateStr ||
+                   FLAGS_task == rebuildIndexStr;
+    if (writing) {
+        if (RunMarker::exists()) {
+            do_recover(manifest);
+        }
+        RunMarker::set();
     }
 
-    if (FLAGS_task == writeStr) {
+    if (FLAGS_task == writeStr || FLAGS_task == batchStr) {
+        if (resolve_chunking(manifest, true)) {
+            RunMarker::clear();
+            return 1;
+        }
+        GlobalChunkingProfile.print("Chunking: ");
 
         // pipelines init
         //------------------------------------------------------
@@ -140,68 +479,15 @@ int main(int argc, char **argv) {
         //------------------------------------------------------
 
         if(TotalVersion != 0)
-            GlobalMetadataManagerPtr->load();
-
-        uint64_t dedupDuration = 0, arrDuration = 0;
-        std::string workloadPath = FLAGS_InputFile;
-        uint64_t taskLength = 0;
-
-        {
-            TotalVersion++;
-            printf("-----------------------Backing up-----------------------\n");
-            printf("Dedup Task: %s\n", workloadPath.data());
-            struct timeval t0, t1;
-            gettimeofday(&t0, NULL);
-
-            taskLength = do_backup(workloadPath);
-
-            gettimeofday(&t1, NULL);
-            uint64_t singleDedup = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
-          printf("[CheckPoint:main] InitTime:%lu, EndTime:%lu\n", t0.tv_sec * 1000000 + t0.tv_usec,
-                 t1.tv_sec * 1000000 + t1.tv_usec);
-          dedupDuration += singleDedup;
-          printf("Backup duration:%lu us, Backup Size:%lu, Speed:%fMB/s\n", singleDedup, taskLength,
-                 (float) taskLength / singleDedup);
-          GlobalReadPipelinePtr->getStatistics();
-          GlobalChunkingPipelinePtr->getStatistics();
-          GlobalHashingPipelinePtr->getStatistics();
-          GlobalDeduplicationPipelinePtr->getStatistics();
-          GlobalWriteFilePipelinePtr->getStatistics();
-          printf("BackupSize:%lu, AfterDedup:%lu, AfterDelta:%lu, AfterCompression:%lu, Total Reduction Ratio:%f\n",
-                 GlobalMetadataManagerPtr->getTotalLength(),
-                 GlobalMetadataManagerPtr->getAfterDedup(),
-                 GlobalMetadataManagerPtr->getAfterDelta(),
-                 GlobalMetadataManagerPtr->getAfterCompression(),
-                 (float) (GlobalMetadataManagerPtr->getTotalLength()) /
-                 (GlobalMetadataManagerPtr->getAfterCompression()));
-
-          printf("----------------------Arrangement------------------------\n");
-          if (FLAGS_ApplyArrangement) {
-            gettimeofday(&t0, NULL);
-            do_arrangement();
-            gettimeofday(&t1, NULL);
-            uint64_t singleArr = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
-            arrDuration += singleArr;
-            printf("Arrangement duration : %lu\n", singleArr);
-          } else {
-                printf("Arrangement is disabled by user.\n");
-                manifest.ArrangementFallBehind++;
-            }
+            GlobalMetadataManagerPtr->load(GetIndexPath(manifest.Generation));
 
-            printf("------------------------Retention----------------------\n");
-            if(TotalVersion > RetentionTime){
-                do_delete();
-            }else{
-              printf("Only %lu versions exist, and the retention is %lu, deletion is not required.\n", TotalVersion,
-                     RetentionTime);
-            }
+        if (FLAGS_task == writeStr) {
+            do_version(FLAGS_InputFile, manifest);
+        } else {
+            do_batch(manifest);
         }
 
-      {
-        manifest.TotalVersion = TotalVersion;
-        ManifestWriter manifestWriter(manifest);
-        GlobalMetadataManagerPtr->save();
-      }
+      do_checkpoint(manifest);
 
 //        printf("==============================================\n");
 //        printf("Total deduplication duration:%lu us, Total Size:%lu, Speed:%fMB/s, arrange duration:%lu\n",
@@ -226,34 +512,91 @@ int main(int argc, char **argv) {
 
     }
     else if (FLAGS_task == restoreStr) {
-        do_restore(FLAGS_RestoreRecipe, manifest.ArrangementFallBehind);
+        exitCode = do_restore(FLAGS_RestoreRecipe, manifest.ArrangementFallBehind) != 0;
+    }
+    else if (FLAGS_task == restoreStreamStr) {
+        exitCode = do_restore_stream(FLAGS_RestoreRecipe, manifest.ArrangementFallBehind, FLAGS_RestoreOffset,
+                                     FLAGS_RestoreLength ? FLAGS_RestoreLength : -1, streamFd) != 0;
+    }
+    else if (FLAGS_task == restoreRangeStr) {
+        exitCode = do_restore(FLAGS_RestoreRecipe, manifest.ArrangementFallBehind, FLAGS_RestoreOffset,
+                              FLAGS_RestoreLength ? FLAGS_RestoreLength : -1) != 0;
     }
     else if (FLAGS_task == eliminateStr) {
+        GlobalMetadataManagerPtr = new MetadataManager();
+        if (TotalVersion != 0)
+            GlobalMetadataManagerPtr->load(GetIndexPath(manifest.Generation));
         Eliminator eliminator;
         eliminator.run(TotalVersion);
         TotalVersion--;
-        {
-            manifest.TotalVersion = TotalVersion;
-            ManifestWriter manifestWriter(manifest);
+        do_checkpoint(manifest);
+        delete GlobalMetadataManagerPtr;
+    }
+    else if (FLAGS_task == rebuildIndexStr) {
+        if (!TotalVersion) {
+            printf("No version in storage, nothing to rebuild\n");
+        } else if (manifest.ArrangementFallBehind) {
+            printf("Arrangement falls %lu versions behind, the index can only be rebuilt from an arranged version\n",
+                   manifest.ArrangementFallBehind);
+        } else {
+            GlobalMetadataManagerPtr = new MetadataManager();
+            IndexRebuilder indexRebuilder;
+            if (!indexRebuilder.run(TotalVersion)) {
+                do_checkpoint(manifest);
+            }
+            delete GlobalMetadataManagerPtr;
         }
     }
+    else if (FLAGS_task == verifyStr) {
+        Verifier verifier;
+        exitCode = verifier.run(TotalVersion);
+    }
     else if (FLAGS_task == statusStr) {
         printf("Totally %lu versions stored.\n", manifest.TotalVersion);
+        for (uint64_t i = 1; i <= manifest.TotalVersion; i++) {
+            char recipePath[256];
+            if (!GlobalContainerCatalog.getRecipePath(i, recipePath)) {
+                printf("Version %lu: no recipe\n", i);
+                continue;
+            }
+            RecipeReader recipeReader(recipePath);
+            printf("Version %lu: %lu bytes, %lu chunks, %lu delta chunks\n", i, recipeReader.getTotalSize(),
+                   recipeReader.getChunkCount(), recipeReader.getDeltaCount());
+        }
         printf("Arrangement fall  %lu versions behind.\n", manifest.ArrangementFallBehind);
+        manifest.Chunking.print("Chunking: ");
     }
     else {
         printf("=================================================\n");
         printf("Usage: MeGA [args..]\n");
         printf("1. Write a series of versions into system\n");
-        printf("./MeGA --ConfigFile=[config file] --task=write --InputFile=[backup workload]\n");
+        printf("./MeGA --ConfigFile=[config file] --task=write --InputFile=[backup workload] [--ChunkingProfile=[small, default, large or vm] | --ExpectSize=[bytes] --MinChunkSize=[bytes] --MaxChunkSize=[bytes] --NormalLevel=[0 ~ 4]]\n");
         printf("2. Restore a version of from the system\n");
         printf("./MeGA --ConfigFile=config.toml --task=restore --RestorePath=[where the restored file is to locate] --RestoreRecipe=[which version to restore(1 ~ no. of the last retained version)]\n");
-        printf("3. Check status of the system\n");
+        printf("3. Restore a byte range of a version\n");
+        printf("./MeGA --ConfigFile=config.toml --task=restore-range --RestorePath=[where the restored range is to locate] --RestoreRecipe=[which version] --RestoreOffset=[first byte] --RestoreLength=[bytes]\n");
+        printf("4. Stream a version, or a range of it, in order to stdout or a pipe\n");
+        printf("./MeGA --ConfigFile=config.toml --task=restore-stream --RestoreRecipe=[which version] [--RestorePath=[pipe, default stdout]] [--RestoreOffset=[first byte] --RestoreLength=[bytes]]\n");
+        printf("5. Write every file listed in a batch file in one process\n");
+        printf("./MeGA --ConfigFile=config.toml --task=batch --BatchFilePath=[one workload path per line] [--BatchFollow]\n");
+        printf("6. Rebuild the index from the containers and recipes\n");
+        printf("./MeGA --ConfigFile=config.toml --task=rebuild-index [--RebuildThreads=[threads]]\n");
+        printf("7. Verify the content of every container and that every recipe resolves\n");
+        printf("./MeGA --ConfigFile=config.toml --task=verify [--VerifyThreads=[threads] --VerifyReadRate=[bytes per second] --VerifyCpuPercent=[percent]]\n");
+        printf("8. Check status of the system\n");
         printf("./MeGA --task=status\n");
         printf("--------------------------------------------------\n");
         printf("more information with --help\n");
         printf("=================================================\n");
 
     }
+    if (writing) {
+        RunMarker::clear();
+    }
 
+    GlobalMetrics.stopReporter();
+    GlobalMetrics.exportMetrics();
+    TRACE_DUMP();
+    printf("Peak RSS : %lu KB\n", peak_rss());
+    return exitCode;
 }
\ No newline at end of file